@@ -0,0 +1,641 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include "jrs_client.h"
+#include "jrs_shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// queued requests are sent once the send buffer grows past this
+#define JRS_SEND_THRESHOLD (1 << 20)
+
+struct jrs_slot {
+  uint8_t *tdo;
+  size_t tdo_len;
+  int done;
+  int status;
+};
+
+struct jrs_client {
+  int fd;
+  uint32_t next_id;
+
+  // shared memory transport, NULL on a plain socket
+  struct jrs_shm_control *shm;
+  size_t shm_len;
+
+  // bytes [send_off, send_len) are not sent yet
+  uint8_t *send_buf;
+  size_t send_off;
+  size_t send_len;
+  size_t send_cap;
+
+  // slot i holds the request with id first_id + i - slots_head
+  struct jrs_slot *slots;
+  size_t slots_head;
+  size_t slots_len;
+  size_t slots_cap;
+  uint32_t first_id;
+  // a request failed since the last jrs_sync()
+  int failed;
+
+  // reply being parsed
+  uint8_t header[JRS_REPLY_SIZE];
+  size_t header_got;
+  uint32_t reply_id;
+  size_t payload_len;
+  size_t payload_got;
+  uint8_t recv_buf[1 << 16];
+};
+
+static void put_le32(uint8_t *p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static void put_le64(uint8_t *p, uint64_t value) {
+  put_le32(p, value);
+  put_le32(p + 4, value >> 32);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static jrs_client *jrs_new(int fd) {
+  // partial writes let replies be read while a large payload is sent
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  jrs_client *client = (jrs_client *)calloc(1, sizeof(jrs_client));
+  if (!client) {
+    close(fd);
+    return NULL;
+  }
+  client->fd = fd;
+  client->next_id = 1;
+  client->first_id = 1;
+  return client;
+}
+
+jrs_client *jrs_open(const char *host, uint16_t port) {
+  char service[16];
+  snprintf(service, sizeof(service), "%u", port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *res;
+  if (getaddrinfo(host, service, &hints, &res) != 0) {
+    fprintf(stderr, "jrs: can not resolve %s\n", host);
+    return NULL;
+  }
+
+  int fd = -1;
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    perror("jrs: connect");
+    return NULL;
+  }
+
+  int flags = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+  return jrs_new(fd);
+}
+
+// receive the memfd the server sends after accepting
+static int jrs_shm_attach(jrs_client *client) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int))];
+  } cmsg;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.data;
+  msg.msg_controllen = sizeof(cmsg.data);
+  // the socket is already non-blocking, wait until the server accepted
+  struct pollfd pfd;
+  pfd.fd = client->fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, -1) < 0 || recvmsg(client->fd, &msg, 0) != 1) {
+    fprintf(stderr, "jrs: server did not offer shared memory\n");
+    return -1;
+  }
+  struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+  if (!header || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "jrs: server did not offer shared memory\n");
+    return -1;
+  }
+  int shm_fd;
+  memcpy(&shm_fd, CMSG_DATA(header), sizeof(int));
+
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(shm_fd, &st) == 0) {
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd,
+                0);
+  }
+  close(shm_fd);
+  if (base == MAP_FAILED) {
+    perror("jrs: mmap");
+    return -1;
+  }
+  client->shm = (struct jrs_shm_control *)base;
+  client->shm_len = st.st_size;
+  if (client->shm->magic != JRS_SHM_MAGIC ||
+      client->shm->data_offset + (size_t)client->shm->ring_size * 2 >
+          client->shm_len) {
+    fprintf(stderr, "jrs: bad shared memory layout\n");
+    return -1;
+  }
+  return 0;
+}
+
+jrs_client *jrs_open_unix(const char *path, int use_shm) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "jrs: unix socket path too long: %s\n", path);
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("jrs: socket");
+    return NULL;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("jrs: connect");
+    close(fd);
+    return NULL;
+  }
+
+  jrs_client *client = jrs_new(fd);
+  if (client && use_shm && jrs_shm_attach(client) < 0) {
+    jrs_close(client);
+    return NULL;
+  }
+  return client;
+}
+
+void jrs_close(jrs_client *client) {
+  if (!client) {
+    return;
+  }
+  if (client->shm) {
+    munmap(client->shm, client->shm_len);
+  }
+  close(client->fd);
+  free(client->send_buf);
+  free(client->slots);
+  free(client);
+}
+
+static int jrs_reserve(jrs_client *client, size_t len) {
+  if (client->send_off > 0) {
+    memmove(client->send_buf, &client->send_buf[client->send_off],
+            client->send_len - client->send_off);
+    client->send_len -= client->send_off;
+    client->send_off = 0;
+  }
+  if (client->send_len + len <= client->send_cap) {
+    return 0;
+  }
+  size_t cap = client->send_cap ? client->send_cap : 4096;
+  while (cap < client->send_len + len) {
+    cap *= 2;
+  }
+  uint8_t *buf = (uint8_t *)realloc(client->send_buf, cap);
+  if (!buf) {
+    return -1;
+  }
+  client->send_buf = buf;
+  client->send_cap = cap;
+  return 0;
+}
+
+// queue a request, payload is the concatenation of up to two parts
+static uint32_t jrs_queue(jrs_client *client, uint8_t op, uint8_t flags,
+                          uint64_t arg, uint8_t *tdo, size_t tdo_len,
+                          const uint8_t *part0, const uint8_t *part1,
+                          size_t part_len) {
+  size_t payload_len = (part0 ? part_len : 0) + (part1 ? part_len : 0);
+  if (jrs_reserve(client, JRS_REQUEST_SIZE + payload_len) < 0) {
+    return 0;
+  }
+
+  if (client->slots_len == client->slots_cap) {
+    if (client->slots_head > 0) {
+      // drop retired slots
+      memmove(client->slots, &client->slots[client->slots_head],
+              (client->slots_len - client->slots_head) *
+                  sizeof(struct jrs_slot));
+      client->slots_len -= client->slots_head;
+      client->slots_head = 0;
+    } else {
+      size_t cap = client->slots_cap ? client->slots_cap * 2 : 256;
+      struct jrs_slot *slots = (struct jrs_slot *)realloc(
+          client->slots, cap * sizeof(struct jrs_slot));
+      if (!slots) {
+        return 0;
+      }
+      client->slots = slots;
+      client->slots_cap = cap;
+    }
+  }
+  uint32_t id = client->next_id++;
+  struct jrs_slot *slot = &client->slots[client->slots_len++];
+  slot->tdo = tdo;
+  slot->tdo_len = tdo_len;
+  slot->done = 0;
+  slot->status = JRS_STATUS_OK;
+
+  uint8_t *p = &client->send_buf[client->send_len];
+  p[0] = op;
+  p[1] = flags;
+  p[2] = 0;
+  p[3] = 0;
+  put_le32(&p[4], id);
+  put_le64(&p[8], arg);
+  p += JRS_REQUEST_SIZE;
+  if (part0) {
+    memcpy(p, part0, part_len);
+    p += part_len;
+  }
+  if (part1) {
+    memcpy(p, part1, part_len);
+  }
+  client->send_len += JRS_REQUEST_SIZE + payload_len;
+
+  if (client->send_len - client->send_off >= JRS_SEND_THRESHOLD &&
+      jrs_flush(client) < 0) {
+    return 0;
+  }
+  return id;
+}
+
+static struct jrs_slot *jrs_find(jrs_client *client, uint32_t id) {
+  size_t index = id - client->first_id + client->slots_head;
+  if (id < client->first_id || index >= client->slots_len) {
+    return NULL;
+  }
+  return &client->slots[index];
+}
+
+// parse replies in recv_buf
+static void jrs_parse(jrs_client *client, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    if (client->header_got < JRS_REPLY_SIZE) {
+      size_t n = JRS_REPLY_SIZE - client->header_got;
+      n = n < len ? n : len;
+      memcpy(&client->header[client->header_got], data, n);
+      client->header_got += n;
+      data += n;
+      len -= n;
+      if (client->header_got < JRS_REPLY_SIZE) {
+        return;
+      }
+      client->reply_id = get_le32(&client->header[0]);
+      client->payload_len = get_le32(&client->header[8]);
+      client->payload_got = 0;
+    }
+
+    size_t n = client->payload_len - client->payload_got;
+    n = n < len ? n : len;
+    struct jrs_slot *slot = jrs_find(client, client->reply_id);
+    if (slot && slot->tdo && client->payload_got < slot->tdo_len) {
+      size_t copy = slot->tdo_len - client->payload_got;
+      copy = copy < n ? copy : n;
+      memcpy(&slot->tdo[client->payload_got], data, copy);
+    }
+    client->payload_got += n;
+    data += n;
+    len -= n;
+
+    if (client->payload_got == client->payload_len) {
+      if (slot) {
+        slot->done = 1;
+        slot->status = client->header[4];
+        if (slot->status != JRS_STATUS_OK) {
+          client->failed = 1;
+        }
+      }
+      client->header_got = 0;
+    }
+  }
+}
+
+static uint64_t jrs_load(uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void jrs_store(uint64_t *p, uint64_t value) {
+  __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+// ring the doorbell if the server waits on this ring
+static void jrs_shm_notify(jrs_client *client, struct jrs_shm_ring *ring) {
+  if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+    char byte = 0;
+    if (write(client->fd, &byte, 1) < 0) {
+      // a closed server is noticed while waiting
+    }
+  }
+}
+
+// move queued data into the ring to server and replies out of the ring to
+// client, sleep on the socket if neither can make progress
+static int jrs_shm_poll(jrs_client *client) {
+  struct jrs_shm_control *control = client->shm;
+  struct jrs_shm_ring *tx = &control->ring[JRS_SHM_TO_SERVER];
+  struct jrs_shm_ring *rx = &control->ring[JRS_SHM_TO_CLIENT];
+  uint8_t *base = (uint8_t *)control + control->data_offset;
+  uint8_t *tx_data = base + (size_t)control->ring_size * JRS_SHM_TO_SERVER;
+  uint8_t *rx_data = base + (size_t)control->ring_size * JRS_SHM_TO_CLIENT;
+  size_t size = control->ring_size;
+  int progress = 0;
+
+  size_t unsent = client->send_len - client->send_off;
+  uint64_t head = jrs_load(&tx->head);
+  size_t space = size - (head - jrs_load(&tx->tail));
+  if (unsent && space) {
+    size_t n = unsent < space ? unsent : space;
+    size_t offset = head % size;
+    size_t first = size - offset < n ? size - offset : n;
+    memcpy(&tx_data[offset], &client->send_buf[client->send_off], first);
+    memcpy(tx_data, &client->send_buf[client->send_off + first], n - first);
+    jrs_store(&tx->head, head + n);
+    jrs_shm_notify(client, tx);
+    client->send_off += n;
+    if (client->send_off == client->send_len) {
+      client->send_off = 0;
+      client->send_len = 0;
+    }
+    progress = 1;
+  }
+
+  uint64_t tail = jrs_load(&rx->tail);
+  size_t avail = jrs_load(&rx->head) - tail;
+  if (avail) {
+    size_t offset = tail % size;
+    size_t first = size - offset < avail ? size - offset : avail;
+    jrs_parse(client, &rx_data[offset], first);
+    jrs_parse(client, rx_data, avail - first);
+    jrs_store(&rx->tail, tail + avail);
+    jrs_shm_notify(client, rx);
+    progress = 1;
+  }
+  if (progress) {
+    return 0;
+  }
+
+  // announce the wait, then check again before sleeping
+  unsent = client->send_len - client->send_off;
+  __atomic_store_n(&rx->waiting, 1, __ATOMIC_SEQ_CST);
+  if (unsent) {
+    __atomic_store_n(&tx->waiting, 1, __ATOMIC_SEQ_CST);
+  }
+  if (jrs_load(&rx->head) != jrs_load(&rx->tail) ||
+      (unsent && jrs_load(&tx->head) - jrs_load(&tx->tail) < size)) {
+    return 0;
+  }
+
+  struct pollfd pfd;
+  pfd.fd = client->fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, -1) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  // drain doorbells
+  ssize_t res = read(client->fd, client->recv_buf, sizeof(client->recv_buf));
+  if (res == 0 || (res < 0 && errno != EAGAIN)) {
+    return -1;
+  }
+  return 0;
+}
+
+// send queued data and read replies as they arrive, so that neither side
+// blocks on a full socket
+static int jrs_poll(jrs_client *client) {
+  if (client->shm) {
+    return jrs_shm_poll(client);
+  }
+
+  struct pollfd pfd;
+  pfd.fd = client->fd;
+  size_t unsent = client->send_len - client->send_off;
+  pfd.events = POLLIN | (unsent ? POLLOUT : 0);
+  if (poll(&pfd, 1, -1) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  if (pfd.revents & POLLIN) {
+    ssize_t res = read(client->fd, client->recv_buf, sizeof(client->recv_buf));
+    if (res > 0) {
+      jrs_parse(client, client->recv_buf, res);
+    } else if (res == 0 || errno != EAGAIN) {
+      return -1;
+    }
+  } else if (pfd.revents & (POLLERR | POLLHUP)) {
+    return -1;
+  }
+
+  if ((pfd.revents & POLLOUT) && unsent) {
+    ssize_t res =
+        write(client->fd, &client->send_buf[client->send_off], unsent);
+    if (res < 0) {
+      return errno == EAGAIN ? 0 : -1;
+    }
+    client->send_off += res;
+    if (client->send_off == client->send_len) {
+      client->send_off = 0;
+      client->send_len = 0;
+    }
+  }
+  return 0;
+}
+
+int jrs_flush(jrs_client *client) {
+  while (client->send_len > client->send_off) {
+    if (jrs_poll(client) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void jrs_retire(jrs_client *client) {
+  while (client->slots_head < client->slots_len &&
+         client->slots[client->slots_head].done) {
+    client->slots_head++;
+    client->first_id++;
+  }
+  if (client->slots_head == client->slots_len) {
+    client->slots_head = 0;
+    client->slots_len = 0;
+  }
+}
+
+int jrs_wait(jrs_client *client, uint32_t id) {
+  struct jrs_slot *slot = jrs_find(client, id);
+  if (!slot) {
+    // already retired
+    return id != 0 && id < client->next_id ? 0 : -1;
+  }
+  // slots only move when a request is queued
+  while (!slot->done) {
+    if (jrs_poll(client) < 0) {
+      return -1;
+    }
+  }
+  int status = slot->status;
+  jrs_retire(client);
+  return status == JRS_STATUS_OK ? 0 : -1;
+}
+
+int jrs_sync(jrs_client *client) {
+  while (1) {
+    jrs_retire(client);
+    if (client->slots_head == client->slots_len) {
+      break;
+    }
+    if (jrs_poll(client) < 0) {
+      return -1;
+    }
+  }
+  int failed = client->failed;
+  client->failed = 0;
+  return failed ? -1 : 0;
+}
+
+int jrs_hello(jrs_client *client, uint32_t *version, uint32_t *max_bits) {
+  uint8_t info[8];
+  uint32_t id =
+      jrs_queue(client, JRS_OP_HELLO, 0, 0, info, sizeof(info), NULL, NULL, 0);
+  if (!id || jrs_wait(client, id) < 0) {
+    return -1;
+  }
+  if (version) {
+    *version = get_le32(&info[0]);
+  }
+  if (max_bits) {
+    *max_bits = get_le32(&info[4]);
+  }
+  return 0;
+}
+
+int jrs_program(jrs_client *client, const uint8_t *program, size_t len,
+                uint32_t *exit_code, uint64_t *tdo) {
+  uint8_t result[16];
+  uint32_t id = jrs_queue(client, JRS_OP_PROGRAM, 0, len, result,
+                          sizeof(result), program, NULL, len);
+  if (!id || jrs_wait(client, id) < 0) {
+    return -1;
+  }
+  if (exit_code) {
+    *exit_code = get_le32(&result[0]);
+  }
+  if (tdo) {
+    *tdo = (uint64_t)get_le32(&result[8]) |
+           ((uint64_t)get_le32(&result[12]) << 32);
+  }
+  return 0;
+}
+
+int jrs_dmi(jrs_client *client, const uint8_t *commands, size_t len,
+            uint8_t *data, size_t data_len, uint32_t *completed) {
+  uint8_t *result = (uint8_t *)malloc(4 + data_len);
+  if (!result) {
+    return -1;
+  }
+  memset(result, 0, 4);
+  uint32_t id = jrs_queue(client, JRS_OP_DMI, 0, len, result, 4 + data_len,
+                          commands, NULL, len);
+  int ret = id ? jrs_wait(client, id) : -1;
+  // partial results are kept on failure
+  if (completed) {
+    *completed = get_le32(&result[0]);
+  }
+  if (data && id) {
+    memcpy(data, &result[4], data_len);
+  }
+  free(result);
+  return ret;
+}
+
+uint32_t jrs_reset(jrs_client *client) {
+  return jrs_queue(client, JRS_OP_RESET, 0, 0, NULL, 0, NULL, NULL, 0);
+}
+
+uint32_t jrs_tms(jrs_client *client, const uint8_t *tms, size_t num_bits) {
+  return jrs_queue(client, JRS_OP_TMS, 0, num_bits, NULL, 0, tms, NULL,
+                   (num_bits + 7) / 8);
+}
+
+uint32_t jrs_scan(jrs_client *client, const uint8_t *tdi, uint8_t *tdo,
+                  const uint8_t *mask, size_t num_bits, int flags) {
+  size_t num_bytes = (num_bits + 7) / 8;
+  flags &= JRS_FLAG_FLIP_TMS;
+  if (tdo) {
+    flags |= mask ? JRS_FLAG_TDO_MASK : JRS_FLAG_TDO_ALL;
+  } else {
+    mask = NULL;
+  }
+  return jrs_queue(client, JRS_OP_SCAN, flags, num_bits, tdo,
+                   tdo ? num_bytes : 0, mask, tdi, num_bytes);
+}
+
+uint32_t jrs_fill(jrs_client *client, uint8_t tdi, uint8_t *tdo,
+                  size_t num_bits, int flags) {
+  flags &= JRS_FLAG_FLIP_TMS;
+  if (tdo) {
+    flags |= JRS_FLAG_TDO_ALL;
+  }
+  return jrs_queue(client, JRS_OP_FILL, flags, num_bits, tdo,
+                   tdo ? (num_bits + 7) / 8 : 0, &tdi, NULL, 1);
+}
+
+uint32_t jrs_clock(jrs_client *client, uint64_t cycles) {
+  return jrs_queue(client, JRS_OP_CLOCK, 0, cycles, NULL, 0, NULL, NULL, 0);
+}
+
+uint32_t jrs_set_freq(jrs_client *client, uint64_t freq_mhz) {
+  return jrs_queue(client, JRS_OP_SET_FREQ, 0, freq_mhz, NULL, 0, NULL, NULL,
+                   0);
+}
+
+uint32_t jrs_goto_state(jrs_client *client, int state) {
+  return jrs_queue(client, JRS_OP_GOTO_STATE, 0, state, NULL, 0, NULL, NULL,
+                   0);
+}
@@ -0,0 +1,64 @@
+#ifndef __JRS_CLIENT_H__
+#define __JRS_CLIENT_H__
+
+#include "jrs_protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// client for the native jtag-remote-server protocol
+//
+// Requests are queued in a send buffer and return their id. Queued requests
+// go out when the buffer grows large or on jrs_flush(), jrs_wait() and
+// jrs_sync(). Tdo is written to the buffer given to jrs_scan() when its
+// reply arrives, so the buffer must stay valid until the scan completes.
+//
+// Functions returning int return 0 on success and -1 on error.
+
+typedef struct jrs_client jrs_client;
+
+jrs_client *jrs_open(const char *host, uint16_t port);
+// connect to a server started with -u path, use_shm needs -m as well
+jrs_client *jrs_open_unix(const char *path, int use_shm);
+void jrs_close(jrs_client *client);
+// query server version and largest scan in bits, waits for the reply
+int jrs_hello(jrs_client *client, uint32_t *version, uint32_t *max_bits);
+
+// run a program next to the adapter and wait for it, see jrs_program_op,
+// tdo is that of the last scan, needs server version 3
+int jrs_program(jrs_client *client, const uint8_t *program, size_t len,
+                uint32_t *exit_code, uint64_t *tdo);
+// run a list of risc-v dmi commands and wait for them, see jrs_dmi_op,
+// data_len bytes read by the commands are written to data, completed counts
+// the commands that succeeded, needs server version 4
+int jrs_dmi(jrs_client *client, const uint8_t *commands, size_t len,
+            uint8_t *data, size_t data_len, uint32_t *completed);
+
+uint32_t jrs_reset(jrs_client *client);
+uint32_t jrs_tms(jrs_client *client, const uint8_t *tms, size_t num_bits);
+// tdo is NULL if not wanted, mask is NULL to read every bit
+// flags: JRS_FLAG_FLIP_TMS
+uint32_t jrs_scan(jrs_client *client, const uint8_t *tdi, uint8_t *tdo,
+                  const uint8_t *mask, size_t num_bits, int flags);
+// scan num_bits of a repeated tdi byte, flags as in jrs_scan() but no mask
+uint32_t jrs_fill(jrs_client *client, uint8_t tdi, uint8_t *tdo,
+                  size_t num_bits, int flags);
+uint32_t jrs_clock(jrs_client *client, uint64_t cycles);
+uint32_t jrs_set_freq(jrs_client *client, uint64_t freq_mhz);
+uint32_t jrs_goto_state(jrs_client *client, int state);
+
+// send queued requests
+int jrs_flush(jrs_client *client);
+// wait until a request completes, fails if its status is not ok
+int jrs_wait(jrs_client *client, uint32_t id);
+// wait until every queued request completes
+int jrs_sync(jrs_client *client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef __JRS_PROTOCOL_H__
+#define __JRS_PROTOCOL_H__
+
+// native jtag-remote-server protocol
+//
+// The client sends a stream of requests, each a 16-byte header followed by
+// its payload. Requests are executed in order, but a reply is sent as soon
+// as a request completes: requests without tdo complete when they are
+// handed to the adapter, scans with tdo complete when the tdo is read back.
+// Replies are matched to requests by id.
+//
+// All integers are little endian.
+
+#define JRS_DEFAULT_PORT 2543
+#define JRS_VERSION 4
+
+// largest scan or tms sequence in bits
+#define JRS_MAX_BITS (1u << 26)
+// largest program in bytes
+#define JRS_MAX_PROGRAM_BYTES (1u << 16)
+// largest list of dmi commands in bytes, and largest data they read
+#define JRS_MAX_DMI_BYTES (1u << 24)
+// most tck cycles of one clock request
+#define JRS_MAX_CLOCK_CYCLES (1ull << 32)
+
+#define JRS_REQUEST_SIZE 16
+#define JRS_REPLY_SIZE 12
+
+// request header:
+// 1-byte: op
+// 1-byte: flags
+// 2-byte: zero
+// 4-byte: id
+// 8-byte: arg
+enum jrs_op {
+  // reply payload: 4-byte version, 4-byte JRS_MAX_BITS
+  JRS_OP_HELLO = 0,
+  // goto Test-Logic-Reset
+  JRS_OP_RESET = 1,
+  // arg: number of bits, payload: tms bits
+  JRS_OP_TMS = 2,
+  // arg: number of bits
+  // payload: tdo mask bits if JRS_FLAG_TDO_MASK, then tdi bits
+  // reply payload: tdo bits if JRS_FLAG_TDO_ALL or JRS_FLAG_TDO_MASK,
+  // bits outside the mask are zero
+  JRS_OP_SCAN = 3,
+  // arg: number of tck cycles, up to JRS_MAX_CLOCK_CYCLES
+  JRS_OP_CLOCK = 4,
+  // arg: tck frequency in MHz
+  JRS_OP_SET_FREQ = 5,
+  // arg: target state, same numbering as JtagState
+  JRS_OP_GOTO_STATE = 6,
+  // completes after every earlier request has completed
+  JRS_OP_SYNC = 7,
+  // scan of a repeated byte, since version 2
+  // arg: number of bits, payload: 1-byte tdi value
+  // reply payload: tdo bits if JRS_FLAG_TDO_ALL, JRS_FLAG_TDO_MASK is ignored
+  JRS_OP_FILL = 8,
+  // run a program next to the adapter, since version 3
+  // arg: program length in bytes, payload: program, see jrs_program_op
+  // reply payload: 4-byte exit code, 4-byte number of scans, 8-byte tdo of
+  // the last scan
+  JRS_OP_PROGRAM = 9,
+  // run a list of risc-v dmi commands, since version 4
+  // arg: list length in bytes, payload: commands, see jrs_dmi_op
+  // reply payload: 4-byte number of commands completed, then the data read
+  // by them in order
+  JRS_OP_DMI = 10,
+};
+
+// program instructions, a 1-byte opcode followed by its operands
+//
+// Scans hold up to 64 bits and end in Run-Test/Idle, their tdo is kept for
+// the branches. Targets are byte offsets into the program. Running past the
+// end exits with code 0. A program that runs longer than the server allows
+// or is malformed fails with JRS_STATUS_PROGRAM_ERROR.
+enum jrs_program_op {
+  // 4-byte exit code
+  JRS_PROG_EXIT = 0,
+  // 1-byte number of bits, 8-byte tdi
+  JRS_PROG_IR = 1,
+  JRS_PROG_DR = 2,
+  // 4-byte number of tck cycles in Run-Test/Idle
+  JRS_PROG_RUNTEST = 3,
+  // 8-byte mask, 8-byte value, 4-byte target
+  // jump if tdo & mask is (or is not) value
+  JRS_PROG_BRANCH_EQ = 4,
+  JRS_PROG_BRANCH_NE = 5,
+  // 4-byte target
+  JRS_PROG_JUMP = 6,
+  // 4-byte count, 4-byte timeout in ms or 0 for none
+  // start the loop counter, replacing the previous loop
+  JRS_PROG_LOOP = 7,
+  // 4-byte target
+  // jump while the loop has iterations and time left, else fall through
+  JRS_PROG_NEXT = 8,
+};
+
+enum jrs_flag {
+  // leave Shift-DR/IR on the last bit of a scan
+  JRS_FLAG_FLIP_TMS = 1 << 0,
+  // read back every tdo bit of a scan
+  JRS_FLAG_TDO_ALL = 1 << 1,
+  // read back tdo bits selected by the mask in the payload
+  JRS_FLAG_TDO_MASK = 1 << 2,
+};
+
+// dmi commands, a 1-byte opcode followed by its operands
+//
+// The debug transport module of a RISC-V debug module (spec 0.13) must be
+// the only tap in the chain. Consecutive reads and writes are pipelined,
+// busy responses are retried after a dmireset with more idle cycles.
+// Memory is accessed in 32-bit words. A failed command stops the list with
+// JRS_STATUS_TARGET_ERROR.
+enum jrs_dmi_op {
+  // 1-byte ir length, 4-byte dtmcs instruction, 4-byte dmi instruction
+  // defaults are 5, 0x10 and 0x11
+  JRS_DMI_CONFIG = 0,
+  // 4-byte address, reads 4 bytes
+  JRS_DMI_READ = 1,
+  // 4-byte address, 4-byte data
+  JRS_DMI_WRITE = 2,
+  // 1-byte jrs_dmi_mem, 8-byte address, 4-byte number of words
+  // reads 4 bytes per word
+  JRS_DMI_READ_MEM = 3,
+  // 1-byte jrs_dmi_mem, 8-byte address, 4-byte number of words, then the
+  // words
+  JRS_DMI_WRITE_MEM = 4,
+};
+
+enum jrs_dmi_mem {
+  // system bus access with auto increment
+  JRS_DMI_MEM_SYSBUS = 0,
+  // access memory abstract command, 32-bit addresses only
+  JRS_DMI_MEM_ABSTRACT = 1,
+};
+
+// reply header:
+// 4-byte: id
+// 1-byte: status
+// 3-byte: zero
+// 4-byte: payload length
+enum jrs_status {
+  JRS_STATUS_OK = 0,
+  JRS_STATUS_ADAPTER_ERROR = 1,
+  JRS_STATUS_PROGRAM_ERROR = 2,
+  JRS_STATUS_TARGET_ERROR = 3,
+};
+
+#endif
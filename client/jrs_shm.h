@@ -0,0 +1,42 @@
+#ifndef __JRS_SHM_H__
+#define __JRS_SHM_H__
+
+#include <stdint.h>
+
+// shared memory transport for local clients
+//
+// The server listens on a unix socket. After accepting a client it sends a
+// single byte with a memfd attached (SCM_RIGHTS). The memfd holds a control
+// block followed by two byte rings, one per direction, at data_offset and
+// data_offset + ring_size. Bytes between tail and head may wrap around the
+// end of a ring. The server maps each ring twice back to back so that they
+// are contiguous, libjrsclient maps them once and copies in two parts.
+//
+// head and tail count bytes since the connection was accepted and are only
+// written by the producer and the consumer respectively. A side that has to
+// block sets waiting on the ring, checks again, and waits for a doorbell byte
+// on the unix socket. The other side sends one after it moves head or tail
+// and finds waiting set. Closing the unix socket ends the session.
+
+#define JRS_SHM_MAGIC 0x314d4853 // "SHM1"
+
+#define JRS_SHM_TO_SERVER 0
+#define JRS_SHM_TO_CLIENT 1
+
+struct jrs_shm_ring {
+  uint64_t head;
+  uint64_t tail;
+  uint32_t waiting;
+  // keep rings on separate cache lines
+  uint8_t reserved[44];
+};
+
+struct jrs_shm_control {
+  uint32_t magic;
+  uint32_t ring_size;
+  uint32_t data_offset;
+  uint8_t reserved[52];
+  struct jrs_shm_ring ring[2];
+};
+
+#endif
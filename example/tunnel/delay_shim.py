@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+# Forward a tcp port with an artificial one-way delay, to try the tunnel
+# mode on loopback:
+#
+#   jtag-remote-server -n                       # next to the adapter
+#   python3 delay_shim.py 12543 127.0.0.1:2543 40
+#   jtag-remote-server -x -t 127.0.0.1:12543    # next to vivado
+#
+# Data is delayed in both directions, so the round trip is twice the delay.
+
+import asyncio
+import sys
+
+
+async def pipe(reader, writer, delay):
+    loop = asyncio.get_running_loop()
+    queue = asyncio.Queue()
+
+    async def send():
+        while True:
+            due, data = await queue.get()
+            await asyncio.sleep(max(0, due - loop.time()))
+            if not data:
+                writer.close()
+                return
+            writer.write(data)
+            await writer.drain()
+
+    sender = asyncio.ensure_future(send())
+    while True:
+        data = await reader.read(1 << 16)
+        queue.put_nowait((loop.time() + delay, data))
+        if not data:
+            break
+    await sender
+
+
+async def main():
+    listen_port = int(sys.argv[1])
+    host, port = sys.argv[2].rsplit(':', 1)
+    delay = float(sys.argv[3]) / 1000
+
+    async def handle(client_reader, client_writer):
+        server_reader, server_writer = await asyncio.open_connection(
+            host, int(port))
+        await asyncio.gather(pipe(client_reader, server_writer, delay),
+                             pipe(server_reader, client_writer, delay))
+
+    server = await asyncio.start_server(handle, '127.0.0.1', listen_port)
+    async with server:
+        await server.serve_forever()
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 4:
+        print('Usage: %s LISTEN_PORT HOST:PORT DELAY_MS' % sys.argv[0])
+        sys.exit(1)
+    asyncio.run(main())
@@ -1,10 +1,17 @@
 #include "common.h"
+#include "image.h"
 #include "mpsse.h"
+#include "shm.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <sys/select.h>
+#include <time.h>
 
 driver *adapter = &mpsse_driver;
+thread_local struct ftdi_context *adapter_ftdi = NULL;
 
 JtagState next_state(JtagState cur, int bit) {
   switch (cur) {
@@ -86,6 +93,116 @@ const char *state_to_string(JtagState state) {
   }
 }
 
+// shadow instruction register
+// ir_current: instruction latched by the chain at the last Update-IR
+// ir_pending: instruction shifted in by jtag_ir_scan, latched on Update-IR
+struct IrShadow {
+  bool valid;
+  size_t num_bits;
+  std::vector<uint8_t> value;
+  std::shared_ptr<std::vector<uint8_t>> capture;
+};
+
+static IrShadow ir_current = {};
+static IrShadow ir_pending = {};
+uint64_t ir_cache_hits = 0;
+uint64_t ir_cache_misses = 0;
+
+void jtag_ir_cache_invalidate() {
+  ir_current.valid = false;
+  ir_pending.valid = false;
+}
+
+// follow a single tms transition
+static void ir_cache_track(JtagState from, JtagState to) {
+  if (to == TestLogicReset) {
+    // instruction is reset to a device specific value
+    jtag_ir_cache_invalidate();
+  } else if (to == UpdateIR) {
+    // latch whatever was shifted in, unknown if not shifted by jtag_ir_scan
+    ir_current = ir_pending;
+    ir_pending.valid = false;
+  } else if (to == ShiftIR && from != ShiftIR) {
+    // a new or resumed shift that we can not follow
+    ir_pending.valid = false;
+  }
+}
+
+static bool bits_equal(const uint8_t *a, const uint8_t *b, size_t num_bits) {
+  size_t whole_bytes = num_bits / 8;
+  if (memcmp(a, b, whole_bytes) != 0) {
+    return false;
+  }
+  if (num_bits % 8) {
+    uint8_t mask = (1 << (num_bits % 8)) - 1;
+    return ((a[whole_bytes] ^ b[whole_bytes]) & mask) == 0;
+  }
+  return true;
+}
+
+bool jtag_ir_scan_send(const uint8_t *data, size_t num_bits, IrScan &scan) {
+  size_t num_bytes = (num_bits + 7) / 8;
+  scan.num_bits = num_bits;
+
+  // between shift and update, the next Update-IR latches ir_pending
+  bool before_update = state == Exit1IR || state == PauseIR || state == Exit2IR;
+  IrShadow &loaded = before_update ? ir_pending : ir_current;
+  if (loaded.valid && loaded.num_bits == num_bits &&
+      bits_equal(loaded.value.data(), data, num_bits)) {
+    // instruction already loaded, return the last captured value
+    ir_cache_hits++;
+    dprintf("IR cache hit\n");
+    scan.hit = true;
+    scan.capture = loaded.capture;
+    return true;
+  }
+
+  ir_cache_misses++;
+  scan.hit = false;
+  scan.capture = std::make_shared<std::vector<uint8_t>>();
+  if (!jtag_tms_seq_to(JtagState::ShiftIR)) {
+    return false;
+  }
+  if (!jtag_scan_chain_send(data, num_bits, true, true)) {
+    return false;
+  }
+
+  // latched when passing Update-IR
+  ir_pending.valid = true;
+  ir_pending.num_bits = num_bits;
+  ir_pending.value.assign(data, data + num_bytes);
+  ir_pending.capture = scan.capture;
+  return true;
+}
+
+bool jtag_ir_scan_recv(uint8_t *recv, IrScan &scan) {
+  size_t num_bytes = (scan.num_bits + 7) / 8;
+  if (!scan.hit) {
+    scan.capture->assign(num_bytes, 0);
+    if (!jtag_scan_chain_recv(scan.capture->data(), scan.num_bits, true)) {
+      return false;
+    }
+  }
+
+  if (recv) {
+    if (scan.capture->size() == num_bytes) {
+      memcpy(recv, scan.capture->data(), num_bytes);
+    } else {
+      // capture of the scan that loaded the instruction failed
+      memset(recv, 0, num_bytes);
+    }
+  }
+  return true;
+}
+
+bool jtag_ir_scan(const uint8_t *data, uint8_t *recv, size_t num_bits) {
+  IrScan scan;
+  if (!jtag_ir_scan_send(data, num_bits, scan)) {
+    return false;
+  }
+  return jtag_ir_scan_recv(recv, scan);
+}
+
 bool jtag_goto_tlr() {
   // 11111: Goto Test-Logic-Reset
   uint8_t tms[] = {0x1F};
@@ -102,7 +219,9 @@ bool jtag_tms_seq(const uint8_t *data, size_t num_bits) {
   JtagState new_state = state;
   for (size_t i = 0; i < num_bits; i++) {
     uint8_t bit = (data[i / 8] >> (i % 8)) & 1;
+    JtagState prev_state = new_state;
     new_state = next_state(new_state, bit);
+    ir_cache_track(prev_state, new_state);
   }
   dprintf("JTAG state: %s -> %s\n", state_to_string(state),
           state_to_string(new_state));
@@ -111,6 +230,45 @@ bool jtag_tms_seq(const uint8_t *data, size_t num_bits) {
   return adapter->jtag_tms_seq(data, num_bits);
 }
 
+void copy_bits(uint8_t *dst, size_t dst_pos, const uint8_t *src,
+               size_t src_pos, size_t num_bits) {
+  // bit by bit until destination is byte aligned
+  while (num_bits > 0 && dst_pos % 8) {
+    uint8_t bit = (src[src_pos / 8] >> (src_pos % 8)) & 1;
+    dst[dst_pos / 8] =
+        (dst[dst_pos / 8] & ~(1 << (dst_pos % 8))) | (bit << (dst_pos % 8));
+    dst_pos++;
+    src_pos++;
+    num_bits--;
+  }
+
+  // whole bytes
+  size_t num_bytes = num_bits / 8;
+  uint8_t *d = &dst[dst_pos / 8];
+  const uint8_t *s = &src[src_pos / 8];
+  int shift = src_pos % 8;
+  if (shift == 0) {
+    memcpy(d, s, num_bytes);
+  } else {
+    for (size_t i = 0; i < num_bytes; i++) {
+      d[i] = (s[i] >> shift) | (s[i + 1] << (8 - shift));
+    }
+  }
+  dst_pos += num_bytes * 8;
+  src_pos += num_bytes * 8;
+  num_bits -= num_bytes * 8;
+
+  // rest bits
+  while (num_bits > 0) {
+    uint8_t bit = (src[src_pos / 8] >> (src_pos % 8)) & 1;
+    dst[dst_pos / 8] =
+        (dst[dst_pos / 8] & ~(1 << (dst_pos % 8))) | (bit << (dst_pos % 8));
+    dst_pos++;
+    src_pos++;
+    num_bits--;
+  }
+}
+
 void print_bitvec(const uint8_t *data, size_t bits) {
   if (!debug) {
     return;
@@ -149,6 +307,10 @@ bool jtag_scan_chain(const uint8_t *data, uint8_t *recv, size_t num_bits,
 bool jtag_scan_chain_send(const uint8_t *data, size_t num_bits, bool flip_tms,
                           bool do_read) {
   bits_send += num_bits;
+  if (state == ShiftIR) {
+    // ir_pending is set by jtag_ir_scan after the scan
+    ir_pending.valid = false;
+  }
   dprintf("Write TDI%s %d bits: ", flip_tms ? "+TMS" : "", num_bits);
   print_bitvec(data, num_bits);
   dprintf("\n");
@@ -174,6 +336,29 @@ bool write_full(int fd, const uint8_t *data, size_t count) {
   return true;
 }
 
+bool writev_full(int fd, struct iovec *iov, size_t iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t res = writev(fd, iov, std::min(iovcnt, (size_t)IOV_MAX));
+    if (res <= 0) {
+      return false;
+    }
+
+    // skip fully written iovecs
+    size_t written = res;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return true;
+}
+
 void dprintf(const char *fmt, ...) {
   if (!debug) {
     return;
@@ -186,6 +371,10 @@ void dprintf(const char *fmt, ...) {
 }
 
 bool setup_tcp_server(uint16_t port) {
+  if (unix_socket_path) {
+    return setup_unix_server(unix_socket_path);
+  }
+
   listen_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (listen_fd < 0) {
     perror("socket");
@@ -220,6 +409,41 @@ bool setup_tcp_server(uint16_t port) {
   return true;
 }
 
+bool setup_unix_server(const char *path) {
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Unix socket path too long: %s\n", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    return false;
+  }
+
+  // set non blocking
+  fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+  // remove stale socket from a previous run
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return false;
+  }
+
+  if (listen(listen_fd, 1) == -1) {
+    perror("listen");
+    return false;
+  }
+
+  printf("Listening on unix socket %s%s\n", path,
+         use_shm_transport ? " with shared memory transport" : "");
+  return true;
+}
+
 bool try_accept() {
   struct timeval timeout;
   timeout.tv_sec = 1;
@@ -235,19 +459,74 @@ bool try_accept() {
   if (client_fd > 0) {
     // fcntl(client_fd, F_SETFL, O_NONBLOCK);
 
-    // set nodelay
-    int flags = 1;
-    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags,
-                   sizeof(flags)) < 0) {
-      perror("setsockopt");
+    if (!unix_socket_path) {
+      // set nodelay
+      int flags = 1;
+      if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags,
+                     sizeof(flags)) < 0) {
+        perror("setsockopt");
+      }
+    } else if (use_shm_transport && !shm_attach()) {
+      client_close();
+      return false;
     }
+    // the board may have been power cycled or used by another tool since
+    // the last session, so neither the tap state nor the instruction is known
+    jtag_ir_cache_invalidate();
+    jtag_goto_tlr();
     printf("JTAG debugger attached\n");
     return true;
   }
   return false;
 }
 
+void client_close() {
+  close(client_fd);
+  client_fd = -1;
+  buffer_begin = 0;
+  buffer_end = 0;
+  if (use_shm_transport) {
+    shm_detach();
+  }
+}
+
+bool client_write(const uint8_t *data, size_t count) {
+  struct iovec iov = {(void *)data, count};
+  return client_writev(&iov, 1);
+}
+
+bool client_writev(struct iovec *iov, size_t iovcnt) {
+  if (use_shm_transport) {
+    return shm_writev(iov, iovcnt);
+  }
+  return writev_full(client_fd, iov, iovcnt);
+}
+
+bool client_readable(int timeout_ms) {
+  if (use_shm_transport) {
+    return shm_readable(timeout_ms);
+  }
+  return socket_readable(client_fd, timeout_ms);
+}
+
+bool socket_readable(int fd, int timeout_ms) {
+  struct timeval timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  return select(fd + 1, &rfds, (fd_set *)0, (fd_set *)0, &timeout) > 0;
+}
+
 bool jtag_clock_tck(size_t times) {
+  if (!adapter->jtag_clock_tck) {
+    return true;
+  }
+  if (state == ShiftIR && times > 0) {
+    // zeros are shifted into the instruction
+    jtag_ir_cache_invalidate();
+  }
   bits_send += times;
   return adapter->jtag_clock_tck(times);
 }
@@ -295,29 +574,102 @@ std::vector<Region> analyze_bitbang(const uint8_t *tms, size_t bits,
   return regions;
 }
 
+uint8_t *map_mirrored(int fd, off_t offset, size_t size) {
+  // reserve twice the size, then map the same pages into both halves
+  uint8_t *base = (uint8_t *)mmap(NULL, size * 2, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (mmap(base + size * i, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+      perror("mmap");
+      munmap(base, size * 2);
+      return NULL;
+    }
+  }
+  return base;
+}
+
+int create_memfd(size_t size) {
+#ifdef __linux__
+  int fd = memfd_create("jtag-remote-server", 0);
+#else
+  char name[64];
+  snprintf(name, sizeof(name), "/jtag-remote-server-%d", (int)getpid());
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  shm_unlink(name);
+#endif
+  if (fd < 0) {
+    perror("memfd_create");
+    return -1;
+  }
+  if (ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool setup_socket_buffer(size_t default_size) {
+  size_t size = socket_buffer_size ? socket_buffer_size : default_size;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) / page_size * page_size;
+
+  if (use_shm_transport) {
+    // the ring shared with the client is the receive buffer
+    return shm_setup(size);
+  }
+
+  int fd = create_memfd(size);
+  if (fd < 0) {
+    return false;
+  }
+  uint8_t *base = map_mirrored(fd, 0, size);
+  close(fd);
+  if (!base) {
+    return false;
+  }
+
+  buffer = base;
+  buffer_size = size;
+  buffer_begin = 0;
+  buffer_end = 0;
+  return true;
+}
+
 bool read_socket() {
-  if (buffer_begin > 0 && buffer_end == BUFFER_SIZE) {
-    // buffer is full, move to zero
-    memmove(buffer, &buffer[buffer_begin], buffer_end - buffer_begin);
-    buffer_end -= buffer_begin;
-    buffer_begin = 0;
+  if (adapter->flush && !client_readable(0)) {
+    // about to wait for the client
+    adapter_flush();
+  }
+
+  if (use_shm_transport) {
+    return shm_read();
+  }
+
+  if (buffer_begin >= buffer_size) {
+    // parser moved into the mirror, wrap both offsets
+    buffer_begin -= buffer_size;
+    buffer_end -= buffer_size;
   } else if (buffer_begin == buffer_end) {
     // buffer is empty
     buffer_begin = 0;
     buffer_end = 0;
   }
 
-  if (buffer_end < BUFFER_SIZE) {
+  size_t used = buffer_end - buffer_begin;
+  if (used < buffer_size) {
     // buffer is not full, read something
     ssize_t num_read =
-        read(client_fd, &buffer[buffer_begin], BUFFER_SIZE - buffer_end);
+        read(client_fd, &buffer[buffer_end], buffer_size - used);
     if (num_read == 0) {
       // remote socket closed
       printf("JTAG debugger detached\n");
-      close(client_fd);
-      client_fd = -1;
-      buffer_begin = 0;
-      buffer_end = 0;
+      client_close();
       return false;
     } else if (num_read > 0) {
       buffer_end += num_read;
@@ -441,6 +793,12 @@ void jtag_get_tms_seq(JtagState from, JtagState to, uint8_t &tms,
       tms = 0x3;
       num_bits = 4;
       return;
+    } else if (to == JtagState::ShiftIR) {
+      // a new scan through update-ir and capture-ir 11100, the shorter way
+      // through pause-ir would resume the last one
+      tms = 0x07;
+      num_bits = 5;
+      return;
     } else if (to == JtagState::RunTestIdle) {
       // from exit1-ir to run-test-idle 10
       tms = 0x1;
@@ -453,9 +811,67 @@ void jtag_get_tms_seq(JtagState from, JtagState to, uint8_t &tms,
       tms = 0x1;
       num_bits = 2;
       return;
+    } else if (to == JtagState::ShiftDR) {
+      // a new scan through update-dr and capture-dr 1100
+      tms = 0x3;
+      num_bits = 4;
+      return;
+    }
+  } else if (from == JtagState::PauseIR) {
+    if (to == JtagState::ShiftIR) {
+      // a new scan through update-ir and capture-ir 111100
+      tms = 0x0F;
+      num_bits = 6;
+      return;
+    }
+  } else if (from == JtagState::PauseDR) {
+    if (to == JtagState::ShiftDR) {
+      // a new scan through update-dr and capture-dr 11100
+      tms = 0x07;
+      num_bits = 5;
+      return;
+    }
+  }
+
+  // fallback: breadth first search for the shortest tms path, never
+  // resuming a shift from exit2: every scan goes through capture
+  JtagState prev[16];
+  uint8_t prev_bit[16];
+  bool visited[16] = {};
+  JtagState queue[16];
+  size_t queue_begin = 0, queue_end = 0;
+  visited[from] = true;
+  queue[queue_end++] = from;
+  while (queue_begin < queue_end && !visited[to]) {
+    JtagState cur = queue[queue_begin++];
+    for (int bit = 0; bit < 2; bit++) {
+      JtagState next = next_state(cur, bit);
+      if ((cur == JtagState::Exit2DR && next == JtagState::ShiftDR) ||
+          (cur == JtagState::Exit2IR && next == JtagState::ShiftIR)) {
+        continue;
+      }
+      if (!visited[next]) {
+        visited[next] = true;
+        prev[next] = cur;
+        prev_bit[next] = bit;
+        queue[queue_end++] = next;
+      }
     }
   }
-  assert(false);
+  assert(visited[to]);
+
+  // walk back from target
+  size_t len = 0;
+  for (JtagState cur = to; cur != from; cur = prev[cur]) {
+    len++;
+  }
+  assert(len <= 8);
+  tms = 0;
+  num_bits = len;
+  for (JtagState cur = to; cur != from; cur = prev[cur]) {
+    len--;
+    tms |= prev_bit[cur] << len;
+  }
   return;
 }
 
@@ -470,44 +886,161 @@ bool jtag_tms_seq_to(JtagState to) {
   }
 }
 
-bool adapter_init(enum AdapterTypes adapter_type) { return adapter->init(adapter_type); }
+// kept with the initialized adapter between sessions, so that a client
+// reconnecting does not probe the chain or set the clock again
+static thread_local bool chain_valid = false;
+static thread_local std::vector<uint32_t> chain_devices;
+// tck frequency last set, 0 if unknown
+static thread_local uint64_t adapter_freq_mhz = 0;
 
-bool adapter_deinit() { return adapter->deinit(); }
+bool adapter_init(enum AdapterTypes adapter_type) {
+  chain_valid = false;
+  adapter_freq_mhz = 0;
+  return adapter->init(adapter_type);
+}
+
+bool adapter_deinit() {
+  chain_valid = false;
+  adapter_freq_mhz = 0;
+  return adapter->deinit();
+}
 
 bool adapter_set_tck_freq(uint64_t freq_mhz) {
-  return adapter->set_tck_freq(freq_mhz);
+  if (freq_mhz == adapter_freq_mhz) {
+    return true;
+  }
+  if (!adapter->set_tck_freq(freq_mhz)) {
+    adapter_freq_mhz = 0;
+    return false;
+  }
+  adapter_freq_mhz = freq_mhz;
+  return true;
 }
 
-bool ftdi_read_retry(struct ftdi_context *ftdi, uint8_t *data, size_t len) {
-  int retry = 100;
-  size_t offset = 0;
-  while (offset < len && (retry > 0)) {
-    int res = ftdi_read_data(ftdi, &data[offset], len - offset);
-    if (res < 0) {
-      printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
-             ftdi_get_error_string(ftdi));
-      return false;
-    }
-    offset += res;
-    retry--;
+std::vector<uint32_t> jtag_chain_devices() {
+  if (!chain_valid) {
+    chain_devices = jtag_probe_devices();
+    // probe again next time if nothing answered
+    chain_valid = !chain_devices.empty();
   }
+  return chain_devices;
+}
+
+void jtag_chain_invalidate() { chain_valid = false; }
+
+bool jtag_chain_check() {
+  if (!chain_valid) {
+    return true;
+  }
+  // after reset the first 32 bits out of dr are the idcode of device 0
+  uint8_t zeros[4] = {0};
+  uint8_t read_buffer[4];
+  if (!jtag_goto_tlr() || !jtag_tms_seq_to(JtagState::ShiftDR) ||
+      !jtag_scan_chain(zeros, read_buffer, 32, true, true) ||
+      !jtag_goto_tlr()) {
+    return false;
+  }
+  uint32_t idcode = read_buffer[0] | (read_buffer[1] << 8) |
+                    (read_buffer[2] << 16) | ((uint32_t)read_buffer[3] << 24);
+  if (idcode != chain_devices[0]) {
+    printf("IDCODE changed from 0x%08X to 0x%08X, probing the chain again\n",
+           chain_devices[0], idcode);
+    jtag_chain_invalidate();
+  }
+  return true;
+}
+
+bool adapter_flush() { return adapter->flush ? adapter->flush() : true; }
+
+bool adapter_can_clock_tck() { return adapter->jtag_clock_tck != NULL; }
+
+size_t adapter_max_pending_read_bytes() {
+  return adapter->max_pending_read_bytes ? adapter->max_pending_read_bytes
+                                         : MAX_PENDING_READ_BYTES;
+}
 
-  return offset == len;
+// a usb transfer fails when it makes no progress for this long
+const uint64_t FTDI_TIMEOUT_MS = 5000;
+
+static uint64_t ftdi_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 bool ftdi_write_retry(struct ftdi_context *ftdi, const uint8_t *data, size_t len) {
-  int retry = 100;
+  if (image_recording()) {
+    image_record_write(data, len);
+    return true;
+  }
+  // ftdi_write_data sleeps in libusb until the chunks are written
   size_t offset = 0;
-  while (offset < len && (retry > 0)) {
+  uint64_t deadline = ftdi_now_ms() + FTDI_TIMEOUT_MS;
+  while (offset < len) {
     int res = ftdi_write_data(ftdi, &data[offset], len - offset);
     if (res < 0) {
       printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
              ftdi_get_error_string(ftdi));
       return false;
     }
-    offset += res;
-    retry--;
+    uint64_t now = ftdi_now_ms();
+    if (res > 0) {
+      offset += res;
+      deadline = now + FTDI_TIMEOUT_MS;
+    } else if (now >= deadline) {
+      printf("USB write timed out after %zu of %zu bytes\n", offset, len);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ftdi_read_full(struct ftdi_context *ftdi, uint8_t *data, size_t len) {
+  if (image_recording()) {
+    image_record_read(data, len);
+    return true;
+  }
+  // the transfer is resubmitted by libftdi until len bytes arrive, sleep in
+  // libusb until it completes instead of polling ftdi_read_data
+  struct ftdi_transfer_control *tc = ftdi_read_data_submit(ftdi, data, len);
+  if (!tc) {
+    printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
+           ftdi_get_error_string(ftdi));
+    return false;
   }
 
-  return offset == len;
-}
\ No newline at end of file
+  int offset = tc->offset;
+  uint64_t deadline = ftdi_now_ms() + FTDI_TIMEOUT_MS;
+  while (!tc->completed) {
+    uint64_t now = ftdi_now_ms();
+    if (tc->offset != offset) {
+      offset = tc->offset;
+      deadline = now + FTDI_TIMEOUT_MS;
+    }
+    if (now >= deadline) {
+      printf("USB read timed out after %d of %zu bytes\n", tc->offset, len);
+      ftdi_transfer_data_cancel(tc, NULL);
+      return false;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = (deadline - now) / 1000;
+    timeout.tv_usec = (deadline - now) % 1000 * 1000;
+    if (libusb_handle_events_timeout_completed(ftdi->usb_ctx, &timeout,
+                                               &tc->completed) < 0) {
+      printf("Error @ %s:%d : libusb event handling failed\n", __FILE__,
+             __LINE__);
+      ftdi_transfer_data_cancel(tc, NULL);
+      return false;
+    }
+  }
+
+  // frees tc
+  int res = ftdi_transfer_data_done(tc);
+  if (res < 0 || (size_t)res != len) {
+    printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
+           ftdi_get_error_string(ftdi));
+    return false;
+  }
+  return true;
+}
@@ -6,10 +6,12 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <ftdi.h>
+#include <memory>
 #include <netinet/tcp.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
@@ -42,7 +44,8 @@ enum AdapterTypes {
   Adapter_DigilentHS3,
 };
 
-extern JtagState state;
+// per thread, fanout workers track the state of their own adapter
+extern thread_local JtagState state;
 extern uint64_t bits_send;
 extern uint64_t freq_mhz;
 
@@ -54,6 +57,8 @@ extern enum ftdi_interface ftdi_channel;
 extern bool use_bus_addr;
 extern uint8_t usb_bus_addr;
 extern uint8_t usb_dev_addr;
+// usb serial number to open instead of the first vid/pid match, or NULL
+extern const char *usb_serial;
 
 // jtag state transition
 JtagState next_state(JtagState cur, int bit);
@@ -69,7 +74,20 @@ struct driver {
   bool (*jtag_scan_chain_send)(const uint8_t *data, size_t num_bits,
                                bool flip_tms, bool do_read);
   bool (*jtag_scan_chain_recv)(uint8_t *recv, size_t num_bits, bool flip_tms);
+  // optional: NULL if tck can not be clocked without shifting
   bool (*jtag_clock_tck)(size_t times);
+
+  // optional: send queued work before waiting for the client
+  bool (*flush)();
+  // tdo bytes queued before reading back, 0 for MAX_PENDING_READ_BYTES
+  size_t max_pending_read_bytes;
+
+  // optional: precompiled images, see image.h
+  int image_encoding;
+  // usb bytes read back for the tdo of a scan, and their decoding
+  size_t (*tdo_raw_bytes)(size_t num_bits, bool flip_tms);
+  void (*decode_tdo)(const uint8_t *raw, uint8_t *recv, size_t num_bits,
+                     bool flip_tms);
 };
 
 extern driver *adapter;
@@ -78,6 +96,10 @@ extern driver *adapter;
 bool adapter_init(enum AdapterTypes adapter_type);
 bool adapter_deinit();
 bool adapter_set_tck_freq(uint64_t freq_mhz);
+bool adapter_flush();
+size_t adapter_max_pending_read_bytes();
+// false if jtag_clock_tck does nothing, waits have to be slept instead
+bool adapter_can_clock_tck();
 
 // jtag operations
 bool jtag_tms_seq(const uint8_t *data, size_t num_bits);
@@ -92,6 +114,35 @@ void jtag_get_tms_seq(JtagState from, JtagState to, uint8_t &tms,
                       size_t &num_bits);
 bool jtag_tms_seq_to(JtagState to);
 std::vector<uint32_t> jtag_probe_devices();
+// idcodes from jtag_probe_devices, cached until the adapter is initialized
+// again, jtag_chain_invalidate or jtag_chain_check finds another first device
+std::vector<uint32_t> jtag_chain_devices();
+void jtag_chain_invalidate();
+// re-read only the first idcode of a cached chain, leaves the tap in
+// test-logic-reset
+bool jtag_chain_check();
+
+// shadow instruction register
+// tracks the instruction loaded into the chain so that an ir scan that would
+// not change it can be skipped
+extern uint64_t ir_cache_hits;
+extern uint64_t ir_cache_misses;
+bool jtag_ir_scan(const uint8_t *data, uint8_t *recv, size_t num_bits);
+void jtag_ir_cache_invalidate();
+
+// ir scan split into send and recv for batching
+// the captured value is filled on recv and shared with later cache hits
+struct IrScan {
+  bool hit;
+  size_t num_bits;
+  std::shared_ptr<std::vector<uint8_t>> capture;
+};
+bool jtag_ir_scan_send(const uint8_t *data, size_t num_bits, IrScan &scan);
+bool jtag_ir_scan_recv(uint8_t *recv, IrScan &scan);
+
+// copy bit vector, both lsb first
+void copy_bits(uint8_t *dst, size_t dst_pos, const uint8_t *src,
+               size_t src_pos, size_t num_bits);
 
 // debug related
 void print_bitvec(const uint8_t *data, size_t bits);
@@ -99,8 +150,23 @@ void dprintf(const char *fmt, ...);
 
 // tcp replated
 bool write_full(int fd, const uint8_t *data, size_t count);
+bool writev_full(int fd, struct iovec *iov, size_t iovcnt);
+// listens on unix_socket_path instead of the port if set
 bool setup_tcp_server(uint16_t port);
+bool setup_unix_server(const char *path);
 bool try_accept();
+bool socket_readable(int fd, int timeout_ms);
+
+// unix socket to listen on, from -u
+extern const char *unix_socket_path;
+// exchange data through shared memory rings on the unix socket, from -m
+extern bool use_shm_transport;
+
+// client i/o over the socket or the shared memory transport
+bool client_write(const uint8_t *data, size_t count);
+bool client_writev(struct iovec *iov, size_t iovcnt);
+bool client_readable(int timeout_ms);
+void client_close();
 
 // analyze regions from bitbang sequence
 struct Region {
@@ -118,15 +184,30 @@ struct Region {
 std::vector<Region> analyze_bitbang(const uint8_t *tms, size_t bits,
                                     JtagState &cur_state);
 
-// read socket buffer
-const int BUFFER_SIZE = 4096;
-extern uint8_t buffer[BUFFER_SIZE];
+// maximum tdo bytes queued in the adapter before reading back
+const size_t MAX_PENDING_READ_BYTES = 2048;
+
+// socket receive ring, mapped twice back to back so that unparsed bytes
+// buffer[buffer_begin..buffer_end) are always contiguous
+extern uint8_t *buffer;
+extern size_t buffer_size;
 extern size_t buffer_begin;
 extern size_t buffer_end;
+// requested by -s, 0 for the protocol default
+extern size_t socket_buffer_size;
+bool setup_socket_buffer(size_t default_size);
+// map size bytes of fd at offset twice back to back
+uint8_t *map_mirrored(int fd, off_t offset, size_t size);
+int create_memfd(size_t size);
 
 // ftdi helper
-bool ftdi_read_retry(struct ftdi_context *ftdi, uint8_t *data, size_t len);
+// usb traffic is captured by image_record_begin() instead
+// both fail when no byte moves for 5 seconds
 bool ftdi_write_retry(struct ftdi_context *ftdi, const uint8_t *data, size_t len);
+// sleeps until len bytes are read
+bool ftdi_read_full(struct ftdi_context *ftdi, uint8_t *data, size_t len);
+// context of the ftdi based adapters, NULL until init
+extern thread_local struct ftdi_context *adapter_ftdi;
 
 bool read_socket();
 
@@ -0,0 +1,542 @@
+#include "dmi.h"
+#include "jrs_protocol.h"
+
+// access memory, 32-bit
+const uint32_t COMMAND_ACCESS_MEMORY = (2 << 24) | (2 << 20);
+
+const uint32_t SBCS_BUSYERROR = 1 << 22;
+const uint32_t SBCS_READONADDR = 1 << 20;
+const uint32_t SBCS_ACCESS32 = 2 << 17;
+const uint32_t SBCS_AUTOINCREMENT = 1 << 16;
+const uint32_t SBCS_READONDATA = 1 << 15;
+const uint32_t SBCS_ERROR = 7 << 12;
+
+const uint32_t DTMCS_DMIRESET = 1 << 16;
+
+// dmi op field of a scan, and its result
+enum DmiOp {
+  Dmi_Nop = 0,
+  Dmi_Read = 1,
+  Dmi_Write = 2,
+};
+
+enum DmiResult {
+  Dmi_Success = 0,
+  Dmi_Failed = 2,
+  Dmi_Busy = 3,
+};
+
+// busy responses tolerated per batch, each costs a round trip to the adapter
+const int DMI_MAX_RETRIES = 100;
+// words of a memory block retried as a whole
+const size_t DMI_BLOCK_WORDS = 1024;
+
+struct DmiAccess {
+  uint8_t op;
+  uint32_t addr;
+  // written, or read back
+  uint32_t data;
+};
+
+static size_t ir_len = 5;
+static uint32_t ir_dtmcs = 0x10;
+static uint32_t ir_dmi = 0x11;
+// read from dtmcs on first use
+static bool dtm_valid = false;
+static size_t abits;
+static size_t idle_cycles;
+
+static uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+  return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le32(uint8_t *p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+static void set_bits(uint8_t *data, size_t pos, uint64_t value,
+                     size_t num_bits) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = value >> (i * 8);
+  }
+  copy_bits(data, pos, bytes, 0, num_bits);
+}
+
+static uint64_t get_bits(const uint8_t *data, size_t pos, size_t num_bits) {
+  uint8_t bytes[8] = {};
+  copy_bits(bytes, 0, data, pos, num_bits);
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)bytes[i] << (i * 8);
+  }
+  return value;
+}
+
+static bool ir_scan(uint32_t instruction) {
+  uint8_t data[4];
+  put_le32(data, instruction);
+  return jtag_ir_scan(data, NULL, ir_len) &&
+         jtag_tms_seq_to(JtagState::RunTestIdle);
+}
+
+// leaves the dr scan in flight, followed by the idle cycles
+static bool dr_send(const uint8_t *data, size_t num_bits) {
+  if (!jtag_tms_seq_to(JtagState::ShiftDR) ||
+      !jtag_scan_chain_send(data, num_bits, true, true) ||
+      !jtag_tms_seq_to(JtagState::RunTestIdle)) {
+    return false;
+  }
+  return idle_cycles == 0 || jtag_clock_tck(idle_cycles);
+}
+
+static bool dtmcs_scan(uint32_t value, uint32_t *dtmcs) {
+  uint8_t data[4], recv[4];
+  put_le32(data, value);
+  if (!ir_scan(ir_dtmcs) || !dr_send(data, 32) ||
+      !jtag_scan_chain_recv(recv, 32, true)) {
+    return false;
+  }
+  if (dtmcs) {
+    *dtmcs = get_le32(recv);
+  }
+  return true;
+}
+
+static bool dtm_probe() {
+  if (dtm_valid) {
+    return true;
+  }
+  uint32_t dtmcs;
+  idle_cycles = 0;
+  if (!dtmcs_scan(0, &dtmcs)) {
+    return false;
+  }
+  if ((dtmcs & 0xF) != 1) {
+    printf("Unsupported DTM version %d, dtmcs %08x\n", dtmcs & 0xF, dtmcs);
+    return false;
+  }
+  abits = (dtmcs >> 4) & 0x3F;
+  idle_cycles = (dtmcs >> 12) & 7;
+  if (abits == 0 || abits > 32) {
+    printf("Unsupported DMI address width %zu\n", abits);
+    return false;
+  }
+  dprintf("DTM abits %zu idle %zu\n", abits, idle_cycles);
+  dtm_valid = true;
+  return true;
+}
+
+static bool dmi_reset_busy() {
+  // the busy access completes, later ones were dropped
+  idle_cycles += idle_cycles / 10 + 1;
+  dprintf("DMI busy, idle %zu\n", idle_cycles);
+  return dtmcs_scan(DTMCS_DMIRESET, NULL);
+}
+
+static size_t dmi_scan_bits() { return abits + 34; }
+
+static void dmi_encode(uint8_t *data, uint8_t op, uint32_t addr,
+                       uint32_t value) {
+  memset(data, 0, (dmi_scan_bits() + 7) / 8);
+  set_bits(data, 0, op, 2);
+  set_bits(data, 2, value, 32);
+  set_bits(data, 34, addr, abits);
+}
+
+// scan a nop until the access in progress has a result
+static int dmi_collect(DmiAccess &access, int &retries) {
+  uint8_t data[16], recv[16];
+  while (true) {
+    dmi_encode(data, Dmi_Nop, 0, 0);
+    if (!ir_scan(ir_dmi) || !dr_send(data, dmi_scan_bits()) ||
+        !jtag_scan_chain_recv(recv, dmi_scan_bits(), true)) {
+      return JRS_STATUS_ADAPTER_ERROR;
+    }
+    uint8_t result = get_bits(recv, 0, 2);
+    if (result == Dmi_Success) {
+      access.data = get_bits(recv, 2, 32);
+      return JRS_STATUS_OK;
+    }
+    if (result == Dmi_Busy && ++retries <= DMI_MAX_RETRIES) {
+      if (!dmi_reset_busy()) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+      continue;
+    }
+    printf("DMI access to %x failed\n", access.addr);
+    dtmcs_scan(DTMCS_DMIRESET, NULL);
+    return JRS_STATUS_TARGET_ERROR;
+  }
+}
+
+// run accesses in order, scans are sent ahead and each returns the result of
+// the access before it
+static int dmi_batch(DmiAccess *accesses, size_t count) {
+  if (!dtm_probe()) {
+    return JRS_STATUS_ADAPTER_ERROR;
+  }
+  size_t scan_bits = dmi_scan_bits();
+  size_t scan_bytes = (scan_bits + 7) / 8;
+  size_t max_scans =
+      std::max((size_t)2, adapter_max_pending_read_bytes() / scan_bytes);
+  std::vector<uint8_t> recv;
+  uint8_t data[16];
+  int retries = 0;
+
+  size_t done = 0;
+  while (done < count) {
+    size_t num = std::min(count - done, max_scans - 1);
+    if (!ir_scan(ir_dmi)) {
+      return JRS_STATUS_ADAPTER_ERROR;
+    }
+    // a trailing nop returns the result of the last access
+    for (size_t i = 0; i <= num; i++) {
+      if (i < num) {
+        DmiAccess &access = accesses[done + i];
+        dmi_encode(data, access.op, access.addr, access.data);
+      } else {
+        dmi_encode(data, Dmi_Nop, 0, 0);
+      }
+      if (!dr_send(data, scan_bits)) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+    }
+    recv.assign((num + 1) * scan_bytes, 0);
+    for (size_t i = 0; i <= num; i++) {
+      if (!jtag_scan_chain_recv(&recv[i * scan_bytes], scan_bits, true)) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+    }
+
+    // busy is sticky, every access after it was dropped
+    if (get_bits(&recv[0], 0, 2) == Dmi_Busy) {
+      if (++retries > DMI_MAX_RETRIES) {
+        printf("DMI stays busy\n");
+        return JRS_STATUS_TARGET_ERROR;
+      }
+      if (!dmi_reset_busy()) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+      continue;
+    }
+    for (size_t i = 0; i < num; i++) {
+      DmiAccess &access = accesses[done];
+      const uint8_t *result = &recv[(i + 1) * scan_bytes];
+      uint8_t status = get_bits(result, 0, 2);
+      if (status == Dmi_Busy) {
+        if (++retries > DMI_MAX_RETRIES) {
+          printf("DMI stays busy\n");
+          return JRS_STATUS_TARGET_ERROR;
+        }
+        if (!dmi_reset_busy()) {
+          return JRS_STATUS_ADAPTER_ERROR;
+        }
+        int res = dmi_collect(access, retries);
+        if (res != JRS_STATUS_OK) {
+          return res;
+        }
+        done++;
+        break;
+      }
+      if (status != Dmi_Success) {
+        printf("DMI access to %x failed\n", access.addr);
+        dtmcs_scan(DTMCS_DMIRESET, NULL);
+        return JRS_STATUS_TARGET_ERROR;
+      }
+      if (access.op == Dmi_Read) {
+        access.data = get_bits(result, 2, 32);
+      }
+      done++;
+    }
+  }
+  return JRS_STATUS_OK;
+}
+
+int dmi_read(uint32_t addr, uint32_t &value) {
+  DmiAccess access = {Dmi_Read, addr, 0};
+  int res = dmi_batch(&access, 1);
+  value = access.data;
+  return res;
+}
+
+int dmi_write(uint32_t addr, uint32_t value) {
+  DmiAccess access = {Dmi_Write, addr, value};
+  return dmi_batch(&access, 1);
+}
+
+// read or write a block with system bus auto increment
+static int sysbus_block(bool write, uint64_t addr, uint32_t *words,
+                        size_t num_words) {
+  std::vector<DmiAccess> accesses;
+  for (int retry = 0;; retry++) {
+    uint32_t sbcs = SBCS_ACCESS32 | SBCS_AUTOINCREMENT | SBCS_BUSYERROR |
+                    SBCS_ERROR;
+    if (!write) {
+      sbcs |= SBCS_READONADDR | SBCS_READONDATA;
+    }
+    accesses.clear();
+    accesses.push_back({Dmi_Write, DM_SBCS, sbcs});
+    if (addr >> 32) {
+      accesses.push_back({Dmi_Write, DM_SBADDRESS1, (uint32_t)(addr >> 32)});
+    }
+    accesses.push_back({Dmi_Write, DM_SBADDRESS0, (uint32_t)addr});
+    size_t first = accesses.size();
+    for (size_t i = 0; i < num_words; i++) {
+      if (!write && i + 1 == num_words) {
+        // do not read past the block
+        accesses.push_back(
+            {Dmi_Write, DM_SBCS, sbcs & ~(SBCS_READONDATA | SBCS_BUSYERROR | SBCS_ERROR)});
+      }
+      accesses.push_back({write ? (uint8_t)Dmi_Write : (uint8_t)Dmi_Read,
+                          DM_SBDATA0, write ? words[i] : 0});
+    }
+    accesses.push_back({Dmi_Read, DM_SBCS, 0});
+
+    int res = dmi_batch(accesses.data(), accesses.size());
+    if (res != JRS_STATUS_OK) {
+      return res;
+    }
+    sbcs = accesses.back().data;
+    if (sbcs & SBCS_ERROR) {
+      printf("System bus error %d at %llx\n", (sbcs >> 12) & 7,
+             (unsigned long long)addr);
+      dmi_write(DM_SBCS, SBCS_ERROR);
+      return JRS_STATUS_TARGET_ERROR;
+    }
+    if (!(sbcs & SBCS_BUSYERROR)) {
+      if (!write) {
+        for (size_t i = 0, pos = first; i < num_words; i++, pos++) {
+          if (accesses[pos].addr != DM_SBDATA0) {
+            pos++;
+          }
+          words[i] = accesses[pos].data;
+        }
+      }
+      return JRS_STATUS_OK;
+    }
+    // accessed faster than the bus allows, slow down and redo the block
+    if (retry == DMI_MAX_RETRIES) {
+      printf("System bus stays busy at %llx\n", (unsigned long long)addr);
+      return JRS_STATUS_TARGET_ERROR;
+    }
+    idle_cycles += idle_cycles / 10 + 1;
+  }
+}
+
+static int abstract_wait(uint32_t &abstractcs) {
+  for (int retry = 0; abstractcs & ABSTRACTCS_BUSY; retry++) {
+    if (retry == DMI_MAX_RETRIES) {
+      printf("Abstract command stays busy\n");
+      return JRS_STATUS_TARGET_ERROR;
+    }
+    int res = dmi_read(DM_ABSTRACTCS, abstractcs);
+    if (res != JRS_STATUS_OK) {
+      return res;
+    }
+  }
+  if (abstractcs & ABSTRACTCS_CMDERR) {
+    // cleared for the next command
+    dmi_write(DM_ABSTRACTCS, ABSTRACTCS_CMDERR);
+    return JRS_STATUS_TARGET_ERROR;
+  }
+  return JRS_STATUS_OK;
+}
+
+int dmi_command(uint32_t command, uint32_t *cmderr) {
+  DmiAccess accesses[2] = {
+      {Dmi_Write, DM_COMMAND, command},
+      {Dmi_Read, DM_ABSTRACTCS, 0},
+  };
+  int res = dmi_batch(accesses, 2);
+  uint32_t abstractcs = accesses[1].data;
+  if (res == JRS_STATUS_OK) {
+    res = abstract_wait(abstractcs);
+  }
+  if (cmderr) {
+    *cmderr = (abstractcs & ABSTRACTCS_CMDERR) >> 8;
+  }
+  return res;
+}
+
+// one access memory command per word
+static int abstract_block(bool write, uint64_t addr, uint32_t *words,
+                          size_t num_words) {
+  if ((addr + num_words * 4) >> 32) {
+    printf("Abstract memory access needs a 32-bit address\n");
+    return JRS_STATUS_TARGET_ERROR;
+  }
+  for (size_t i = 0; i < num_words; i++) {
+    DmiAccess accesses[4];
+    size_t num = 0;
+    if (write) {
+      accesses[num++] = {Dmi_Write, DM_DATA0, words[i]};
+    }
+    accesses[num++] = {Dmi_Write, DM_DATA1, (uint32_t)addr + (uint32_t)i * 4};
+    accesses[num++] = {Dmi_Write, DM_COMMAND,
+                       COMMAND_ACCESS_MEMORY | (write ? COMMAND_WRITE : 0)};
+    accesses[num++] = {Dmi_Read, DM_ABSTRACTCS, 0};
+    int res = dmi_batch(accesses, num);
+    if (res != JRS_STATUS_OK) {
+      return res;
+    }
+    uint32_t abstractcs = accesses[num - 1].data;
+    res = abstract_wait(abstractcs);
+    if (res == JRS_STATUS_TARGET_ERROR) {
+      printf("Abstract command error %d at %llx\n", (abstractcs >> 8) & 7,
+             (unsigned long long)addr + i * 4);
+    }
+    if (res == JRS_STATUS_OK && !write) {
+      res = dmi_read(DM_DATA0, words[i]);
+    }
+    if (res != JRS_STATUS_OK) {
+      return res;
+    }
+  }
+  return JRS_STATUS_OK;
+}
+
+int dmi_mem(bool write, uint8_t mode, uint64_t addr, uint32_t *words,
+            size_t num_words) {
+  if (!dtm_probe()) {
+    return JRS_STATUS_ADAPTER_ERROR;
+  }
+  for (size_t offset = 0; offset < num_words; offset += DMI_BLOCK_WORDS) {
+    size_t num = std::min(num_words - offset, DMI_BLOCK_WORDS);
+    int res = mode == JRS_DMI_MEM_SYSBUS
+                  ? sysbus_block(write, addr + offset * 4, &words[offset], num)
+                  : abstract_block(write, addr + offset * 4, &words[offset],
+                                   num);
+    if (res != JRS_STATUS_OK) {
+      return res;
+    }
+  }
+  return JRS_STATUS_OK;
+}
+
+// operand bytes after the opcode, not counting written words
+static size_t operand_size(uint8_t op) {
+  switch (op) {
+  case JRS_DMI_CONFIG:
+    return 9;
+  case JRS_DMI_READ:
+    return 4;
+  case JRS_DMI_WRITE:
+    return 8;
+  case JRS_DMI_READ_MEM:
+  case JRS_DMI_WRITE_MEM:
+    return 13;
+  default:
+    return 0;
+  }
+}
+
+// run a batch of reads and writes, appending the data read to reply
+static int run_accesses(std::vector<DmiAccess> &accesses,
+                        std::vector<uint8_t> &reply, uint32_t &completed) {
+  int res = dmi_batch(accesses.data(), accesses.size());
+  if (res != JRS_STATUS_OK) {
+    return res;
+  }
+  for (auto &access : accesses) {
+    if (access.op == Dmi_Read) {
+      reply.resize(reply.size() + 4);
+      put_le32(&reply[reply.size() - 4], access.data);
+    }
+  }
+  completed += accesses.size();
+  accesses.clear();
+  return JRS_STATUS_OK;
+}
+
+int dmi_run(const uint8_t *commands, size_t len, std::vector<uint8_t> &reply,
+            uint32_t &completed) {
+  completed = 0;
+  // consecutive reads and writes are run as one batch
+  std::vector<DmiAccess> accesses;
+  std::vector<uint32_t> words;
+
+  size_t pos = 0;
+  while (pos < len) {
+    uint8_t op = commands[pos];
+    const uint8_t *arg = &commands[pos + 1];
+    size_t size = operand_size(op);
+    if (size == 0 || pos + 1 + size > len) {
+      printf("Bad DMI command at %zu\n", pos);
+      return JRS_STATUS_PROGRAM_ERROR;
+    }
+
+    if (op == JRS_DMI_READ || op == JRS_DMI_WRITE) {
+      if (op == JRS_DMI_READ) {
+        accesses.push_back({Dmi_Read, get_le32(arg), 0});
+      } else {
+        accesses.push_back({Dmi_Write, get_le32(arg), get_le32(&arg[4])});
+      }
+      pos += 1 + size;
+      if (pos == len || (commands[pos] != JRS_DMI_READ &&
+                         commands[pos] != JRS_DMI_WRITE)) {
+        int res = run_accesses(accesses, reply, completed);
+        if (res != JRS_STATUS_OK) {
+          return res;
+        }
+      }
+      continue;
+    }
+
+    if (op == JRS_DMI_CONFIG) {
+      if (arg[0] == 0 || arg[0] > 32) {
+        printf("Bad DMI ir length %d\n", arg[0]);
+        return JRS_STATUS_PROGRAM_ERROR;
+      }
+      ir_len = arg[0];
+      ir_dtmcs = get_le32(&arg[1]);
+      ir_dmi = get_le32(&arg[5]);
+      dtm_valid = false;
+    } else {
+      bool write = op == JRS_DMI_WRITE_MEM;
+      uint8_t mode = arg[0];
+      uint64_t addr = get_le64(&arg[1]);
+      uint32_t num_words = get_le32(&arg[9]);
+      if (mode > JRS_DMI_MEM_ABSTRACT ||
+          (write && num_words * 4ull > len - pos - 1 - size)) {
+        printf("Bad DMI command at %zu\n", pos);
+        return JRS_STATUS_PROGRAM_ERROR;
+      }
+      if (!write && reply.size() + num_words * 4ull > JRS_MAX_DMI_BYTES) {
+        printf("DMI read of %u words too large\n", num_words);
+        return JRS_STATUS_PROGRAM_ERROR;
+      }
+      words.resize(num_words);
+      if (write) {
+        for (size_t i = 0; i < num_words; i++) {
+          words[i] = get_le32(&arg[size + i * 4]);
+        }
+        size += num_words * 4;
+      }
+      int res = dmi_mem(write, mode, addr, words.data(), num_words);
+      if (res != JRS_STATUS_OK) {
+        return res;
+      }
+      if (!write) {
+        size_t old_size = reply.size();
+        reply.resize(old_size + num_words * 4);
+        for (size_t i = 0; i < num_words; i++) {
+          put_le32(&reply[old_size + i * 4], words[i]);
+        }
+      }
+    }
+    pos += 1 + size;
+    completed++;
+  }
+  return JRS_STATUS_OK;
+}
+
+void dmi_reset() { dtm_valid = false; }
@@ -0,0 +1,47 @@
+#ifndef __DMI_H__
+#define __DMI_H__
+
+#include "common.h"
+
+// risc-v debug module access next to the adapter, see jrs_dmi_op for the
+// command encoding
+
+// dmi registers of the debug module
+const uint32_t DM_DATA0 = 0x04;
+const uint32_t DM_DATA1 = 0x05;
+const uint32_t DM_DMCONTROL = 0x10;
+const uint32_t DM_DMSTATUS = 0x11;
+const uint32_t DM_ABSTRACTCS = 0x16;
+const uint32_t DM_COMMAND = 0x17;
+const uint32_t DM_PROGBUF0 = 0x20;
+const uint32_t DM_PROGBUF1 = 0x21;
+const uint32_t DM_SBCS = 0x38;
+const uint32_t DM_SBADDRESS0 = 0x39;
+const uint32_t DM_SBADDRESS1 = 0x3A;
+const uint32_t DM_SBDATA0 = 0x3C;
+
+const uint32_t ABSTRACTCS_BUSY = 1 << 12;
+const uint32_t ABSTRACTCS_CMDERR = 7 << 8;
+// abstract command fields
+const uint32_t COMMAND_POSTEXEC = 1 << 18;
+const uint32_t COMMAND_TRANSFER = 1 << 17;
+const uint32_t COMMAND_WRITE = 1 << 16;
+
+// returns a jrs_status, data read is appended to reply, earlier scans must
+// have been received
+int dmi_run(const uint8_t *commands, size_t len, std::vector<uint8_t> &reply,
+            uint32_t &completed);
+
+// single accesses for the gdb server, return a jrs_status
+int dmi_read(uint32_t addr, uint32_t &value);
+int dmi_write(uint32_t addr, uint32_t value);
+// run an abstract command, cmderr is set on JRS_STATUS_TARGET_ERROR
+int dmi_command(uint32_t command, uint32_t *cmderr);
+// 32-bit words of memory, mode is a jrs_dmi_mem
+int dmi_mem(bool write, uint8_t mode, uint64_t addr, uint32_t *words,
+            size_t num_words);
+
+// forget the dtm parameters, e.g. when the client changes
+void dmi_reset();
+
+#endif
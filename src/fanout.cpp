@@ -0,0 +1,387 @@
+#include "fanout.h"
+#include "image.h"
+#include <condition_variable>
+#include <deque>
+#include <inttypes.h>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// ops queued per adapter before the session waits for it
+const size_t FANOUT_MAX_QUEUED_OPS = 4096;
+
+struct FanoutTarget {
+  std::string name;
+  // usb serial number, or bus and device address
+  std::string serial;
+  uint8_t bus;
+  uint8_t dev;
+};
+
+enum FanoutOpType {
+  Fanout_Init,
+  Fanout_Deinit,
+  Fanout_SetFreq,
+  Fanout_TmsSeq,
+  Fanout_Send,
+  Fanout_Recv,
+  Fanout_Clock,
+  Fanout_Flush,
+  Fanout_Stop,
+};
+
+struct FanoutOp {
+  FanoutOpType type;
+  // shared by all workers
+  std::shared_ptr<std::vector<uint8_t>> data;
+  size_t num_bits;
+  bool flip_tms;
+  bool do_read;
+  uint64_t value;
+};
+
+struct FanoutWorker {
+  FanoutTarget target;
+  std::thread thread;
+
+  // guards the fields below
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<FanoutOp> ops;
+  // tdo of recv ops in order
+  std::deque<std::vector<uint8_t>> results;
+  uint64_t posted = 0;
+  uint64_t completed = 0;
+  // cleared on the first error, later ops are skipped
+  bool ok = true;
+
+  // only used by the session thread
+  bool active = true;
+  uint64_t mismatches = 0;
+};
+
+static driver *base_driver = NULL;
+static std::vector<FanoutTarget> targets;
+static std::vector<std::unique_ptr<FanoutWorker>> workers;
+static enum AdapterTypes fanout_adapter_type;
+
+bool fanout_set_targets(const char *list, driver *base) {
+  targets.clear();
+  std::string rest = list;
+  while (!rest.empty()) {
+    size_t comma = rest.find(',');
+    std::string name = rest.substr(0, comma);
+    rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+
+    FanoutTarget target;
+    target.name = name;
+    unsigned bus, dev;
+    char extra;
+    if (sscanf(name.c_str(), "%u:%u%c", &bus, &dev, &extra) == 2 &&
+        bus <= 255 && dev <= 255) {
+      target.bus = bus;
+      target.dev = dev;
+    } else if (!name.empty()) {
+      target.serial = name;
+    } else {
+      printf("Empty fanout target in %s\n", list);
+      return false;
+    }
+    targets.push_back(target);
+  }
+  if (targets.empty()) {
+    printf("No fanout targets\n");
+    return false;
+  }
+  if (base == &fanout_driver || base->image_encoding == Image_None) {
+    // only local usb adapters can be told apart by bus and serial
+    printf("Fanout needs a usb adapter\n");
+    return false;
+  }
+  base_driver = base;
+  fanout_driver.jtag_clock_tck =
+      base->jtag_clock_tck ? fanout_jtag_clock_tck : NULL;
+  return true;
+}
+
+static bool run_op(FanoutOp &op, std::vector<uint8_t> &tdo) {
+  switch (op.type) {
+  case Fanout_Init:
+    return base_driver->init(fanout_adapter_type);
+  case Fanout_Deinit:
+    return base_driver->deinit();
+  case Fanout_SetFreq:
+    return base_driver->set_tck_freq(op.value);
+  case Fanout_TmsSeq:
+    return base_driver->jtag_tms_seq(op.data->data(), op.num_bits);
+  case Fanout_Send:
+    return base_driver->jtag_scan_chain_send(op.data->data(), op.num_bits,
+                                             op.flip_tms, op.do_read);
+  case Fanout_Recv:
+    return base_driver->jtag_scan_chain_recv(tdo.data(), op.num_bits,
+                                             op.flip_tms);
+  case Fanout_Clock:
+    return base_driver->jtag_clock_tck(op.value);
+  case Fanout_Flush:
+    return base_driver->flush ? base_driver->flush() : true;
+  case Fanout_Stop:
+    break;
+  }
+  return true;
+}
+
+static void worker_thread(FanoutWorker *worker) {
+  bool ok = true;
+  while (true) {
+    std::unique_lock<std::mutex> guard(worker->lock);
+    worker->cond.wait(guard, [worker] { return !worker->ops.empty(); });
+    FanoutOp op = worker->ops.front();
+    worker->ops.pop_front();
+    guard.unlock();
+    // one slot was freed
+    worker->cond.notify_all();
+
+    std::vector<uint8_t> tdo;
+    if (op.type == Fanout_Recv) {
+      tdo.assign((op.num_bits + 7) / 8, 0);
+    }
+    if (ok && !run_op(op, tdo)) {
+      ok = false;
+    }
+
+    guard.lock();
+    worker->ok = ok;
+    if (op.type == Fanout_Recv) {
+      worker->results.push_back(std::move(tdo));
+    }
+    worker->completed++;
+    guard.unlock();
+    worker->cond.notify_all();
+
+    if (op.type == Fanout_Stop) {
+      return;
+    }
+  }
+}
+
+// queue op, returns its sequence number
+static uint64_t post(FanoutWorker *worker, const FanoutOp &op) {
+  std::unique_lock<std::mutex> guard(worker->lock);
+  worker->cond.wait(guard, [worker] {
+    return worker->ops.size() < FANOUT_MAX_QUEUED_OPS;
+  });
+  worker->ops.push_back(op);
+  uint64_t seq = ++worker->posted;
+  guard.unlock();
+  worker->cond.notify_all();
+  return seq;
+}
+
+// wait for op seq, returns whether the adapter is still fine
+static bool wait_done(FanoutWorker *worker, uint64_t seq) {
+  std::unique_lock<std::mutex> guard(worker->lock);
+  worker->cond.wait(guard, [worker, seq] { return worker->completed >= seq; });
+  return worker->ok;
+}
+
+static bool worker_ok(FanoutWorker *worker) {
+  std::lock_guard<std::mutex> guard(worker->lock);
+  return worker->ok;
+}
+
+static std::vector<uint8_t> pop_result(FanoutWorker *worker) {
+  std::unique_lock<std::mutex> guard(worker->lock);
+  worker->cond.wait(guard, [worker] { return !worker->results.empty(); });
+  std::vector<uint8_t> res = std::move(worker->results.front());
+  worker->results.pop_front();
+  return res;
+}
+
+// a failed adapter other than the primary is no longer mirrored
+static bool check_workers() {
+  for (size_t i = 1; i < workers.size(); i++) {
+    FanoutWorker *worker = workers[i].get();
+    if (worker->active && !worker_ok(worker)) {
+      printf("Adapter %s failed, no longer mirrored\n",
+             worker->target.name.c_str());
+      worker->active = false;
+    }
+  }
+  return worker_ok(workers[0].get());
+}
+
+static bool post_all(const FanoutOp &op) {
+  for (auto &worker : workers) {
+    if (worker->active) {
+      post(worker.get(), op);
+    }
+  }
+  return check_workers();
+}
+
+static void stop_worker(FanoutWorker *worker) {
+  FanoutOp op = {};
+  op.type = Fanout_Stop;
+  post(worker, op);
+  worker->thread.join();
+}
+
+bool fanout_init(enum AdapterTypes adapter_type) {
+  fanout_adapter_type = adapter_type;
+  // adapters are opened one by one, each with its own selection
+  bool saved_use_bus_addr = use_bus_addr;
+  uint8_t saved_bus = usb_bus_addr;
+  uint8_t saved_dev = usb_dev_addr;
+  const char *saved_serial = usb_serial;
+
+  bool ok = true;
+  for (size_t i = 0; i < targets.size(); i++) {
+    FanoutTarget &target = targets[i];
+    printf("Fanout adapter %s%s\n", target.name.c_str(),
+           i == 0 ? " (primary)" : "");
+    use_bus_addr = target.serial.empty();
+    usb_bus_addr = target.bus;
+    usb_dev_addr = target.dev;
+    usb_serial = target.serial.empty() ? NULL : target.serial.c_str();
+
+    workers.emplace_back(new FanoutWorker());
+    FanoutWorker *worker = workers.back().get();
+    worker->target = target;
+    worker->thread = std::thread(worker_thread, worker);
+    FanoutOp op = {};
+    op.type = Fanout_Init;
+    if (!wait_done(worker, post(worker, op))) {
+      printf("Failed to initialize adapter %s\n", target.name.c_str());
+      ok = false;
+      break;
+    }
+  }
+
+  use_bus_addr = saved_use_bus_addr;
+  usb_bus_addr = saved_bus;
+  usb_dev_addr = saved_dev;
+  usb_serial = saved_serial;
+
+  if (!ok) {
+    for (auto &worker : workers) {
+      stop_worker(worker.get());
+    }
+    workers.clear();
+  }
+  return ok;
+}
+
+bool fanout_deinit() {
+  FanoutOp op = {};
+  op.type = Fanout_Deinit;
+  post_all(op);
+  for (auto &worker : workers) {
+    if (worker->mismatches) {
+      printf("Adapter %s: %" PRIu64 " TDO mismatches\n",
+             worker->target.name.c_str(), worker->mismatches);
+    }
+    stop_worker(worker.get());
+  }
+  bool ok = workers.empty() || workers[0]->ok;
+  workers.clear();
+  return ok;
+}
+
+bool fanout_set_tck_freq(uint64_t freq_mhz) {
+  FanoutOp op = {};
+  op.type = Fanout_SetFreq;
+  op.value = freq_mhz;
+  return post_all(op);
+}
+
+bool fanout_jtag_tms_seq(const uint8_t *data, size_t num_bits) {
+  FanoutOp op = {};
+  op.type = Fanout_TmsSeq;
+  op.data = std::make_shared<std::vector<uint8_t>>(data,
+                                                   data + (num_bits + 7) / 8);
+  op.num_bits = num_bits;
+  return post_all(op);
+}
+
+bool fanout_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                 bool flip_tms, bool do_read) {
+  FanoutOp op = {};
+  op.type = Fanout_Send;
+  op.data = std::make_shared<std::vector<uint8_t>>(data,
+                                                   data + (num_bits + 7) / 8);
+  op.num_bits = num_bits;
+  op.flip_tms = flip_tms;
+  op.do_read = do_read;
+
+  if (flip_tms) {
+    // workers track their own state
+    JtagState new_state = next_state(state, 1);
+    dprintf("JTAG state: %s -> %s\n", state_to_string(state),
+            state_to_string(new_state));
+    state = new_state;
+  }
+  return post_all(op);
+}
+
+bool fanout_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                 bool flip_tms) {
+  FanoutOp op = {};
+  op.type = Fanout_Recv;
+  op.num_bits = num_bits;
+  op.flip_tms = flip_tms;
+  post_all(op);
+
+  size_t num_bytes = (num_bits + 7) / 8;
+  std::vector<uint8_t> primary = pop_result(workers[0].get());
+  memcpy(recv, primary.data(), num_bytes);
+  for (size_t i = 1; i < workers.size(); i++) {
+    FanoutWorker *worker = workers[i].get();
+    if (!worker->active) {
+      continue;
+    }
+    std::vector<uint8_t> tdo = pop_result(worker);
+    if (!worker_ok(worker)) {
+      continue;
+    }
+    // compare all bits
+    for (size_t bit = 0; bit < num_bits; bit++) {
+      if (((tdo[bit / 8] ^ primary[bit / 8]) >> (bit % 8)) & 1) {
+        if (worker->mismatches++ == 0) {
+          printf("Adapter %s: TDO differs from %s at bit %zu of %zu\n",
+                 worker->target.name.c_str(),
+                 workers[0]->target.name.c_str(), bit, num_bits);
+        }
+        break;
+      }
+    }
+  }
+  return check_workers();
+}
+
+bool fanout_jtag_clock_tck(size_t times) {
+  FanoutOp op = {};
+  op.type = Fanout_Clock;
+  op.value = times;
+  return post_all(op);
+}
+
+bool fanout_flush() {
+  FanoutOp op = {};
+  op.type = Fanout_Flush;
+  return post_all(op);
+}
+
+driver fanout_driver = {
+    .init = fanout_init,
+    .deinit = fanout_deinit,
+    .set_tck_freq = fanout_set_tck_freq,
+    .jtag_tms_seq = fanout_jtag_tms_seq,
+    .jtag_scan_chain_send = fanout_jtag_scan_chain_send,
+    .jtag_scan_chain_recv = fanout_jtag_scan_chain_recv,
+    .jtag_clock_tck = fanout_jtag_clock_tck,
+    .flush = fanout_flush,
+    .max_pending_read_bytes = 0,
+    .image_encoding = Image_None,
+    .tdo_raw_bytes = NULL,
+    .decode_tdo = NULL,
+};
@@ -0,0 +1,29 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include "common.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// mirror jtag operations to several adapters of the same kind, each driven
+// by its own thread, the first one is the primary and provides the tdo
+//
+// targets are separated by commas, each is BUS:DEV or a usb serial number
+bool fanout_set_targets(const char *list, driver *base);
+
+bool fanout_init(enum AdapterTypes adapter_type);
+bool fanout_deinit();
+bool fanout_set_tck_freq(uint64_t freq_mhz);
+
+// jtag functions
+bool fanout_jtag_tms_seq(const uint8_t *data, size_t num_bits);
+bool fanout_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                 bool flip_tms, bool do_read);
+bool fanout_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                 bool flip_tms);
+bool fanout_jtag_clock_tck(size_t times);
+bool fanout_flush();
+
+extern driver fanout_driver;
+
+#endif
@@ -0,0 +1,702 @@
+#include "gdb.h"
+#include "common.h"
+#include "dmi.h"
+#include "jrs_protocol.h"
+#include <inttypes.h>
+#include <string>
+
+// gdb remote serial protocol, the subset needed to debug hart 0 of a risc-v
+// debug module: registers, memory, halt and resume, step and breakpoints
+
+const uint16_t GDB_DEFAULT_PORT = 3333;
+const size_t GDB_SOCKET_BUFFER_SIZE = 1 << 16;
+// largest packet gdb may send, memory is transferred in hex
+const size_t GDB_PACKET_SIZE = 0x4000;
+// a running hart is polled whenever gdb is quiet for this long
+const int GDB_POLL_MS = 50;
+// dmstatus reads before a halt or resume request is given up
+const int GDB_MAX_POLLS = 100;
+
+const uint32_t DMCONTROL_HALTREQ = 1u << 31;
+const uint32_t DMCONTROL_RESUMEREQ = 1 << 30;
+const uint32_t DMCONTROL_DMACTIVE = 1 << 0;
+const uint32_t DMSTATUS_IMPEBREAK = 1 << 22;
+const uint32_t DMSTATUS_ALLRESUMEACK = 1 << 17;
+const uint32_t DMSTATUS_ALLHALTED = 1 << 9;
+
+// access register abstract command
+const uint32_t REG_GPR = 0x1000;
+const uint32_t REG_TSELECT = 0x7A0;
+const uint32_t REG_TDATA1 = 0x7A1;
+const uint32_t REG_TDATA2 = 0x7A2;
+const uint32_t REG_DCSR = 0x7B0;
+const uint32_t REG_DPC = 0x7B1;
+
+const uint64_t DCSR_EBREAKM = 1 << 15;
+const uint64_t DCSR_EBREAKS = 1 << 13;
+const uint64_t DCSR_EBREAKU = 1 << 12;
+const uint64_t DCSR_STEP = 1 << 2;
+
+// mcontrol trigger bits, type and dmode are at the top of tdata1
+const uint64_t MCONTROL_ACTION_DEBUG = 1 << 12;
+const uint64_t MCONTROL_M = 1 << 6;
+const uint64_t MCONTROL_S = 1 << 4;
+const uint64_t MCONTROL_U = 1 << 3;
+const uint64_t MCONTROL_EXECUTE = 1 << 2;
+const uint64_t MCONTROL_STORE = 1 << 1;
+const uint64_t MCONTROL_LOAD = 1 << 0;
+const size_t MAX_TRIGGERS = 32;
+
+const uint32_t EBREAK = 0x00100073;
+const uint32_t C_EBREAK = 0x9002;
+const uint32_t FENCE_I = 0x0000100F;
+
+static const char *const gpr_names[32] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "fp", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+
+struct GdbBreakpoint {
+  uint64_t addr;
+  // instruction size of a software breakpoint
+  int kind;
+  // as requested by gdb
+  bool hardware;
+  // set with a trigger, also software breakpoints without fence.i
+  bool trigger;
+  // replaced instruction, or trigger index
+  uint32_t saved;
+};
+
+// hart halted and probed for the current client
+static bool attached = false;
+static bool running = false;
+static bool no_ack = false;
+static int xlen;
+static uint8_t mem_mode;
+static std::vector<GdbBreakpoint> breakpoints;
+// program buffer words, fence.i needs one and an ebreak
+static uint32_t progbuf_size;
+static bool can_fence_i;
+// memory was written since the hart last ran fence.i
+static bool icache_stale = false;
+
+bool jtag_gdb_init() {
+  if (!setup_socket_buffer(GDB_SOCKET_BUFFER_SIZE)) {
+    return false;
+  }
+  if (!setup_tcp_server(GDB_DEFAULT_PORT)) {
+    return false;
+  }
+
+  printf("Start gdb server at :%d\n", GDB_DEFAULT_PORT);
+  return true;
+}
+
+static bool ok(int status) { return status == JRS_STATUS_OK; }
+
+static void gdb_send(const std::string &data) {
+  uint8_t checksum = 0;
+  for (char c : data) {
+    checksum += (uint8_t)c;
+  }
+  char trailer[4];
+  snprintf(trailer, sizeof(trailer), "#%02x", checksum);
+  std::string packet = "$" + data + trailer;
+  dprintf("gdb <- %s\n", packet.c_str());
+  client_write((const uint8_t *)packet.data(), packet.size());
+}
+
+static std::string to_hex(const uint8_t *data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  std::string res;
+  for (size_t i = 0; i < len; i++) {
+    res += digits[data[i] >> 4];
+    res += digits[data[i] & 0xF];
+  }
+  return res;
+}
+
+static bool from_hex(const char *hex, uint8_t *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned int byte;
+    if (sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+      return false;
+    }
+    data[i] = byte;
+  }
+  return true;
+}
+
+// registers in target order, xlen bits
+static std::string reg_to_hex(uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = value >> (i * 8);
+  }
+  return to_hex(bytes, xlen / 8);
+}
+
+static bool reg_from_hex(const char *hex, uint64_t &value) {
+  uint8_t bytes[8] = {};
+  if (!from_hex(hex, bytes, xlen / 8)) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)bytes[i] << (i * 8);
+  }
+  return true;
+}
+
+static bool reg_access(uint32_t regno, uint64_t &value, bool write) {
+  uint32_t aarsize = xlen == 64 ? 3 : 2;
+  uint32_t command = (aarsize << 20) | COMMAND_TRANSFER | regno;
+  if (write) {
+    command |= COMMAND_WRITE;
+    if (!ok(dmi_write(DM_DATA0, value)) ||
+        (xlen == 64 && !ok(dmi_write(DM_DATA1, value >> 32)))) {
+      return false;
+    }
+  }
+  if (!ok(dmi_command(command, NULL))) {
+    return false;
+  }
+  if (!write) {
+    uint32_t low, high = 0;
+    if (!ok(dmi_read(DM_DATA0, low)) ||
+        (xlen == 64 && !ok(dmi_read(DM_DATA1, high)))) {
+      return false;
+    }
+    value = low | ((uint64_t)high << 32);
+  }
+  return true;
+}
+
+static bool reg_read(uint32_t regno, uint64_t &value) {
+  return reg_access(regno, value, false);
+}
+
+static bool reg_write(uint32_t regno, uint64_t value) {
+  return reg_access(regno, value, true);
+}
+
+// memory is accessed in aligned words
+static bool mem_read(uint64_t addr, uint8_t *data, size_t len) {
+  uint64_t begin = addr & ~(uint64_t)3;
+  uint64_t end = (addr + len + 3) & ~(uint64_t)3;
+  std::vector<uint32_t> words((end - begin) / 4);
+  if (!ok(dmi_mem(false, mem_mode, begin, words.data(), words.size()))) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    size_t offset = addr - begin + i;
+    data[i] = words[offset / 4] >> (offset % 4 * 8);
+  }
+  return true;
+}
+
+static bool mem_write(uint64_t addr, const uint8_t *data, size_t len) {
+  uint64_t begin = addr & ~(uint64_t)3;
+  uint64_t end = (addr + len + 3) & ~(uint64_t)3;
+  std::vector<uint32_t> words((end - begin) / 4);
+  if (words.empty()) {
+    return true;
+  }
+  // keep the bytes around an unaligned range
+  if (addr != begin && !ok(dmi_mem(false, mem_mode, begin, &words[0], 1))) {
+    return false;
+  }
+  if (addr + len != end &&
+      !ok(dmi_mem(false, mem_mode, end - 4, &words.back(), 1))) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    size_t offset = addr - begin + i;
+    uint32_t shift = offset % 4 * 8;
+    words[offset / 4] &= ~(0xFFu << shift);
+    words[offset / 4] |= (uint32_t)data[i] << shift;
+  }
+  icache_stale = true;
+  return ok(dmi_mem(true, mem_mode, begin, words.data(), words.size()));
+}
+
+static bool wait_dmstatus(uint32_t bit) {
+  for (int i = 0; i < GDB_MAX_POLLS; i++) {
+    uint32_t dmstatus;
+    if (!ok(dmi_read(DM_DMSTATUS, dmstatus))) {
+      return false;
+    }
+    if (dmstatus & bit) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool hart_halt() {
+  if (!ok(dmi_write(DM_DMCONTROL, DMCONTROL_HALTREQ | DMCONTROL_DMACTIVE))) {
+    return false;
+  }
+  bool halted = wait_dmstatus(DMSTATUS_ALLHALTED);
+  if (!ok(dmi_write(DM_DMCONTROL, DMCONTROL_DMACTIVE)) || !halted) {
+    printf("Failed to halt hart\n");
+    return false;
+  }
+  running = false;
+  return true;
+}
+
+// run fence.i from the program buffer, so that the hart does not execute
+// instructions from its cache that memory writes replaced
+static bool hart_fence_i() {
+  if (!icache_stale || !can_fence_i) {
+    return true;
+  }
+  uint32_t aarsize = xlen == 64 ? 3 : 2;
+  if (!ok(dmi_write(DM_PROGBUF0, FENCE_I)) ||
+      (progbuf_size >= 2 && !ok(dmi_write(DM_PROGBUF1, EBREAK))) ||
+      !ok(dmi_command((aarsize << 20) | COMMAND_POSTEXEC, NULL))) {
+    printf("Failed to run fence.i\n");
+    return false;
+  }
+  icache_stale = false;
+  return true;
+}
+
+static bool hart_resume(bool step) {
+  uint64_t dcsr;
+  if (!hart_fence_i() || !reg_read(REG_DCSR, dcsr)) {
+    return false;
+  }
+  dcsr = step ? dcsr | DCSR_STEP : dcsr & ~DCSR_STEP;
+  if (!reg_write(REG_DCSR, dcsr) ||
+      !ok(dmi_write(DM_DMCONTROL,
+                    DMCONTROL_RESUMEREQ | DMCONTROL_DMACTIVE))) {
+    return false;
+  }
+  bool resumed = wait_dmstatus(DMSTATUS_ALLRESUMEACK);
+  if (!ok(dmi_write(DM_DMCONTROL, DMCONTROL_DMACTIVE)) || !resumed) {
+    printf("Failed to resume hart\n");
+    return false;
+  }
+  running = true;
+  return true;
+}
+
+static bool gdb_attach() {
+  uint64_t dcsr;
+  uint32_t sbcs, abstractcs, dmstatus;
+  if (!ok(dmi_write(DM_DMCONTROL, DMCONTROL_DMACTIVE)) || !hart_halt()) {
+    return false;
+  }
+  // 64-bit register access fails on rv32
+  xlen = 64;
+  if (!reg_read(REG_GPR + 8, dcsr)) {
+    xlen = 32;
+  }
+  if (!reg_read(REG_DCSR, dcsr) ||
+      !reg_write(REG_DCSR,
+                 dcsr | DCSR_EBREAKM | DCSR_EBREAKS | DCSR_EBREAKU)) {
+    return false;
+  }
+  // sbversion and 32-bit access
+  if (!ok(dmi_read(DM_SBCS, sbcs))) {
+    return false;
+  }
+  mem_mode = (sbcs >> 29) && (sbcs & 4) ? JRS_DMI_MEM_SYSBUS
+                                         : JRS_DMI_MEM_ABSTRACT;
+  if (!ok(dmi_read(DM_ABSTRACTCS, abstractcs)) ||
+      !ok(dmi_read(DM_DMSTATUS, dmstatus))) {
+    return false;
+  }
+  progbuf_size = (abstractcs >> 24) & 0x1F;
+  can_fence_i = progbuf_size >= 2 ||
+                (progbuf_size == 1 && (dmstatus & DMSTATUS_IMPEBREAK));
+  icache_stale = false;
+  printf("Attached to rv%d hart, memory through %s\n", xlen,
+         mem_mode == JRS_DMI_MEM_SYSBUS ? "system bus" : "abstract commands");
+  if (!can_fence_i) {
+    printf("No program buffer for fence.i, software breakpoints use "
+           "triggers\n");
+  }
+  attached = true;
+  return true;
+}
+
+static bool trigger_in_use(uint32_t index) {
+  for (auto &bp : breakpoints) {
+    if (bp.trigger && bp.saved == index) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// replace the instruction with ebreak
+static bool breakpoint_insert_ebreak(GdbBreakpoint &bp) {
+  uint8_t old[4] = {}, ebreak[4];
+  uint32_t insn = bp.kind == 4 ? EBREAK : C_EBREAK;
+  for (int i = 0; i < 4; i++) {
+    ebreak[i] = insn >> (i * 8);
+  }
+  if ((bp.kind != 2 && bp.kind != 4) || !mem_read(bp.addr, old, bp.kind) ||
+      !mem_write(bp.addr, ebreak, bp.kind)) {
+    return false;
+  }
+  bp.saved = old[0] | (old[1] << 8) | (old[2] << 16) | (old[3] << 24);
+  breakpoints.push_back(bp);
+  return true;
+}
+
+static bool breakpoint_insert(bool hardware, uint64_t addr, int kind) {
+  GdbBreakpoint bp = {addr, kind, hardware, true, 0};
+  if (!hardware && can_fence_i) {
+    bp.trigger = false;
+    return breakpoint_insert_ebreak(bp);
+  }
+
+  // first free execute trigger
+  uint64_t type = (uint64_t)2 << (xlen - 4);
+  uint64_t dmode = (uint64_t)1 << (xlen - 5);
+  for (uint32_t index = 0; index < MAX_TRIGGERS; index++) {
+    uint64_t tselect, tdata1;
+    if (!reg_write(REG_TSELECT, index) || !reg_read(REG_TSELECT, tselect) ||
+        tselect != index) {
+      break;
+    }
+    if (trigger_in_use(index) || !reg_read(REG_TDATA1, tdata1) ||
+        (tdata1 >> (xlen - 4)) != 2 ||
+        (tdata1 & (MCONTROL_EXECUTE | MCONTROL_STORE | MCONTROL_LOAD))) {
+      continue;
+    }
+    if (!reg_write(REG_TDATA1, 0) || !reg_write(REG_TDATA2, addr) ||
+        !reg_write(REG_TDATA1, type | dmode | MCONTROL_ACTION_DEBUG |
+                                   MCONTROL_M | MCONTROL_S | MCONTROL_U |
+                                   MCONTROL_EXECUTE)) {
+      return false;
+    }
+    bp.saved = index;
+    breakpoints.push_back(bp);
+    return true;
+  }
+  if (!hardware) {
+    // out of triggers, the cache may still hold the old instruction
+    bp.trigger = false;
+    return breakpoint_insert_ebreak(bp);
+  }
+  return false;
+}
+
+static bool breakpoint_remove(bool hardware, uint64_t addr) {
+  for (auto it = breakpoints.begin(); it != breakpoints.end(); ++it) {
+    if (it->hardware != hardware || it->addr != addr) {
+      continue;
+    }
+    bool res;
+    if (it->trigger) {
+      res = reg_write(REG_TSELECT, it->saved) && reg_write(REG_TDATA1, 0);
+    } else {
+      uint8_t old[4];
+      for (int i = 0; i < 4; i++) {
+        old[i] = it->saved >> (i * 8);
+      }
+      res = mem_write(addr, old, it->kind);
+    }
+    breakpoints.erase(it);
+    return res;
+  }
+  return false;
+}
+
+static std::string target_xml() {
+  std::string xml = "<?xml version=\"1.0\"?>"
+                    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+                    "<target version=\"1.0\"><architecture>riscv:rv" +
+                    std::to_string(xlen) +
+                    "</architecture>"
+                    "<feature name=\"org.gnu.gdb.riscv.cpu\">";
+  std::string bits = std::to_string(xlen);
+  for (int i = 0; i < 32; i++) {
+    xml += std::string("<reg name=\"") + gpr_names[i] + "\" bitsize=\"" +
+           bits + "\" type=\"int\" regnum=\"" + std::to_string(i) + "\"/>";
+  }
+  xml += "<reg name=\"pc\" bitsize=\"" + bits +
+         "\" type=\"code_ptr\" regnum=\"32\"/></feature></target>";
+  return xml;
+}
+
+// gdb register number, x0-x31, pc and then csrs at 65
+static bool gdb_reg_access(size_t regno, uint64_t &value, bool write) {
+  if (regno == 0) {
+    value = 0;
+    return true;
+  }
+  uint32_t number;
+  if (regno < 32) {
+    number = REG_GPR + regno;
+  } else if (regno == 32) {
+    number = REG_DPC;
+  } else if (regno >= 65 && regno < 65 + 0x1000) {
+    number = regno - 65;
+  } else {
+    return false;
+  }
+  return reg_access(number, value, write);
+}
+
+// handle a packet, returns false if no reply is due now
+static bool gdb_handle(const std::string &packet, std::string &reply) {
+  const char *args = packet.c_str() + 1;
+  uint64_t addr;
+  size_t len;
+  reply = "";
+
+  switch (packet[0]) {
+  case '?':
+    reply = "S05";
+    break;
+  case 'g':
+    for (size_t i = 0; i <= 32; i++) {
+      uint64_t value;
+      if (!gdb_reg_access(i, value, false)) {
+        reply = "E01";
+        break;
+      }
+      reply += reg_to_hex(value);
+    }
+    break;
+  case 'G':
+    reply = "OK";
+    for (size_t i = 1; i <= 32; i++) {
+      uint64_t value;
+      if (strlen(args) < (i + 1) * xlen / 4 ||
+          !reg_from_hex(&args[i * xlen / 4], value) ||
+          !gdb_reg_access(i, value, true)) {
+        reply = "E01";
+        break;
+      }
+    }
+    break;
+  case 'p': {
+    uint64_t value;
+    reply = sscanf(args, "%zx", &len) == 1 &&
+                    gdb_reg_access(len, value, false)
+                ? reg_to_hex(value)
+                : "E01";
+    break;
+  }
+  case 'P': {
+    uint64_t value;
+    const char *eq = strchr(args, '=');
+    reply = eq && sscanf(args, "%zx", &len) == 1 &&
+                    reg_from_hex(eq + 1, value) &&
+                    gdb_reg_access(len, value, true)
+                ? "OK"
+                : "E01";
+    break;
+  }
+  case 'm': {
+    if (sscanf(args, "%" SCNx64 ",%zx", &addr, &len) != 2) {
+      reply = "E01";
+      break;
+    }
+    std::vector<uint8_t> data(std::min(len, GDB_PACKET_SIZE / 2));
+    reply = mem_read(addr, data.data(), data.size())
+                ? to_hex(data.data(), data.size())
+                : "E01";
+    break;
+  }
+  case 'M': {
+    const char *colon = strchr(args, ':');
+    if (!colon || sscanf(args, "%" SCNx64 ",%zx", &addr, &len) != 2 ||
+        strlen(colon + 1) < len * 2) {
+      reply = "E01";
+      break;
+    }
+    std::vector<uint8_t> data(len);
+    reply = from_hex(colon + 1, data.data(), len) &&
+                    mem_write(addr, data.data(), len)
+                ? "OK"
+                : "E01";
+    break;
+  }
+  case 'c':
+  case 's':
+    if (sscanf(args, "%" SCNx64, &addr) == 1 && !reg_write(REG_DPC, addr)) {
+      reply = "E01";
+      break;
+    }
+    if (!hart_resume(packet[0] == 's')) {
+      reply = "E01";
+      break;
+    }
+    if (packet[0] == 's' && wait_dmstatus(DMSTATUS_ALLHALTED)) {
+      running = false;
+      reply = "S05";
+      break;
+    }
+    // reply once halted
+    return false;
+  case 'Z':
+  case 'z': {
+    unsigned int type;
+    int kind;
+    if (sscanf(args, "%u,%" SCNx64 ",%x", &type, &addr, &kind) != 3 ||
+        type > 1) {
+      // watchpoints are not supported
+      break;
+    }
+    bool res = packet[0] == 'Z' ? breakpoint_insert(type == 1, addr, kind)
+                                : breakpoint_remove(type == 1, addr);
+    reply = res ? "OK" : "E01";
+    break;
+  }
+  case 'D':
+    while (!breakpoints.empty()) {
+      breakpoint_remove(breakpoints[0].hardware, breakpoints[0].addr);
+    }
+    reply = hart_resume(false) ? "OK" : "E01";
+    break;
+  case 'H':
+    reply = "OK";
+    break;
+  case 'q':
+    if (packet.compare(0, 10, "qSupported") == 0) {
+      char features[128];
+      snprintf(features, sizeof(features),
+               "PacketSize=%zx;qXfer:features:read+;QStartNoAckMode+",
+               GDB_PACKET_SIZE);
+      reply = features;
+    } else if (packet.compare(0, 31, "qXfer:features:read:target.xml:") ==
+               0) {
+      size_t offset;
+      if (sscanf(packet.c_str() + 31, "%zx,%zx", &offset, &len) != 2) {
+        reply = "E01";
+        break;
+      }
+      std::string xml = target_xml();
+      if (offset >= xml.size()) {
+        reply = "l";
+      } else {
+        reply = (offset + len >= xml.size() ? "l" : "m") +
+                xml.substr(offset, len);
+      }
+    } else if (packet == "qAttached") {
+      reply = "1";
+    }
+    break;
+  case 'Q':
+    if (packet == "QStartNoAckMode") {
+      reply = "OK";
+      gdb_send(reply);
+      no_ack = true;
+      return false;
+    }
+    break;
+  }
+  return true;
+}
+
+static void gdb_reset() {
+  // do not leave ebreaks behind in memory
+  if (attached && !running) {
+    while (!breakpoints.empty()) {
+      breakpoint_remove(breakpoints[0].hardware, breakpoints[0].addr);
+    }
+  }
+  breakpoints.clear();
+  attached = false;
+  running = false;
+  no_ack = false;
+  dmi_reset();
+}
+
+// handle complete packets in the buffer
+static bool gdb_parse() {
+  while (buffer_begin < buffer_end) {
+    uint8_t c = buffer[buffer_begin];
+    if (c == 0x03) {
+      // interrupt
+      buffer_begin++;
+      if (running) {
+        gdb_send(hart_halt() ? "S02" : "E01");
+      }
+      continue;
+    }
+    if (c != '$') {
+      // acks and noise
+      buffer_begin++;
+      continue;
+    }
+
+    const uint8_t *begin = &buffer[buffer_begin + 1];
+    const uint8_t *end = (const uint8_t *)memchr(
+        begin, '#', buffer_end - buffer_begin - 1);
+    if (!end || end + 3 > &buffer[buffer_end]) {
+      // wait for the rest
+      return true;
+    }
+    std::string packet((const char *)begin, end - begin);
+    uint8_t checksum = 0;
+    for (char ch : packet) {
+      checksum += (uint8_t)ch;
+    }
+    unsigned int expected;
+    bool good = sscanf((const char *)end + 1, "%2x", &expected) == 1 &&
+                expected == checksum;
+    buffer_begin = end + 3 - buffer;
+    if (!no_ack) {
+      client_write((const uint8_t *)(good ? "+" : "-"), 1);
+    }
+    if (!good || packet.empty()) {
+      continue;
+    }
+
+    dprintf("gdb -> %s\n", packet.c_str());
+    if (packet[0] == 'k') {
+      return false;
+    }
+    std::string reply;
+    if (gdb_handle(packet, reply)) {
+      gdb_send(reply);
+    }
+  }
+  return true;
+}
+
+void jtag_gdb_tick() {
+  if (client_fd >= 0) {
+    if (!attached && !gdb_attach()) {
+      printf("Failed to attach to the debug module\n");
+      gdb_reset();
+      client_close();
+      return;
+    }
+
+    if (running && !client_readable(GDB_POLL_MS)) {
+      uint32_t dmstatus;
+      if (!ok(dmi_read(DM_DMSTATUS, dmstatus))) {
+        gdb_send("E01");
+        running = false;
+      } else if (dmstatus & DMSTATUS_ALLHALTED) {
+        running = false;
+        gdb_send("S05");
+      }
+      return;
+    }
+
+    if (!read_socket()) {
+      gdb_reset();
+      return;
+    }
+    if (!gdb_parse()) {
+      gdb_reset();
+      printf("JTAG debugger detached\n");
+      client_close();
+    }
+  } else {
+    // accept connection
+    try_accept();
+  }
+}
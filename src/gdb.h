@@ -0,0 +1,8 @@
+#ifndef __GDB_H__
+#define __GDB_H__
+
+// gdb remote serial protocol for a risc-v hart behind the debug module
+bool jtag_gdb_init();
+void jtag_gdb_tick();
+
+#endif
@@ -0,0 +1,260 @@
+#include "image.h"
+#include "svf.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static bool recording = false;
+static std::vector<uint8_t> image;
+// offset of the write record still being appended to, 0 for none
+static size_t open_write = 0;
+static JtagState start_state;
+// bytes read from usb so far, and those belonging to checks
+static uint64_t raw_recorded = 0;
+static uint64_t raw_checked = 0;
+
+static void pad_image() {
+  image.resize((image.size() + 7) & ~(size_t)7);
+}
+
+static void close_write() {
+  if (open_write) {
+    pad_image();
+    open_write = 0;
+  }
+}
+
+static void append_record(uint32_t type, uint32_t line, uint64_t length) {
+  close_write();
+  ImageRecord record = {type, line, length};
+  const uint8_t *p = (const uint8_t *)&record;
+  image.insert(image.end(), p, p + sizeof(record));
+}
+
+bool image_recording() { return recording; }
+
+bool image_record_begin() {
+  if (adapter->image_encoding == Image_None) {
+    printf("Adapter does not support images\n");
+    return false;
+  }
+  image.assign(sizeof(ImageHeader), 0);
+  open_write = 0;
+  start_state = state;
+  raw_recorded = 0;
+  raw_checked = 0;
+  recording = true;
+  return true;
+}
+
+void image_record_write(const uint8_t *data, size_t len) {
+  if (!open_write) {
+    append_record(Image_Write, 0, 0);
+    open_write = image.size() - sizeof(ImageRecord);
+  }
+  // consecutive writes are merged
+  ImageRecord *record = (ImageRecord *)&image[open_write];
+  record->length += len;
+  image.insert(image.end(), data, data + len);
+}
+
+void image_record_read(uint8_t *data, size_t len) {
+  memset(data, 0, len);
+  append_record(Image_Read, 0, len);
+  raw_recorded += len;
+}
+
+void image_record_check(uint32_t line, const uint8_t *expected,
+                        const uint8_t *mask, size_t num_bits, bool flip_tms) {
+  ImageCheck check = {};
+  check.flip_tms = flip_tms;
+  check.raw_bytes = adapter->tdo_raw_bytes(num_bits, flip_tms);
+  // scans are received in the order they were read
+  check.raw_offset = raw_checked;
+  raw_checked += check.raw_bytes;
+  assert(raw_checked <= raw_recorded);
+
+  size_t num_bytes = (num_bits + 7) / 8;
+  append_record(Image_Check, line, num_bits);
+  const uint8_t *p = (const uint8_t *)&check;
+  image.insert(image.end(), p, p + sizeof(check));
+  image.insert(image.end(), expected, expected + num_bytes);
+  image.insert(image.end(), mask, mask + num_bytes);
+  pad_image();
+}
+
+void image_record_sleep(uint64_t us) { append_record(Image_Sleep, 0, us); }
+
+bool image_record_end(const char *path, bool xsvf) {
+  // capture commands still buffered by the driver
+  bool ok = adapter_flush();
+  append_record(Image_End, 0, 0);
+  recording = false;
+  if (!ok || !path) {
+    image.clear();
+    return false;
+  }
+
+  ImageHeader *header = (ImageHeader *)image.data();
+  memcpy(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+  header->version = IMAGE_VERSION;
+  header->encoding = adapter->image_encoding;
+  header->start_state = start_state;
+  header->end_state = state;
+  header->xsvf = xsvf;
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  ok = fwrite(image.data(), 1, image.size(), fp) == image.size();
+  if (fclose(fp) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+  printf("Wrote image %s: %zu bytes\n", path, image.size());
+  image.clear();
+  return true;
+}
+
+static bool play(const uint8_t *data, size_t size) {
+  const ImageHeader *header = (const ImageHeader *)data;
+  if (size < sizeof(ImageHeader) ||
+      memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+      header->version == 0 || header->version > IMAGE_VERSION ||
+      header->start_state > UpdateIR ||
+      header->end_state > UpdateIR) {
+    printf("Not an image\n");
+    return false;
+  }
+  if (header->encoding != (uint32_t)adapter->image_encoding || !adapter_ftdi) {
+    printf("Image was compiled for another adapter\n");
+    return false;
+  }
+  const char *location = header->xsvf ? "Offset" : "Line";
+
+  if (!jtag_tms_seq_to((JtagState)header->start_state) || !adapter_flush()) {
+    return false;
+  }
+
+  // bytes read from usb, raw[0] is at raw_base in the stream
+  std::vector<uint8_t> raw;
+  uint64_t raw_base = 0;
+  std::vector<uint8_t> tdo;
+  size_t pos = sizeof(ImageHeader);
+  while (true) {
+    if (pos + sizeof(ImageRecord) > size) {
+      printf("Truncated image\n");
+      return false;
+    }
+    const ImageRecord *record = (const ImageRecord *)&data[pos];
+    const uint8_t *payload = &data[pos + sizeof(ImageRecord)];
+    size_t payload_size = 0;
+    switch (record->type) {
+    case Image_End:
+      state = (JtagState)header->end_state;
+      return true;
+    case Image_Write:
+      payload_size = record->length;
+      break;
+    case Image_Read:
+    case Image_Sleep:
+      break;
+    case Image_Check:
+      payload_size = sizeof(ImageCheck) + (record->length + 7) / 8 * 2;
+      break;
+    default:
+      printf("Unknown image record %u\n", record->type);
+      return false;
+    }
+    if (payload_size > size - pos - sizeof(ImageRecord)) {
+      printf("Truncated image\n");
+      return false;
+    }
+
+    if (record->type == Image_Write) {
+      if (!ftdi_write_retry(adapter_ftdi, payload, record->length)) {
+        printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
+               ftdi_get_error_string(adapter_ftdi));
+        return false;
+      }
+    } else if (record->type == Image_Sleep) {
+      struct timespec ts;
+      ts.tv_sec = record->length / 1000000;
+      ts.tv_nsec = record->length % 1000000 * 1000;
+      while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+      }
+    } else if (record->type == Image_Read) {
+      size_t old_size = raw.size();
+      raw.resize(old_size + record->length);
+      if (!ftdi_read_full(adapter_ftdi, &raw[old_size], record->length)) {
+        return false;
+      }
+    } else {
+      const ImageCheck *check = (const ImageCheck *)payload;
+      size_t num_bits = record->length;
+      const uint8_t *expected = payload + sizeof(ImageCheck);
+      const uint8_t *mask = expected + (num_bits + 7) / 8;
+      if (num_bits == 0 || check->raw_offset < raw_base ||
+          check->raw_bytes !=
+              adapter->tdo_raw_bytes(num_bits, check->flip_tms) ||
+          check->raw_offset + check->raw_bytes > raw_base + raw.size()) {
+        printf("Bad image check\n");
+        return false;
+      }
+
+      tdo.resize((num_bits + 7) / 8);
+      adapter->decode_tdo(&raw[check->raw_offset - raw_base], tdo.data(),
+                          num_bits, check->flip_tms);
+      // drop bytes up to the end of this check
+      size_t consumed = check->raw_offset + check->raw_bytes - raw_base;
+      raw.erase(raw.begin(), raw.begin() + consumed);
+      raw_base += consumed;
+
+      if (!svf_check_tdo(location, record->line, tdo.data(), expected, mask,
+                         num_bits)) {
+        return false;
+      }
+    }
+    pos = (pos + sizeof(ImageRecord) + payload_size + 7) & ~(size_t)7;
+  }
+}
+
+bool image_play(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  printf("Play image %s\n", path);
+
+  struct timeval begin;
+  gettimeofday(&begin, NULL);
+  bool ok = play((const uint8_t *)data, size);
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  if (ok) {
+    printf("Image done in %.3f s\n", (end.tv_sec - begin.tv_sec) +
+                                         (end.tv_usec - begin.tv_usec) / 1e6);
+  }
+
+  if (data) {
+    munmap(data, size);
+  }
+  return ok;
+}
@@ -0,0 +1,81 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "common.h"
+
+// precompiled adapter command images
+//
+// An image holds the usb traffic of a programming sequence as encoded by the
+// adapter driver, and the expected tdo of the scans read back. It is
+// recorded once without hardware and then streamed to the adapter as is.
+// The file is in native byte order and is mapped when played.
+
+const char IMAGE_MAGIC[8] = {'J', 'R', 'S', 'I', 'M', 'G', '\0', '\0'};
+// version 2 added Image_Sleep, older images still play
+const uint32_t IMAGE_VERSION = 2;
+
+// usb command encoding, images only play on a driver with the same encoding
+enum ImageEncoding {
+  Image_None,
+  Image_MPSSE,
+  Image_USBBlaster,
+};
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t encoding;
+  // jtag state before and after the image
+  uint32_t start_state;
+  uint32_t end_state;
+  // checks report an offset instead of a line
+  uint32_t xsvf;
+  uint32_t reserved;
+};
+
+enum ImageRecordType {
+  Image_End,
+  // length bytes of payload written to usb
+  Image_Write,
+  // length bytes read from usb
+  Image_Read,
+  // tdo of a scan of length bits, payload is ImageCheck
+  Image_Check,
+  // wait length microseconds, for adapters that can not clock tck alone
+  Image_Sleep,
+};
+
+// records follow the header, payloads are padded to 8 bytes
+struct ImageRecord {
+  uint32_t type;
+  // source line or offset of checks
+  uint32_t line;
+  uint64_t length;
+};
+
+// followed by expected tdo and mask, each (length + 7) / 8 bytes
+struct ImageCheck {
+  uint32_t flip_tms;
+  uint32_t reserved;
+  // bytes read from usb that hold the tdo, offset counts all reads
+  uint64_t raw_offset;
+  uint64_t raw_bytes;
+};
+
+// capture usb traffic of the adapter instead of sending it
+bool image_record_begin();
+bool image_record_end(const char *path, bool xsvf);
+bool image_recording();
+// called by the ftdi helpers while recording, reads return zeros
+void image_record_write(const uint8_t *data, size_t len);
+void image_record_read(uint8_t *data, size_t len);
+// expected tdo of the last scan received
+void image_record_check(uint32_t line, const uint8_t *expected,
+                        const uint8_t *mask, size_t num_bits, bool flip_tms);
+// wait after the writes recorded so far
+void image_record_sleep(uint64_t us);
+
+// stream an image to the adapter and verify the checks
+bool image_play(const char *path);
+
+#endif
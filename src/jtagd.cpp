@@ -1,9 +1,15 @@
 #include "common.h"
+#include "sld.h"
 #include <deque>
-#include <map>
 #include <string>
 
+// socket receive ring, fifo data waits here while the fifo is full
+const size_t JTAGD_SOCKET_BUFFER_SIZE = 1 << 18;
+
 bool jtag_jtagd_init() {
+  if (!setup_socket_buffer(JTAGD_SOCKET_BUFFER_SIZE)) {
+    return false;
+  }
   if (!setup_tcp_server(1309)) {
     return false;
   }
@@ -18,32 +24,90 @@ bool jtag_jtagd_init() {
 // String: 1-byte length, then the string content
 // Integer: 4-byte, big endian
 
-uint8_t send_buffer[BUFFER_SIZE];
-uint8_t send_buffer_size;
+// Replies are built as a list of spans and sent with writev: header and
+// scalar fields are stored in reply_arena, payloads such as tdo are
+// referenced in place and must stay valid until reply_flush()
+const size_t MAX_PACKET_LENGTH = 1 << 12;
+
+struct ReplySpan {
+  // NULL for bytes in reply_arena
+  const uint8_t *data;
+  size_t offset;
+  size_t length;
+};
+
+std::vector<uint8_t> reply_arena;
+std::vector<ReplySpan> reply_spans;
+bool packet_open = false;
+size_t packet_header;
+size_t packet_length;
+
+// when set, replies are appended here instead, used to hold replies
+std::vector<uint8_t> *reply_capture = NULL;
+
+void do_send(uint16_t mux);
+
+void open_packet() {
+  if (!packet_open) {
+    // header will be filled in do_send
+    packet_header = reply_arena.size();
+    reply_arena.resize(reply_arena.size() + 2);
+    reply_spans.push_back(ReplySpan{NULL, packet_header, 2});
+    packet_open = true;
+    packet_length = 0;
+  }
+}
+
+void add_bytes(const void *data, size_t length) {
+  if (reply_capture) {
+    reply_capture->insert(reply_capture->end(), (const uint8_t *)data,
+                          (const uint8_t *)data + length);
+    return;
+  }
+
+  open_packet();
+  assert(packet_length + length <= MAX_PACKET_LENGTH);
+  ReplySpan &last = reply_spans.back();
+  if (last.data == NULL && last.offset + last.length == reply_arena.size()) {
+    last.length += length;
+  } else {
+    reply_spans.push_back(ReplySpan{NULL, reply_arena.size(), length});
+  }
+  reply_arena.insert(reply_arena.end(), (const uint8_t *)data,
+                     (const uint8_t *)data + length);
+  packet_length += length;
+}
 
 // jtag_message.h TXMESSAGE::add_string
 void add_string(const char *data, size_t length) {
   assert(length <= 0xff);
-  assert(send_buffer_size + 1 + length <= BUFFER_SIZE);
-  send_buffer[send_buffer_size++] = length;
-  memcpy(&send_buffer[send_buffer_size], data, length);
-  send_buffer_size += length;
+  uint8_t len = length;
+  add_bytes(&len, 1);
+  add_bytes(data, length);
 }
 
 void add_string(const std::string &s) { add_string(s.data(), s.length()); }
 
 // jtag_message.h TXMESSAGE::add_int
 void add_int(uint32_t value) {
-  assert(send_buffer_size + sizeof(uint32_t) <= BUFFER_SIZE);
   uint32_t be = htonl(value);
-  memcpy(&send_buffer[send_buffer_size], &be, sizeof(uint32_t));
-  send_buffer_size += sizeof(uint32_t);
+  add_bytes(&be, sizeof(uint32_t));
 }
 
-void add_array(uint8_t *data, size_t len) {
-  assert(send_buffer_size + len <= BUFFER_SIZE);
-  memcpy(&send_buffer[send_buffer_size], data, len);
-  send_buffer_size += len;
+void add_array(const uint8_t *data, size_t len) { add_bytes(data, len); }
+
+// add responses captured in reply_capture, each within one packet
+void add_responses(const std::vector<uint8_t> &responses) {
+  size_t offset = 0;
+  while (offset + 4 <= responses.size()) {
+    size_t length = (responses[offset + 2] << 8) | responses[offset + 3];
+    assert(length >= 4 && offset + length <= responses.size());
+    if (packet_open && packet_length + length > MAX_PACKET_LENGTH) {
+      do_send(0);
+    }
+    add_bytes(&responses[offset], length);
+    offset += length;
+  }
 }
 
 int last_response = -1;
@@ -54,20 +118,27 @@ int last_response = -1;
 // 2-byte: length in big endian
 void add_response(uint8_t resp) {
   assert(last_response == -1);
-  assert(send_buffer_size + 4 <= BUFFER_SIZE);
-  last_response = send_buffer_size;
-  send_buffer[send_buffer_size++] = resp;
-  send_buffer[send_buffer_size++] = 0;
+  if (!reply_capture && packet_open &&
+      packet_length + 256 > MAX_PACKET_LENGTH) {
+    // keep each response within one packet
+    do_send(0);
+  }
+  if (!reply_capture) {
+    open_packet();
+  }
+  std::vector<uint8_t> &out = reply_capture ? *reply_capture : reply_arena;
+  last_response = out.size();
   //  length will be filled below
-  send_buffer[send_buffer_size++] = 0;
-  send_buffer[send_buffer_size++] = 0;
+  uint8_t header[4] = {resp, 0, 0, 0};
+  add_bytes(header, sizeof(header));
 }
 
 void end_response() {
   assert(last_response != -1);
-  uint16_t length = send_buffer_size - last_response;
-  send_buffer[last_response + 2] = length >> 8;
-  send_buffer[last_response + 3] = length;
+  std::vector<uint8_t> &out = reply_capture ? *reply_capture : reply_arena;
+  uint16_t length = out.size() - last_response;
+  out[last_response + 2] = length >> 8;
+  out[last_response + 3] = length;
   last_response = -1;
 }
 
@@ -75,22 +146,52 @@ uint16_t compute_header(uint16_t length, uint16_t mux) {
   return (mux << 12) | (length - 1);
 }
 
-void fill_header(uint16_t mux) {
-  uint16_t actual_length = send_buffer_size - 2;
-  uint16_t header = compute_header(actual_length, mux);
-  send_buffer[0] = header >> 8;
-  send_buffer[1] = header;
+// close current packet
+void do_send(uint16_t mux) {
+  if (!packet_open) {
+    return;
+  }
+  uint16_t header = compute_header(packet_length, mux);
+  reply_arena[packet_header] = header >> 8;
+  reply_arena[packet_header + 1] = header;
+  packet_open = false;
+}
+
+// send payload owned by the caller via fifo, split into packets
+void add_fifo(uint16_t mux, const uint8_t *data, size_t length) {
+  do_send(0);
+  for (size_t offset = 0; offset < length; offset += MAX_PACKET_LENGTH) {
+    size_t len = std::min(length - offset, MAX_PACKET_LENGTH);
+    open_packet();
+    reply_spans.push_back(ReplySpan{&data[offset], 0, len});
+    packet_length = len;
+    do_send(mux);
+  }
 }
 
-void do_send(uint16_t mux) {
-  fill_header(mux);
-  dprintf("Sending:\n");
-  for (int i = 0; i < send_buffer_size; i++) {
-    dprintf("%02X ", send_buffer[i]);
+// write all closed packets
+void reply_flush() {
+  do_send(0);
+  if (reply_spans.empty()) {
+    return;
   }
-  dprintf("\n");
-  write_full(client_fd, send_buffer, send_buffer_size);
-  send_buffer_size = 2;
+
+  std::vector<struct iovec> iov(reply_spans.size());
+  for (size_t i = 0; i < reply_spans.size(); i++) {
+    const ReplySpan &span = reply_spans[i];
+    const uint8_t *data =
+        span.data ? span.data : &reply_arena[span.offset];
+    iov[i].iov_base = (void *)data;
+    iov[i].iov_len = span.length;
+    dprintf("Sending %zu bytes:\n", span.length);
+    for (size_t j = 0; j < span.length && debug; j++) {
+      dprintf("%02X ", data[j]);
+    }
+    dprintf("\n");
+  }
+  client_writev(iov.data(), iov.size());
+  reply_arena.clear();
+  reply_spans.clear();
 }
 
 // jtag_message.h add_command
@@ -104,382 +205,863 @@ struct MessageHeader {
   uint16_t be_len; // big endian
 };
 
+// message parsed in place: body points into the socket buffer while the
+// message is handled in the same tick, and is copied to storage only if the
+// message has to wait for a later tick
 struct Message {
   uint8_t command;
-  std::vector<uint8_t> body;
+  const uint8_t *body;
+  uint16_t length;
+  std::shared_ptr<std::vector<uint8_t>> storage;
+};
+
+// bounded ring buffer for fifo data
+struct ByteRing {
+  std::vector<uint8_t> data;
+  size_t head;
+  size_t size;
+
+  size_t space() const { return data.size() - size; }
+
+  void push(const uint8_t *src, size_t len) {
+    assert(len <= space());
+    size_t tail = (head + size) % data.size();
+    size_t first = std::min(len, data.size() - tail);
+    memcpy(&data[tail], src, first);
+    memcpy(&data[0], src + first, len - first);
+    size += len;
+  }
+
+  void pop(uint8_t *dst, size_t len) {
+    assert(len <= size);
+    size_t first = std::min(len, data.size() - head);
+    memcpy(dst, &data[head], first);
+    memcpy(dst + first, &data[0], len - first);
+    head = (head + len) % data.size();
+    size -= len;
+  }
+
+  // contiguous readable bytes at head
+  const uint8_t *peek(size_t &len) const {
+    len = std::min(size, data.size() - head);
+    return &data[head];
+  }
+
+  void drop(size_t len) {
+    assert(len <= size);
+    head = (head + len) % data.size();
+    size -= len;
+  }
+
+  void clear() {
+    head = 0;
+    size = 0;
+  }
 };
 
 // saved device list
 std::vector<uint32_t> devices;
+// the cached chain was checked against the board in this session
+bool chain_checked = false;
 std::deque<Message> messages;
-std::map<int, std::vector<uint32_t>> fifos;
+// one ring per mux channel, allocated on first use
+ByteRing fifos[16];
 const int FIFO_MIN = 4;
+const size_t FIFO_CAPACITY = 1 << 20;
 
 bool pop_fifo(uint8_t *buffer, size_t length) {
-  if (length <= fifos[FIFO_MIN].size()) {
+  if (length <= fifos[FIFO_MIN].size) {
     dprintf("Pop %d bytes from fifo\n", length);
-    memcpy(buffer, &fifos[FIFO_MIN][0], length);
-    fifos[FIFO_MIN].erase(fifos[FIFO_MIN].begin(),
-                          fifos[FIFO_MIN].begin() + length);
+    fifos[FIFO_MIN].pop(buffer, length);
     return true;
   } else {
     return false;
   }
 }
 
+// accesses sent to the adapter, replies are sent after tdo is received
+struct PendingAccess {
+  uint8_t command;
+  IrScan ir_scan;
+  uint32_t length_dr;
+  uint32_t read_length;
+  // node selection and USER0 before a virtual access
+  SldScan sld = {};
+  // referenced by the reply until it is sent
+  std::vector<uint8_t> tdo;
+  // replies of messages processed while this access waited for fifo data
+  std::vector<uint8_t> held_replies;
+};
+
+std::deque<PendingAccess> pending_accesses;
+size_t pending_read_bytes = 0;
+std::vector<uint8_t> held_replies;
+
+// long dr accesses are streamed: tdi is shifted as fifo data arrives and
+// tdo is sent back in fifo packets after each chunk
+const uint32_t DR_BATCH_BITS = MAX_PENDING_READ_BYTES * 8;
+const uint32_t DR_WRITE_CHUNK_BITS = 1 << 19;
+const uint32_t DR_READ_CHUNK_BITS = MAX_PENDING_READ_BYTES * 8;
+
+struct DrStream {
+  bool active;
+  uint32_t length_dr;
+  // bits taken from fifo, rounded down to bytes
+  uint32_t write_bits;
+  uint32_t read_length;
+  // bits shifted so far
+  uint32_t done;
+  // fifo bytes consumed so far
+  uint32_t popped;
+};
+
+DrStream dr_stream = {};
+std::vector<uint8_t> dr_stream_tdo;
+
+// only a single intel device is supported, all of them have a 10-bit ir
+const size_t JTAGD_IR_LEN = 10;
+
+// aji.h AJI_FAILURE
+const uint8_t AJI_FAILURE = 1;
+
+// messages that queue scans and are batched
+static bool jtagd_is_access(uint8_t command) {
+  // ACCESS_IR_2, ACCESS_DR_2, ACCESS_NODE_IR, ACCESS_NODE_DR
+  return command == 0xC6 || command == 0xC8 || command == 0xCC ||
+         command == 0xCD;
+}
+
+// messages that touch neither the chain nor the fifos
+static bool jtagd_is_independent(uint8_t command) {
+  switch (command) {
+  case 0x83: // GET_VERSION_INFO
+  case 0x84: // GET_DEFINED_DEVICES
+  case 0xA2: // LOCK_CHAIN
+  case 0xA3: // UNLOCK_CHAIN
+  case 0xAA: // SET_PARAMETER
+  case 0xAB: // GET_PARAMETER
+  case 0xC0: // CLOSE_DEVICE
+  case 0xC2: // UNLOCK_DEVICE
+  case 0xFE: // USE_PROTOCOL_VERSION
+    return true;
+  default:
+    return false;
+  }
+}
+
+// receive tdo of all pending accesses and send their replies in order
+static void jtagd_flush_accesses() {
+  for (auto &access : pending_accesses) {
+    if (access.command == 0xC6) {
+      uint8_t read_back[4] = {};
+      jtag_ir_scan_recv(read_back, access.ir_scan);
+
+      // success
+      add_response(0);
+      uint32_t res = read_back[0];
+      memcpy(&res, read_back, sizeof(read_back));
+      add_int(res);
+      end_response();
+      do_send(0);
+    } else if (access.command == 0xCC) {
+      uint32_t captured = 0;
+      sld_scan_recv(access.sld, &captured);
+
+      // success
+      add_response(0);
+      add_int(captured);
+      end_response();
+      do_send(0);
+    } else {
+      sld_scan_recv(access.sld, NULL);
+
+      size_t num_bytes = (access.read_length + 7) / 8;
+      access.tdo.assign((access.length_dr + 7) / 8, 0);
+      if (access.read_length > 0) {
+        jtag_scan_chain_recv(access.tdo.data(), access.length_dr, true);
+      }
+
+      // success
+      add_response(0);
+      end_response();
+      do_send(0);
+
+      if (access.read_length > 0) {
+        // send data via fifo without copying
+        add_fifo(FIFO_MIN, access.tdo.data(),
+                 std::min(num_bytes, access.tdo.size()));
+      }
+    }
+
+    if (!access.held_replies.empty()) {
+      add_responses(access.held_replies);
+      do_send(0);
+    }
+  }
+  reply_flush();
+  pending_accesses.clear();
+  pending_read_bytes = 0;
+}
+
+// shift the active dr stream as far as fifo data allows
+// false if it has to wait for more fifo data
+static bool jtagd_stream_dr() {
+  ByteRing &fifo = fifos[FIFO_MIN];
+  uint32_t write_bytes = dr_stream.write_bits / 8;
+  while (dr_stream.done < dr_stream.length_dr) {
+    uint32_t done = dr_stream.done;
+    bool do_read = done < dr_stream.read_length;
+    uint32_t end = std::min(
+        dr_stream.length_dr,
+        done + (do_read ? DR_READ_CHUNK_BITS : DR_WRITE_CHUNK_BITS));
+
+    const uint8_t *tdi;
+    size_t used = 0;
+    std::vector<uint8_t> zeros;
+    if (done < dr_stream.write_bits) {
+      // shift straight from the fifo, up to where it wraps
+      end = std::min(end, dr_stream.write_bits);
+      size_t available;
+      tdi = fifo.peek(available);
+      if (available == 0) {
+        return false;
+      }
+      used = (end - done + 7) / 8;
+      if (available < used) {
+        used = available;
+        end = done + used * 8;
+      }
+    } else {
+      zeros.assign((end - done + 7) / 8, 0);
+      tdi = zeros.data();
+    }
+
+    bool last = end == dr_stream.length_dr;
+    jtag_scan_chain_send(tdi, end - done, last, do_read);
+    fifo.drop(used);
+    dr_stream.popped += used;
+    dr_stream.done = end;
+
+    if (do_read) {
+      dr_stream_tdo.assign((end - done + 7) / 8, 0);
+      jtag_scan_chain_recv(dr_stream_tdo.data(), end - done, last);
+      uint32_t read_end = std::min(end, dr_stream.read_length);
+      add_fifo(FIFO_MIN, dr_stream_tdo.data(), (read_end - done + 7) / 8);
+      reply_flush();
+    }
+  }
+
+  // discard written bytes beyond length_dr
+  while (dr_stream.popped < write_bytes) {
+    size_t available;
+    fifo.peek(available);
+    if (available == 0) {
+      return false;
+    }
+    size_t used = std::min(available, (size_t)(write_bytes - dr_stream.popped));
+    fifo.drop(used);
+    dr_stream.popped += used;
+  }
+
+  dr_stream.active = false;
+  if (!held_replies.empty()) {
+    add_responses(held_replies);
+    do_send(0);
+    held_replies.clear();
+  }
+  reply_flush();
+  return true;
+}
+
+static uint32_t body_int(const uint8_t *body, size_t offset) {
+  uint32_t value;
+  memcpy(&value, &body[offset], 4);
+  return ntohl(value);
+}
+
+// the sld hub is enumerated on first use, after pending scans are received
+static bool jtagd_node_valid(uint32_t node) {
+  if (!sld_hub.valid) {
+    jtagd_flush_accesses();
+    sld_enumerate();
+  }
+  return sld_hub.valid && node < sld_hub.nodes.size();
+}
+
+static void jtagd_node_failure() {
+  jtagd_flush_accesses();
+  add_response(AJI_FAILURE);
+  end_response();
+  do_send(0);
+}
+
+// send an access to the adapter, false if it has to wait for fifo data
+static bool jtagd_queue_access(const Message &msg) {
+  const uint8_t *body = msg.body;
+  if ((msg.command == 0xC8 || msg.command == 0xCD) && dr_stream.active) {
+    // resume streaming
+    return jtagd_stream_dr();
+  }
+
+  PendingAccess access;
+  access.command = msg.command;
+  if (msg.command == 0xC6) {
+    // it does not appear in libaji_client
+    // but it is adjacent to ACCESS_IR
+    // ACCESS_IR_2
+    dprintf("ACCESS_IR_2\n");
+
+    // guessed input:
+    // int: open_id
+    // int: 1
+    // int: idcode
+    // int: instruction
+    uint8_t instruction[4] = {};
+    // reverse endian
+    instruction[0] = body[15];
+    instruction[1] = body[14];
+    instruction[2] = body[13];
+    instruction[3] = body[12];
+
+    jtag_ir_scan_send(instruction, JTAGD_IR_LEN, access.ir_scan);
+    if (!access.ir_scan.hit) {
+      pending_read_bytes += (JTAGD_IR_LEN + 7) / 8;
+    }
+  } else if (msg.command == 0xCC) {
+    // ACCESS_NODE_IR, virtual ir of a sld node
+    dprintf("ACCESS_NODE_IR\n");
+
+    // input:
+    // int: node index from GET_NODES
+    // int: instruction
+    if (msg.length < 8 || !jtagd_node_valid(body_int(body, 0))) {
+      jtagd_node_failure();
+      return true;
+    }
+    sld_vir_send(body_int(body, 0), body_int(body, 4), access.sld);
+    // ir and virtual ir captures
+    pending_read_bytes += 10;
+  } else {
+    // it does not appear in libaji_client
+    // but it is adjacent to ACCESS_DR
+    // ACCESS_DR_2
+    dprintf("ACCESS_DR_2\n");
+
+    // guessed input:
+    // int: 1
+    // int: ?
+    // int: idcode
+    // int: length_dr
+    // int: write_offset
+    // int: write_length
+    // int: read_offset
+    // int: read_length
+    uint32_t length_dr;
+    uint32_t write_length;
+    uint32_t read_length;
+    int node = -1;
+    if (msg.command == 0xCD) {
+      // ACCESS_NODE_DR, virtual dr of a sld node
+      dprintf("ACCESS_NODE_DR\n");
+
+      // input:
+      // int: node index from GET_NODES
+      // int: length_dr
+      // int: write_length
+      // int: read_length
+      if (msg.length < 16) {
+        jtagd_node_failure();
+        return true;
+      }
+      node = body_int(body, 0);
+      length_dr = body_int(body, 4);
+      write_length = body_int(body, 8);
+      read_length = body_int(body, 12);
+      if (!jtagd_node_valid(node)) {
+        jtagd_node_failure();
+        reply_flush();
+
+        // drop the tdi that came with it
+        dr_stream = {};
+        dr_stream.active = true;
+        dr_stream.write_bits = write_length / 8 * 8;
+        return jtagd_stream_dr();
+      }
+    } else {
+      length_dr = body_int(body, 12);
+      write_length = body_int(body, 20);
+      read_length = body_int(body, 28);
+      // the virtual ir may be shifted behind our back
+      sld_vir_invalidate();
+    }
+    dprintf("Got length_dr=%d write_length=%d read_length=%d\n", length_dr,
+            write_length, read_length);
+
+    if (length_dr > DR_BATCH_BITS) {
+      jtagd_flush_accesses();
+      if (node >= 0) {
+        SldScan scan;
+        sld_dr_send(node, scan);
+        sld_scan_recv(scan, NULL);
+      }
+
+      // success, tdo follows in fifo packets
+      add_response(0);
+      end_response();
+      do_send(0);
+      reply_flush();
+
+      dr_stream.active = true;
+      dr_stream.length_dr = length_dr;
+      dr_stream.write_bits = write_length / 8 * 8;
+      dr_stream.read_length = read_length;
+      dr_stream.done = 0;
+      dr_stream.popped = 0;
+      jtag_tms_seq_to(JtagState::ShiftDR);
+      return jtagd_stream_dr();
+    }
+
+    std::vector<uint8_t> send(
+        std::max((length_dr + 7) / 8, write_length / 8), 0);
+
+    // try to get data from fifo
+    if (!pop_fifo(send.data(), write_length / 8)) {
+      // try again later
+      return false;
+    }
+
+    if (node >= 0) {
+      sld_dr_send(node, access.sld);
+      // ir and virtual ir captures
+      pending_read_bytes += 10;
+    }
+
+    // skip reading when tdo is not wanted
+    jtag_tms_seq_to(JtagState::ShiftDR);
+    jtag_scan_chain_send(send.data(), length_dr, true, read_length > 0);
+    access.length_dr = length_dr;
+    access.read_length = read_length;
+    if (read_length > 0) {
+      pending_read_bytes += (length_dr + 7) / 8;
+    }
+  }
+
+  access.held_replies.swap(held_replies);
+  pending_accesses.push_back(access);
+  if (pending_read_bytes >= adapter_max_pending_read_bytes()) {
+    jtagd_flush_accesses();
+  }
+  return true;
+}
+
+// handle a single message, false if it has to wait for fifo data
+static bool jtagd_handle_message(const Message &msg) {
+  const uint8_t *body = msg.body;
+  dprintf("Processing message of command 0x%02X length %d:\n", msg.command,
+          msg.length);
+  for (int i = 0; i < msg.length; i++) {
+    dprintf("%02X ", body[i]);
+  }
+  dprintf("\n");
+
+  if (msg.command == 0x80) {
+    // GET_HARDWARE
+    dprintf("GET_HARDWARE\n");
+    // jtag_client_link.cpp AJI_CLIENT::get_hardware_from_server
+    // response:
+    add_response(0);
+    // an int: n: number of devices
+    int n = 1;
+    add_int(n);
+    // an int: fifo_len: payload size below
+    std::string hw_name = "hw0";
+    std::string port = "port0";
+    std::string device_name = "device0";
+    int fifo_len = 4 + 1 + hw_name.length() + 1 + port.length() + 4 + 1 +
+                   device_name.length() + 4;
+    add_int(fifo_len);
+    end_response();
+    do_send(0);
+
+    // each payload:
+    // an int: chain_id
+    int chain_id = 1; // cannot be zero
+    add_int(chain_id);
+    // a string: hw_name
+    add_string(hw_name);
+    // a string: port
+    add_string(port);
+    // an int: chain_type
+    int chain_type = 1; // JTAG
+    add_int(chain_type);
+    // a string: device_name
+    add_string(device_name);
+    // an int: features
+    int features = 0x0800; // AJI_FEATURE_JTAG
+    add_int(features);
+
+    do_send(FIFO_MIN);
+  } else if (msg.command == 0x83) {
+    // GET_VERSION_INFO
+    dprintf("GET_VERSION_INFO\n");
+    // response:
+    // a string: version info
+    // an int: pgmparts version
+    // a string: server path
+    std::string version_info = "1.0";
+    std::string server_path = "jtagd";
+    add_response(0);
+    add_string(version_info);
+    add_int(0);
+    add_string(server_path);
+    end_response();
+  } else if (msg.command == 0x84) {
+    // GET_DEFINED_DEVICES
+    dprintf("GET_DEFINED_DEVICES\n");
+    add_response(0);
+    // int: defined_tag
+    int defined_tag = 1;
+    add_int(defined_tag);
+    // int: device_count
+    int device_count = 0;
+    add_int(device_count);
+    // int: fifo_len
+    int fifo_len = 0;
+    add_int(fifo_len);
+    end_response();
+  } else if (msg.command == 0xA2) {
+    // LOCK_CHAIN
+    dprintf("LOCK_CHAIN\n");
+    // success
+    add_response(0);
+    end_response();
+  } else if (msg.command == 0xA3) {
+    // UNLOCK_CHAIN
+    dprintf("UNLOCK_CHAIN\n");
+    // success
+    add_response(0);
+    end_response();
+  } else if (msg.command == 0xA5) {
+    // READ_CHAIN
+    dprintf("READ_CHAIN\n");
+    // args:
+    // int: chain_id
+    // int: chain_tag
+    // int: autoscan
+
+    // scan jtag, or reuse the chain of an earlier session if the board was
+    // not swapped in between
+    if (!chain_checked) {
+      jtag_chain_check();
+      chain_checked = true;
+    }
+    devices = jtag_chain_devices();
+    sld_invalidate();
+
+    add_response(0);
+    // int: chain_tag
+    int chain_tag = 1;
+    add_int(chain_tag);
+    // int: device_count
+    int device_count = devices.size();
+    add_int(device_count);
+    // int: fifo_len
+    std::string device_name = "device0";
+    int fifo_len =
+        device_count * (4 + 4 + 4 + 4 + 4 + 1 + device_name.length());
+    add_int(fifo_len);
+    end_response();
+    do_send(0);
+
+    // for each device
+    for (int i = 0; i < devices.size(); i++) {
+      // int: device_id
+      int device_id = devices[i];
+      add_int(device_id);
+      // int: instruction_length
+      // TODO: find this in a database
+      int instruction_length = 10;
+      add_int(instruction_length);
+      // int: features
+      int features = 0;
+      add_int(features);
+      // 2x int: dummy
+      add_int(0);
+      add_int(0);
+      // string: device_name
+      std::string device_name = "device0";
+      add_string(device_name);
+    }
+    do_send(FIFO_MIN);
+  } else if (msg.command == 0xA6) {
+    // GET_NODES
+    // it does not appear in libaji_client, the sld hub is enumerated once
+    // here instead of with a round trip per nibble
+    dprintf("GET_NODES\n");
+    // args:
+    // int: chain_id
+    // int: tap_position
+    if (!sld_enumerate()) {
+      add_response(AJI_FAILURE);
+      end_response();
+      return true;
+    }
+
+    add_response(0);
+    // int: hub_info
+    add_int(sld_hub.info);
+    // int: node_count
+    add_int(sld_hub.nodes.size());
+    // int: fifo_len
+    add_int(sld_hub.nodes.size() * 4);
+    end_response();
+    do_send(0);
+
+    // int: node_info for each node
+    for (uint32_t info : sld_hub.nodes) {
+      add_int(info);
+    }
+    do_send(FIFO_MIN);
+  } else if (msg.command == 0xA8) {
+    // OPEN_DEVICE
+    dprintf("OPEN_DEVICE\n");
+    add_response(0);
+    // int: idcode
+    // TODO: index from tap_position
+    int id = devices[0];
+    add_int(id);
+    end_response();
+  } else if (msg.command == 0xAA) {
+    // SET_PARAMETER
+    dprintf("SET_PARAMETER\n");
+    add_response(0);
+    end_response();
+  } else if (msg.command == 0xAB) {
+    // GET_PARAMETER
+    dprintf("GET_PARAMETER\n");
+    add_response(0);
+    add_int(0);
+    end_response();
+  } else if (msg.command == 0xC0) {
+    // CLOSE_DEVICE
+    dprintf("CLOSE_DEVICE\n");
+    // success
+    add_response(0);
+    end_response();
+  } else if (msg.command == 0xC1) {
+    // LOCK_DEVICE
+    dprintf("LOCK_DEVICE\n");
+    // success
+    add_response(0);
+    end_response();
+    do_send(0);
+  } else if (msg.command == 0xC2) {
+    // UNLOCK_DEVICE
+    dprintf("UNLOCK_DEVICE\n");
+    // success
+    add_response(0);
+    end_response();
+  } else if (jtagd_is_access(msg.command)) {
+    // ACCESS_IR_2 / ACCESS_DR_2 / ACCESS_NODE_IR / ACCESS_NODE_DR
+    return jtagd_queue_access(msg);
+  } else if (msg.command == 0xCA) {
+    // RUN_TEST_IDLE
+    dprintf("RUN_TEST_IDLE\n");
+    jtag_tms_seq_to(JtagState::RunTestIdle);
+
+    add_response(0);
+    end_response();
+    do_send(0);
+  } else if (msg.command == 0xFE) {
+    // USE_PROTOCOL_VERSION
+    dprintf("USE_PROTOCOL_VERSION\n");
+    // the argument is version
+    // response: flags
+    int flags = 1; // SERVER_ALLOW_REMOTE
+    // 8: 4 header, 1 int
+    add_response(0);
+    add_int(flags);
+    end_response();
+  } else {
+    dprintf("Unrecognized command: %x\n", msg.command);
+
+    // aji.h AJI_UNIMPLEMENTED
+    add_response(126);
+    end_response();
+  }
+  return true;
+}
+
+// parsing stopped at a full fifo that has been drained since
+bool fifo_stalled = false;
+// fifo packet whose payload is still arriving
+uint16_t fifo_packet_mux;
+size_t fifo_packet_remaining = 0;
+
 void jtag_jtagd_tick() {
-  // leave space for header
-  send_buffer_size = 2;
   if (client_fd >= 0) {
-    if (!read_socket()) {
-      return;
+    // the stalled packets can be parsed now, do not block on the client
+    if (!fifo_stalled || client_readable(0)) {
+      if (!read_socket()) {
+        return;
+      }
     }
+    fifo_stalled = false;
 
     // the protocol is learned from intel/libaji_client
-    while (buffer_begin + 2 <= buffer_end) {
+    while (true) {
+      if (fifo_packet_remaining > 0) {
+        // fifo payload is pushed as it arrives
+        ByteRing &fifo = fifos[fifo_packet_mux];
+        size_t len = std::min(fifo_packet_remaining, buffer_end - buffer_begin);
+        if (fifo_packet_mux != FIFO_MIN) {
+          // nothing reads the other fifos, drop their data
+          buffer_begin += len;
+          fifo_packet_remaining -= len;
+          if (len == 0) {
+            break;
+          }
+          continue;
+        }
+        len = std::min(len, fifo.space());
+        if (len == 0) {
+          // fifo full, leave the data in the socket buffer until drained
+          break;
+        }
+        dprintf("Added %zu bytes to fifo %d\n", len, fifo_packet_mux);
+        fifo.push(&buffer[buffer_begin], len);
+        buffer_begin += len;
+        fifo_packet_remaining -= len;
+        continue;
+      }
+
+      if (buffer_begin + 2 > buffer_end) {
+        break;
+      }
+
       // jtag_tcplink.cpp TCPLINK:add_packet
       uint16_t header =
           (((uint16_t)buffer[buffer_begin]) << 8) + buffer[buffer_begin + 1];
       uint16_t mux = header >> 12;
       uint16_t length = (header & ((1 << 12) - 1)) + 1;
-      if (buffer_begin + 2 + length <= buffer_end) {
-        dprintf("Received block of length %d, mux %d:\n", length, mux);
-        for (int i = 0; i < length; i++) {
-          dprintf("%02X ", (uint8_t)buffer[buffer_begin + 2 + i]);
+      if (mux >= 4) {
+        // fifo
+        ByteRing &fifo = fifos[mux];
+        if (mux == FIFO_MIN && fifo.data.empty()) {
+          fifo.data.resize(FIFO_CAPACITY);
         }
-        dprintf("\n");
         buffer_begin += 2;
-
-        if (mux == 0) {
-          // one or more messages
-          uint8_t *p = (uint8_t *)&buffer[buffer_begin];
-          uint8_t *end = (uint8_t *)&buffer[buffer_begin + length];
-          while (p < end) {
-            MessageHeader *header = (MessageHeader *)p;
-            dprintf("Received message of command 0x%02X length %d:\n",
-                    header->command, ntohs(header->be_len));
-            uint16_t header_len = ntohs(header->be_len);
-            for (int i = 0; i < header_len; i++) {
-              dprintf("%02X ", (uint8_t)p[i]);
-            }
-            dprintf("\n");
-
-            if (header_len < 4) {
-              // bad header, avoid infinite loop
-              printf("Unexpected header len %d\n", header_len);
-              break;
-            }
-
-            Message msg;
-            msg.command = header->command;
-            msg.body.insert(msg.body.end(), &p[4], p + header_len);
-
-            messages.push_back(msg);
-
-            p += header_len;
-          }
-        } else if (mux >= 4) {
-          // fifo
-          dprintf("Added %d bytes to fifo\n", length);
-          fifos[mux].insert(fifos[mux].end(), buffer_begin,
-                            buffer_begin + length);
-        }
-
-        buffer_begin += length;
-      } else {
+        fifo_packet_mux = mux;
+        fifo_packet_remaining = length;
+        continue;
+      }
+      if (buffer_begin + 2 + length > buffer_end) {
         break;
       }
-    }
 
-    // handle messages
-    while (!messages.empty()) {
-      Message msg = messages.front();
-
-      dprintf("Processing message of command 0x%02X length %d:\n", msg.command,
-              msg.body.size());
-      for (int i = 0; i < msg.body.size(); i++) {
-        dprintf("%02X ", msg.body[i]);
+      dprintf("Received block of length %d, mux %d:\n", length, mux);
+      for (int i = 0; i < length; i++) {
+        dprintf("%02X ", (uint8_t)buffer[buffer_begin + 2 + i]);
       }
       dprintf("\n");
+      buffer_begin += 2;
 
-      if (msg.command == 0x80) {
-        // GET_HARDWARE
-        dprintf("GET_HARDWARE\n");
-        // jtag_client_link.cpp AJI_CLIENT::get_hardware_from_server
-        // response:
-        add_response(0);
-        // an int: n: number of devices
-        int n = 1;
-        add_int(n);
-        // an int: fifo_len: payload size below
-        std::string hw_name = "hw0";
-        std::string port = "port0";
-        std::string device_name = "device0";
-        int fifo_len = 4 + 1 + hw_name.length() + 1 + port.length() + 4 + 1 +
-                       device_name.length() + 4;
-        add_int(fifo_len);
-        end_response();
-        do_send(0);
-
-        // each payload:
-        // an int: chain_id
-        int chain_id = 1; // cannot be zero
-        add_int(chain_id);
-        // a string: hw_name
-        add_string(hw_name);
-        // a string: port
-        add_string(port);
-        // an int: chain_type
-        int chain_type = 1; // JTAG
-        add_int(chain_type);
-        // a string: device_name
-        add_string(device_name);
-        // an int: features
-        int features = 0x0800; // AJI_FEATURE_JTAG
-        add_int(features);
-
-        do_send(FIFO_MIN);
-      } else if (msg.command == 0x83) {
-        // GET_VERSION_INFO
-        dprintf("GET_VERSION_INFO\n");
-        // response:
-        // a string: version info
-        // an int: pgmparts version
-        // a string: server path
-        std::string version_info = "1.0";
-        std::string server_path = "jtagd";
-        add_response(0);
-        add_string(version_info);
-        add_int(0);
-        add_string(server_path);
-        end_response();
-      } else if (msg.command == 0x84) {
-        // GET_DEFINED_DEVICES
-        dprintf("GET_DEFINED_DEVICES\n");
-        add_response(0);
-        // int: defined_tag
-        int defined_tag = 1;
-        add_int(defined_tag);
-        // int: device_count
-        int device_count = 0;
-        add_int(device_count);
-        // int: fifo_len
-        int fifo_len = 0;
-        add_int(fifo_len);
-        end_response();
-      } else if (msg.command == 0xA2) {
-        // LOCK_CHAIN
-        dprintf("LOCK_CHAIN\n");
-        // success
-        add_response(0);
-        end_response();
-      } else if (msg.command == 0xA3) {
-        // UNLOCK_CHAIN
-        dprintf("UNLOCK_CHAIN\n");
-        // success
-        add_response(0);
-        end_response();
-      } else if (msg.command == 0xA5) {
-        // READ_CHAIN
-        dprintf("READ_CHAIN\n");
-        // args:
-        // int: chain_id
-        // int: chain_tag
-        // int: autoscan
-
-        // scan jtag
-        devices = jtag_probe_devices();
-
-        add_response(0);
-        // int: chain_tag
-        int chain_tag = 1;
-        add_int(chain_tag);
-        // int: device_count
-        int device_count = devices.size();
-        add_int(device_count);
-        // int: fifo_len
-        std::string device_name = "device0";
-        int fifo_len =
-            device_count * (4 + 4 + 4 + 4 + 4 + 1 + device_name.length());
-        add_int(fifo_len);
-        end_response();
-        do_send(0);
-
-        // for each device
-        for (int i = 0; i < devices.size(); i++) {
-          // int: device_id
-          int device_id = devices[i];
-          add_int(device_id);
-          // int: instruction_length
-          // TODO: find this in a database
-          int instruction_length = 10;
-          add_int(instruction_length);
-          // int: features
-          int features = 0;
-          add_int(features);
-          // 2x int: dummy
-          add_int(0);
-          add_int(0);
-          // string: device_name
-          std::string device_name = "device0";
-          add_string(device_name);
-        }
-        do_send(FIFO_MIN);
-      } else if (msg.command == 0xA8) {
-        // OPEN_DEVICE
-        dprintf("OPEN_DEVICE\n");
-        add_response(0);
-        // int: idcode
-        // TODO: index from tap_position
-        int id = devices[0];
-        add_int(id);
-        end_response();
-      } else if (msg.command == 0xAA) {
-        // SET_PARAMETER
-        dprintf("SET_PARAMETER\n");
-        add_response(0);
-        end_response();
-      } else if (msg.command == 0xAB) {
-        // GET_PARAMETER
-        dprintf("GET_PARAMETER\n");
-        add_response(0);
-        add_int(0);
-        end_response();
-      } else if (msg.command == 0xC0) {
-        // CLOSE_DEVICE
-        dprintf("CLOSE_DEVICE\n");
-        // success
-        add_response(0);
-        end_response();
-      } else if (msg.command == 0xC1) {
-        // LOCK_DEVICE
-        dprintf("LOCK_DEVICE\n");
-        // success
-        add_response(0);
-        end_response();
-        do_send(0);
-      } else if (msg.command == 0xC2) {
-        // UNLOCK_DEVICE
-        dprintf("UNLOCK_DEVICE\n");
-        // success
-        add_response(0);
-        end_response();
-      } else if (msg.command == 0xC6) {
-        // it does not appear in libaji_client
-        // but it is adjacent to ACCESS_IR
-        // ACCESS_IR_2
-        dprintf("ACCESS_IR_2\n");
-
-        // guessed input:
-        // int: open_id
-        // int: 1
-        // int: idcode
-        // int: instruction
-        uint8_t instruction[4] = {};
-        // reverse endian
-        instruction[0] = msg.body[15];
-        instruction[1] = msg.body[14];
-        instruction[2] = msg.body[13];
-        instruction[3] = msg.body[12];
-        uint8_t read_back[4] = {};
-
-        // TODO: do not hardcode irlen
-        int ir_len = 10;
-        jtag_tms_seq_to(JtagState::ShiftIR);
-        jtag_scan_chain(instruction, read_back, ir_len, true, true);
-
-        // success
-        add_response(0);
-        uint32_t res = read_back[0];
-        memcpy(&res, read_back, sizeof(read_back));
-        add_int(res);
-        end_response();
-        do_send(0);
-      } else if (msg.command == 0xC8) {
-        // it does not appear in libaji_client
-        // but it is adjacent to ACCESS_DR
-        // ACCESS_DR_2
-        dprintf("ACCESS_DR_2\n");
-
-        // guessed input:
-        // int: 1
-        // int: ?
-        // int: idcode
-        // int: length_dr
-        // int: write_offset
-        // int: write_length
-        // int: read_offset
-        // int: read_length
-        uint32_t length_dr;
-        memcpy(&length_dr, &msg.body[12], 4);
-        length_dr = ntohl(length_dr);
-        uint32_t write_length;
-        memcpy(&write_length, &msg.body[20], 4);
-        write_length = ntohl(write_length);
-        uint32_t read_length;
-        memcpy(&read_length, &msg.body[28], 4);
-        read_length = ntohl(read_length);
-        printf("Got length_dr=%d write_length=%d read_length=%d\n", length_dr,
-               write_length, read_length);
-
-        uint8_t send[BUFFER_SIZE] = {};
-        uint8_t recv[BUFFER_SIZE] = {};
-
-        // try to get data from fifo
-        if (!pop_fifo(send, write_length / 8)) {
-          // try again later
-          break;
-        }
+      if (mux == 0) {
+        // one or more messages
+        const uint8_t *p = &buffer[buffer_begin];
+        const uint8_t *end = &buffer[buffer_begin + length];
+        while (p + sizeof(MessageHeader) <= end) {
+          const MessageHeader *header = (const MessageHeader *)p;
+          dprintf("Received message of command 0x%02X length %d:\n",
+                  header->command, ntohs(header->be_len));
+          uint16_t header_len = ntohs(header->be_len);
+          if (header_len < 4 || p + header_len > end) {
+            // bad header, avoid infinite loop
+            printf("Unexpected header len %d\n", header_len);
+            break;
+          }
+          for (int i = 0; i < header_len; i++) {
+            dprintf("%02X ", (uint8_t)p[i]);
+          }
+          dprintf("\n");
 
-        jtag_tms_seq_to(JtagState::ShiftDR);
-        jtag_scan_chain(send, recv, length_dr, true, true);
+          Message msg;
+          msg.command = header->command;
+          msg.body = &p[4];
+          msg.length = header_len - 4;
+          messages.push_back(msg);
 
-        // success
-        add_response(0);
-        end_response();
-        do_send(0);
+          p += header_len;
+        }
+      }
 
-        if (read_length > 0) {
-          size_t num_bytes = (read_length + 7) / 8;
+      buffer_begin += length;
+    }
 
-          // send data via fifo
-          add_array(recv, num_bytes);
-          do_send(FIFO_MIN);
+    // handle messages
+    // consecutive accesses are batched, other messages flush the batch
+    // messages behind an access waiting for fifo data are processed if they
+    // do not touch the chain, their replies are held until the access is done
+    size_t index = 0;
+    bool blocked = false;
+    while (index < messages.size()) {
+      const Message &msg = messages[index];
+      if (blocked) {
+        if (!jtagd_is_independent(msg.command)) {
+          break;
         }
-      } else if (msg.command == 0xCA) {
-        // RUN_TEST_IDLE
-        dprintf("RUN_TEST_IDLE\n");
-        jtag_tms_seq_to(JtagState::RunTestIdle);
-
-        add_response(0);
-        end_response();
-        do_send(0);
-      } else if (msg.command == 0xFE) {
-        // USE_PROTOCOL_VERSION
-        dprintf("USE_PROTOCOL_VERSION\n");
-        // the argument is version
-        // response: flags
-        int flags = 1; // SERVER_ALLOW_REMOTE
-        // 8: 4 header, 1 int
-        add_response(0);
-        add_int(flags);
-        end_response();
-      } else {
-        dprintf("Unrecognized command: %x\n", msg.command);
-
-        // aji.h AJI_UNIMPLEMENTED
-        add_response(126);
-        end_response();
+        // hold reply after the blocked access
+        reply_capture = &held_replies;
+        jtagd_handle_message(msg);
+        reply_capture = NULL;
+        messages.erase(messages.begin() + index);
+        continue;
       }
 
-      messages.pop_front();
+      if (!jtagd_is_access(msg.command)) {
+        jtagd_flush_accesses();
+      }
+      if (!jtagd_handle_message(msg)) {
+        // try again when fifo data arrives
+        jtagd_flush_accesses();
+        reply_flush();
+        blocked = true;
+        index++;
+        continue;
+      }
+      messages.erase(messages.begin() + index);
+    }
+    if (!blocked) {
+      jtagd_flush_accesses();
     }
 
-    if (send_buffer_size > 2) {
-      do_send(0);
+    // socket buffer may be reused before the next tick
+    for (auto &msg : messages) {
+      if (!msg.storage) {
+        msg.storage = std::make_shared<std::vector<uint8_t>>(
+            msg.body, msg.body + msg.length);
+        msg.body = msg.storage->data();
+      }
     }
+
+    // only skip the blocking read if an access drained the full fifo,
+    // otherwise wait for the client
+    fifo_stalled = fifo_packet_remaining > 0 && buffer_begin < buffer_end &&
+                   fifos[fifo_packet_mux].space() > 0;
+
+    reply_flush();
   } else {
     messages.clear();
+    for (auto &fifo : fifos) {
+      fifo.clear();
+    }
+    pending_accesses.clear();
+    pending_read_bytes = 0;
+    held_replies.clear();
+    dr_stream.active = false;
+    sld_invalidate();
+    fifo_stalled = false;
+    fifo_packet_remaining = 0;
     // accept connection
     if (try_accept()) {
       // send initial message
@@ -492,8 +1074,9 @@ void jtag_jtagd_tick() {
       // integer authtype
       // no authentication
       add_int(0);
-      do_send(0);
+      reply_flush();
       dprintf("Sent hello message\n");
+      chain_checked = false;
     }
   }
 }
\ No newline at end of file
@@ -0,0 +1,373 @@
+#include "jtagremote.h"
+#include "common.h"
+#include "jrs_protocol.h"
+#include "image.h"
+#include "dmi.h"
+#include "fanout.h"
+#include "gdb.h"
+#include "jtagd.h"
+#include "mpsse.h"
+#include "native.h"
+#include "program.h"
+#include "rbb.h"
+#include "sample.h"
+#include "sld.h"
+#include "svf.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "usb_blaster.h"
+#include "vpi.h"
+#include "xvc.h"
+#include <inttypes.h>
+#include <string>
+#include <sys/time.h>
+
+int client_fd = -1;
+int listen_fd = -1;
+thread_local JtagState state = TestLogicReset;
+bool debug = false;
+
+int ftdi_vid = 0x0403;
+int ftdi_pid = 0x6011;
+enum ftdi_interface ftdi_channel = INTERFACE_A;
+enum AdapterTypes adapter_type = Adapter_Xilinx;
+static volatile bool stop = false;
+uint64_t bits_send = 0;
+uint64_t freq_mhz = 15;
+
+uint8_t *buffer = NULL;
+size_t buffer_size = 0;
+size_t buffer_begin = 0;
+size_t buffer_end = 0;
+size_t socket_buffer_size = 0;
+const char *unix_socket_path = NULL;
+bool use_shm_transport = false;
+const char *tunnel_host = NULL;
+uint16_t tunnel_port = JRS_DEFAULT_PORT;
+enum UpstreamProtocol upstream_protocol = Upstream_RBB;
+const char *upstream_host = NULL;
+uint16_t upstream_port = 12345;
+
+bool use_bus_addr     = false;
+uint8_t usb_bus_addr  = 1;
+uint8_t usb_dev_addr  = 1;
+const char *usb_serial = NULL;
+
+// adapter mirrored by fanout
+static driver *fanout_base = NULL;
+
+// copies of the strings passed in
+static std::string adapter_host;
+static std::string socket_path;
+
+static uint64_t get_time_ns() {
+  struct timeval tv = {};
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+static int result(bool ok) { return ok ? 0 : -1; }
+
+// split host[:port], port is left alone if not given
+static const char *parse_host(const char *spec, uint16_t &port) {
+  adapter_host = spec;
+  size_t colon = adapter_host.rfind(':');
+  if (colon != std::string::npos) {
+    sscanf(adapter_host.c_str() + colon + 1, "%" SCNu16, &port);
+    adapter_host.resize(colon);
+  }
+  return adapter_host.c_str();
+}
+
+int jr_set_adapter(const char *name) {
+  if (strcmp(name, "Xilinx") == 0) {
+    adapter = &mpsse_driver;
+    adapter_type = Adapter_Xilinx;
+  } else if (strcmp(name, "hs2") == 0) {
+    adapter = &mpsse_driver;
+    ftdi_pid = 0x6014;
+    adapter_type = Adapter_DigilentHS2;
+  } else if (strcmp(name, "hs3") == 0) {
+    adapter = &mpsse_driver;
+    ftdi_pid = 0x6014;
+    adapter_type = Adapter_DigilentHS3;
+  } else if (strcmp(name, "usb-blaster") == 0) {
+    adapter = &usb_blaster_driver;
+  } else if (strncmp(name, "tunnel:", 7) == 0) {
+    tunnel_host = parse_host(name + 7, tunnel_port);
+    adapter = &tunnel_driver;
+  } else if (strncmp(name, "rbb:", 4) == 0) {
+    upstream_protocol = Upstream_RBB;
+    upstream_host = parse_host(name + 4, upstream_port);
+    adapter = &upstream_driver;
+  } else if (strncmp(name, "vpi:", 4) == 0) {
+    upstream_protocol = Upstream_VPI;
+    upstream_host = parse_host(name + 4, upstream_port);
+    adapter = &upstream_driver;
+  } else {
+    printf("Unknown adapter %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+void jr_set_usb_id(int vid, int pid) {
+  ftdi_vid = vid;
+  ftdi_pid = pid;
+}
+
+void jr_set_usb_bus_addr(uint8_t bus, uint8_t dev) {
+  use_bus_addr = true;
+  usb_bus_addr = bus;
+  usb_dev_addr = dev;
+}
+
+int jr_set_fanout(const char *targets) {
+  driver *base = adapter == &fanout_driver ? fanout_base : adapter;
+  if (!fanout_set_targets(targets, base)) {
+    return -1;
+  }
+  fanout_base = base;
+  adapter = &fanout_driver;
+  return 0;
+}
+
+int jr_set_ftdi_channel(char channel) {
+  if (channel < 'A' || channel > 'D') {
+    return -1;
+  }
+  ftdi_channel = (ftdi_interface)(channel - 'A' + 1);
+  return 0;
+}
+
+void jr_set_debug(int enable) { debug = enable; }
+
+static bool initialized = false;
+
+int jr_init(void) {
+  initialized = adapter_init(adapter_type);
+  return result(initialized);
+}
+
+int jr_deinit(void) {
+  initialized = false;
+  return result(adapter_deinit());
+}
+
+int jr_set_tck_freq(uint64_t freq) {
+  freq_mhz = freq;
+  if (!initialized) {
+    // used by jr_init()
+    return 0;
+  }
+  return result(adapter_set_tck_freq(freq));
+}
+
+int jr_get_state(void) { return state; }
+
+int jr_reset(void) { return result(jtag_goto_tlr()); }
+
+int jr_goto_state(int to) {
+  if (to < TestLogicReset || to > UpdateIR) {
+    return -1;
+  }
+  return result(jtag_tms_seq_to((JtagState)to));
+}
+
+int jr_tms_seq(const uint8_t *tms, size_t num_bits) {
+  return result(jtag_tms_seq(tms, num_bits));
+}
+
+int jr_scan_send(const uint8_t *tdi, size_t num_bits, int flip_tms,
+                 int do_read) {
+  return result(jtag_scan_chain_send(tdi, num_bits, flip_tms, do_read));
+}
+
+int jr_scan_recv(uint8_t *tdo, size_t num_bits, int flip_tms) {
+  return result(jtag_scan_chain_recv(tdo, num_bits, flip_tms));
+}
+
+int jr_scan(const uint8_t *tdi, uint8_t *tdo, size_t num_bits, int flip_tms) {
+  return result(jtag_scan_chain(tdi, tdo, num_bits, flip_tms, tdo != NULL));
+}
+
+int jr_clock_tck(size_t cycles) { return result(jtag_clock_tck(cycles)); }
+
+int jr_flush(void) { return result(adapter_flush()); }
+
+int jr_play_svf(const char *path) { return result(svf_play(path)); }
+
+int jr_play_xsvf(const char *path) { return result(xsvf_play(path)); }
+
+int jr_compile_svf(const char *path, const char *image_path) {
+  return result(svf_compile(path, image_path));
+}
+
+int jr_compile_xsvf(const char *path, const char *image_path) {
+  return result(xsvf_compile(path, image_path));
+}
+
+int jr_play_image(const char *image_path) {
+  return result(image_play(image_path));
+}
+
+int jr_run_program(const uint8_t *program, size_t len, uint32_t *exit_code,
+                   uint64_t *tdo) {
+  ProgramResult res;
+  if (program_run(program, len, res) != JRS_STATUS_OK) {
+    return -1;
+  }
+  if (exit_code) {
+    *exit_code = res.exit_code;
+  }
+  if (tdo) {
+    *tdo = res.tdo;
+  }
+  return 0;
+}
+
+int jr_dmi(const uint8_t *commands, size_t len, uint8_t *data,
+           size_t data_len, uint32_t *completed) {
+  std::vector<uint8_t> reply;
+  uint32_t count;
+  int status = dmi_run(commands, len, reply, count);
+  if (completed) {
+    *completed = count;
+  }
+  if (data) {
+    memset(data, 0, data_len);
+    memcpy(data, reply.data(), std::min(data_len, reply.size()));
+  }
+  return status == JRS_STATUS_OK ? 0 : -1;
+}
+
+int jr_sample_pins(uint32_t instruction, size_t ir_len, size_t bsr_len,
+                   uint64_t count, const char *output) {
+  return result(
+      sample_stream(instruction, ir_len, bsr_len, count, output, &stop));
+}
+
+int jr_sld_nodes(uint32_t *hub_info, uint32_t *nodes, size_t max_nodes,
+                 size_t *count) {
+  if (!sld_enumerate()) {
+    return -1;
+  }
+  if (hub_info) {
+    *hub_info = sld_hub.info;
+  }
+  if (nodes) {
+    memcpy(nodes, sld_hub.nodes.data(),
+           std::min(max_nodes, sld_hub.nodes.size()) * sizeof(uint32_t));
+  }
+  if (count) {
+    *count = sld_hub.nodes.size();
+  }
+  return 0;
+}
+
+int jr_sld_vir_scan(size_t node, uint32_t value, uint32_t *captured) {
+  SldScan scan;
+  return result(sld_enumerate() && sld_vir_send(node, value, scan) &&
+                sld_scan_recv(scan, captured) &&
+                jtag_tms_seq_to(JtagState::RunTestIdle));
+}
+
+int jr_sld_dr_scan(size_t node, const uint8_t *tdi, uint8_t *tdo,
+                   size_t num_bits) {
+  SldScan scan;
+  if (!sld_enumerate() || node >= sld_hub.nodes.size() ||
+      !sld_dr_send(node, scan) || !jtag_tms_seq_to(JtagState::ShiftDR) ||
+      !jtag_scan_chain_send(tdi, num_bits, true, tdo != NULL) ||
+      !sld_scan_recv(scan, NULL) ||
+      (tdo && !jtag_scan_chain_recv(tdo, num_bits, true))) {
+    return -1;
+  }
+  return result(jtag_tms_seq_to(JtagState::RunTestIdle));
+}
+
+void jr_sld_invalidate(void) { sld_invalidate(); }
+
+void jr_set_unix_socket(const char *path, int use_shm) {
+  if (path) {
+    socket_path = path;
+    unix_socket_path = socket_path.c_str();
+  } else {
+    unix_socket_path = NULL;
+  }
+  use_shm_transport = use_shm;
+}
+
+void jr_set_socket_buffer_size(size_t size) { socket_buffer_size = size; }
+
+int jr_server_init(enum jr_protocol protocol) {
+  if (use_shm_transport && !unix_socket_path) {
+    printf("Shared memory transport requires a unix socket\n");
+    return -1;
+  }
+
+  switch (protocol) {
+  case JR_PROTOCOL_RBB:
+    printf("Use remote bitbang protocol\n");
+    return result(jtag_rbb_init());
+  case JR_PROTOCOL_VPI:
+    printf("Use jtag_vpi protocol\n");
+    return result(jtag_vpi_init());
+  case JR_PROTOCOL_XVC:
+    printf("Use xilinx virtual cable protocol\n");
+    return result(jtag_xvc_init());
+  case JR_PROTOCOL_JTAGD:
+    printf("Use intel jtag server protocol\n");
+    return result(jtag_jtagd_init());
+  case JR_PROTOCOL_NATIVE:
+    printf("Use native batched protocol\n");
+    return result(jtag_native_init());
+  case JR_PROTOCOL_GDB:
+    printf("Use gdb remote serial protocol\n");
+    return result(jtag_gdb_init());
+  }
+  return -1;
+}
+
+void jr_server_tick(enum jr_protocol protocol) {
+  switch (protocol) {
+  case JR_PROTOCOL_RBB:
+    jtag_rbb_tick();
+    break;
+  case JR_PROTOCOL_VPI:
+    jtag_vpi_tick();
+    break;
+  case JR_PROTOCOL_XVC:
+    jtag_xvc_tick();
+    break;
+  case JR_PROTOCOL_JTAGD:
+    jtag_jtagd_tick();
+    break;
+  case JR_PROTOCOL_NATIVE:
+    jtag_native_tick();
+    break;
+  case JR_PROTOCOL_GDB:
+    jtag_gdb_tick();
+    break;
+  }
+}
+
+void jr_run(enum jr_protocol protocol) {
+  uint64_t last_time = get_time_ns();
+  uint64_t last_bits_send = 0;
+  while (!stop) {
+    uint64_t current_time = get_time_ns();
+    if (current_time - last_time > 1000000000l) {
+      fprintf(stderr, "\rSpeed: %.2lf kbps",
+              (double)((bits_send - last_bits_send) * 1000000000l / 1000) /
+                  (current_time - last_time));
+      last_time = current_time;
+      last_bits_send = bits_send;
+    }
+    jr_server_tick(protocol);
+  }
+  printf("\nIR cache: %" PRIu64 " hits, %" PRIu64 " misses\n", ir_cache_hits,
+         ir_cache_misses);
+  fflush(stdout);
+}
+
+void jr_stop(void) { stop = true; }
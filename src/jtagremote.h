@@ -0,0 +1,117 @@
+#ifndef __JTAGREMOTE_H__
+#define __JTAGREMOTE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// in-process api of jtag-remote-server
+//
+// Configure the adapter with the jr_set_*() functions, then call jr_init().
+// The jtag functions queue work in the adapter like the protocol servers do:
+// tdo of jr_scan_send() with do_read is read back by jr_scan_recv() in the
+// same order. A protocol server can be run in the same process with
+// jr_server_init() and jr_server_tick(), or jr_run() until jr_stop().
+//
+// Functions returning int return 0 on success and -1 on error.
+
+enum jr_protocol {
+  JR_PROTOCOL_VPI,
+  JR_PROTOCOL_RBB,
+  JR_PROTOCOL_XVC,
+  JR_PROTOCOL_JTAGD,
+  JR_PROTOCOL_NATIVE,
+  JR_PROTOCOL_GDB,
+};
+
+// adapter configuration, must be called before jr_init()
+// name: Xilinx, hs2, hs3, usb-blaster, tunnel:HOST[:PORT], rbb:HOST[:PORT]
+// or vpi:HOST[:PORT]
+int jr_set_adapter(const char *name);
+void jr_set_usb_id(int vid, int pid);
+void jr_set_usb_bus_addr(uint8_t bus, uint8_t dev);
+// run the session on several adapters of the kind set by jr_set_adapter(),
+// comma separated BUS:DEV or serial numbers, the first one provides tdo
+int jr_set_fanout(const char *targets);
+// A to D
+int jr_set_ftdi_channel(char channel);
+void jr_set_debug(int enable);
+
+int jr_init(void);
+int jr_deinit(void);
+// before jr_init() sets the initial frequency
+int jr_set_tck_freq(uint64_t freq_mhz);
+
+// jtag operations, states use the same numbering as the native protocol
+int jr_get_state(void);
+int jr_reset(void);
+int jr_goto_state(int state);
+int jr_tms_seq(const uint8_t *tms, size_t num_bits);
+int jr_scan_send(const uint8_t *tdi, size_t num_bits, int flip_tms,
+                 int do_read);
+int jr_scan_recv(uint8_t *tdo, size_t num_bits, int flip_tms);
+// send and wait for tdo, tdo is NULL if not wanted
+int jr_scan(const uint8_t *tdi, uint8_t *tdo, size_t num_bits, int flip_tms);
+int jr_clock_tck(size_t cycles);
+// send queued work of adapters that batch, e.g. tunnel and upstream
+int jr_flush(void);
+
+// play a svf or xsvf file, -1 on error or tdo mismatch
+int jr_play_svf(const char *path);
+int jr_play_xsvf(const char *path);
+// record the usb commands of a svf or xsvf file into an image without
+// hardware, needs jr_set_adapter() but not jr_init()
+int jr_compile_svf(const char *path, const char *image_path);
+int jr_compile_xsvf(const char *path, const char *image_path);
+// stream a compiled image to the adapter, -1 on error or tdo mismatch
+int jr_play_image(const char *image_path);
+
+// run a program of the native protocol, see jrs_program_op in
+// client/jrs_protocol.h, tdo of earlier scans must have been received,
+// -1 on error or if the program is malformed
+int jr_run_program(const uint8_t *program, size_t len, uint32_t *exit_code,
+                   uint64_t *tdo);
+// run a list of risc-v dmi commands, see jrs_dmi_op in
+// client/jrs_protocol.h, data_len bytes read are written to data
+int jr_dmi(const uint8_t *commands, size_t len, uint8_t *data,
+           size_t data_len, uint32_t *completed);
+// capture the boundary-scan register with SAMPLE/PRELOAD loaded, back to
+// back, count samples or until jr_stop() if 0, the device must be the only
+// tap, output is a file, - or tcp:PORT, see src/sample.h for the format
+int jr_sample_pins(uint32_t instruction, size_t ir_len, size_t bsr_len,
+                   uint64_t count, const char *output);
+
+// intel sld hub (virtual jtag) of a device with a 10-bit ir that is the only
+// tap, see src/sld.h, nodes are numbered from 0
+// read the hub info and node infos once, up to max_nodes are written to
+// nodes and count is set to the number of nodes
+int jr_sld_nodes(uint32_t *hub_info, uint32_t *nodes, size_t max_nodes,
+                 size_t *count);
+// both scans end in Run-Test/Idle
+// load the virtual ir of node, captured may be NULL
+int jr_sld_vir_scan(size_t node, uint32_t value, uint32_t *captured);
+// scan the virtual dr of node, tdo may be NULL
+int jr_sld_dr_scan(size_t node, const uint8_t *tdi, uint8_t *tdo,
+                   size_t num_bits);
+// forget the hub and the selected node, e.g. after other scans of the device
+void jr_sld_invalidate(void);
+
+// protocol servers, configuration must be set before jr_server_init()
+void jr_set_unix_socket(const char *path, int use_shm);
+void jr_set_socket_buffer_size(size_t size);
+int jr_server_init(enum jr_protocol protocol);
+// serve the client for a while, returns after at most a second when idle
+void jr_server_tick(enum jr_protocol protocol);
+// tick until jr_stop(), printing the speed
+void jr_run(enum jr_protocol protocol);
+// safe to call from a signal handler
+void jr_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,129 +1,155 @@
-#include "common.h"
-#include "usb_blaster.h"
-#include "jtagd.h"
-#include "rbb.h"
-#include "vpi.h"
-#include "xvc.h"
-#include <assert.h>
+#include "jtagremote.h"
 #include <inttypes.h>
-#include <sys/signal.h>
-#include <time.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
 #include <unistd.h>
 
-int client_fd = -1;
-int listen_fd = -1;
-JtagState state = TestLogicReset;
-bool debug = false;
-
-int ftdi_vid = 0x0403;
-int ftdi_pid = 0x6011;
-enum ftdi_interface ftdi_channel = INTERFACE_A;
-enum AdapterTypes adapter_type = Adapter_Xilinx;
-bool stop = false;
-uint64_t bits_send = 0;
-uint64_t freq_mhz = 15;
-
-uint8_t buffer[BUFFER_SIZE];
-size_t buffer_begin = 0;
-size_t buffer_end = 0;
-
-bool use_bus_addr     = false;
-uint8_t usb_bus_addr  = 1;
-uint8_t usb_dev_addr  = 1;
-
 void sigint_handler(int sig) {
   printf("Gracefully shutdown\n");
-  stop = true;
-}
-
-uint64_t get_time_ns() {
-  struct timeval tv = {};
-  gettimeofday(&tv, NULL);
-  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+  jr_stop();
 }
 
-enum Protocol { VPI, RBB, XVC, JTAGD };
-
 int main(int argc, char *argv[]) {
   signal(SIGINT, sigint_handler);
   signal(SIGPIPE, SIG_IGN);
 
   bool usb_vid_pid_used = false;
   bool usb_bus_dev_used = false;
+  int vid = 0x0403;
+  int pid = 0x6011;
+  uint8_t bus = 1;
+  uint8_t dev = 1;
+  uint64_t freq = 0;
+  const char *unix_socket_path = NULL;
+  bool use_shm_transport = false;
+  size_t socket_buffer_size = 0;
+  const char *play_path = NULL;
+  const char *image_path = NULL;
+  bool compile = false;
+  const char *fanout_targets = NULL;
+  bool sample = false;
+  unsigned int sample_ir = 0;
+  size_t sample_ir_len = 0;
+  size_t sample_bsr_len = 0;
+  uint64_t sample_count = 0;
+  const char *sample_output = "samples.bin";
 
   // https://man7.org/linux/man-pages/man3/getopt.3.html
   int opt;
-  Protocol proto = Protocol::VPI;
-  while ((opt = getopt(argc, argv, "dvrxjbc:V:p:f:a:B:D:")) != -1) {
+  jr_protocol proto = JR_PROTOCOL_VPI;
+  while ((opt = getopt(argc, argv, "dvrxjngbmc:V:p:f:a:B:D:s:u:t:U:S:C:I:F:P:O:")) != -1) {
     switch (opt) {
     case 'd':
-      debug = true;
+      jr_set_debug(true);
       break;
     case 'v':
-      proto = Protocol::VPI;
+      proto = JR_PROTOCOL_VPI;
       break;
     case 'r':
-      proto = Protocol::RBB;
+      proto = JR_PROTOCOL_RBB;
       break;
     case 'x':
-      proto = Protocol::XVC;
+      proto = JR_PROTOCOL_XVC;
       break;
     case 'j':
-      proto = Protocol::JTAGD;
+      proto = JR_PROTOCOL_JTAGD;
+      break;
+    case 'n':
+      proto = JR_PROTOCOL_NATIVE;
+      break;
+    case 'g':
+      proto = JR_PROTOCOL_GDB;
       break;
     case 'a':
-      if (strcmp(optarg, "Xilinx") == 0) {
-        adapter_type = Adapter_Xilinx;
-      }
-      else if (strcmp(optarg, "hs2") == 0) {
-        ftdi_pid = 0x6014;
-        adapter_type = Adapter_DigilentHS2;
-      }
-      else if (strcmp(optarg, "hs3") == 0) {
-        ftdi_pid = 0x6014;
-        adapter_type = Adapter_DigilentHS3;
-      }
-      else {
-        printf("Unknown adapter\n");
+      if (jr_set_adapter(optarg) == 0 &&
+          (strcmp(optarg, "hs2") == 0 || strcmp(optarg, "hs3") == 0)) {
+        pid = 0x6014;
       }
       break;
     case 'b':
-      adapter = &usb_blaster_driver;
+      jr_set_adapter("usb-blaster");
       break;
     case 'c':
-      if ('A' <= optarg[0] && optarg[0] <= 'D') {
-        ftdi_channel = (ftdi_interface)(optarg[0] - 'A' + 1);
-      }
+      jr_set_ftdi_channel(optarg[0]);
       break;
     case 'V':
       usb_vid_pid_used = true;
-      sscanf(optarg, "%x", &ftdi_vid);
+      sscanf(optarg, "%x", &vid);
       break;
     case 'p':
       usb_vid_pid_used = true;
-      sscanf(optarg, "%x", &ftdi_pid);
+      sscanf(optarg, "%x", &pid);
       break;
     case 'B':
-      use_bus_addr     = true;
       usb_bus_dev_used = true;
-      sscanf(optarg, "%" SCNu8, &usb_bus_addr);
+      sscanf(optarg, "%" SCNu8, &bus);
       break;
     case 'D':
-      use_bus_addr     = true;
       usb_bus_dev_used = true;
-      sscanf(optarg, "%" SCNu8, &usb_dev_addr);
+      sscanf(optarg, "%" SCNu8, &dev);
       break;
     case 'f':
-      sscanf(optarg, "%" SCNu64, &freq_mhz);
+      sscanf(optarg, "%" SCNu64, &freq);
+      break;
+    case 's':
+      sscanf(optarg, "%zu", &socket_buffer_size);
+      socket_buffer_size *= 1024;
+      break;
+    case 'u':
+      unix_socket_path = optarg;
+      break;
+    case 'm':
+      use_shm_transport = true;
+      break;
+    case 't':
+      if (jr_set_adapter((std::string("tunnel:") + optarg).c_str()) < 0) {
+        return 1;
+      }
+      break;
+    case 'U':
+      if (jr_set_adapter(optarg) < 0) {
+        return 1;
+      }
+      break;
+    case 'S':
+      play_path = optarg;
+      break;
+    case 'C':
+      image_path = optarg;
+      compile = true;
+      break;
+    case 'I':
+      image_path = optarg;
+      compile = false;
+      break;
+    case 'F':
+      fanout_targets = optarg;
+      break;
+    case 'P':
+      sample_count = 0;
+      if (sscanf(optarg, "%x:%zu:%zu:%" SCNu64, &sample_ir, &sample_ir_len,
+                 &sample_bsr_len, &sample_count) < 3) {
+        fprintf(stderr, "Bad sample spec %s\n", optarg);
+        return 1;
+      }
+      sample = true;
+      break;
+    case 'O':
+      sample_output = optarg;
       break;
     default: /* '?' */
-      fprintf(stderr, "Usage: %s [-d] [-v|-r] [-V vid] [-p pid] [-f freq]\n",
+      fprintf(stderr, "Usage: %s [-d] [-v|-r] [-V vid] [-p pid] [-f freq] [-s size]\n",
               argv[0]);
       fprintf(stderr, "\t-d: Enable debug messages\n");
       fprintf(stderr, "\t-v: Use jtag_vpi protocol\n");
       fprintf(stderr, "\t-r: Use remote bitbang protocol\n");
       fprintf(stderr, "\t-x: Use xilinx virtual cable protocol\n");
       fprintf(stderr, "\t-j: Use intel jtag server protocol\n");
+      fprintf(stderr, "\t-n: Use native batched protocol\n");
+      fprintf(stderr, "\t-g: Serve gdb for a RISC-V hart\n");
       fprintf(stderr, "\t-a Xilinx|hs2|hs3: Use Xilinx (default) or Digilent HS2/HS3 adapter\n");
       fprintf(stderr, "\t-b: Use USB Blaster adapter\n");
       fprintf(stderr, "\t-c A|B|C|D: Select ftdi channel\n");
@@ -132,6 +158,17 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "\t-B BUS: Specify usb bus addr\n");
       fprintf(stderr, "\t-D DEV: Specify usb device addr\n");
       fprintf(stderr, "\t-f FREQ: Specify jtag clock frequency in MHz\n");
+      fprintf(stderr, "\t-s SIZE: Specify socket receive buffer size in KiB\n");
+      fprintf(stderr, "\t-u PATH: Listen on unix socket instead of tcp port\n");
+      fprintf(stderr, "\t-m: Use shared memory transport on the unix socket\n");
+      fprintf(stderr, "\t-t HOST[:PORT]: Tunnel to a remote server running -n\n");
+      fprintf(stderr, "\t-U rbb|vpi:HOST[:PORT]: Forward to an upstream remote bitbang or jtag_vpi server\n");
+      fprintf(stderr, "\t-S FILE: Play a svf or xsvf file and exit\n");
+      fprintf(stderr, "\t-C IMAGE: Compile the -S file into an image for the adapter and exit\n");
+      fprintf(stderr, "\t-I IMAGE: Play a compiled image and exit\n");
+      fprintf(stderr, "\t-F BUS:DEV|SERIAL,...: Mirror the session to several adapters, the first provides TDO\n");
+      fprintf(stderr, "\t-P IR:IRLEN:BSRLEN[:COUNT]: Stream boundary-scan samples, IR is the SAMPLE opcode in hex\n");
+      fprintf(stderr, "\t-O FILE|-|tcp:PORT: Output of -P, default samples.bin\n");
       return 1;
     }
   }
@@ -141,44 +178,64 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  if (!adapter_init(adapter_type)) {
+  if (use_shm_transport && !unix_socket_path) {
+    fprintf(stderr, "Shared memory transport requires a unix socket (-u)\n");
     return 1;
   }
 
-  if (proto == Protocol::RBB) {
-    printf("Use remote bitbang protocol\n");
-    jtag_rbb_init();
-  } else if (proto == Protocol::VPI) {
-    printf("Use jtag_vpi protocol\n");
-    jtag_vpi_init();
-  } else if (proto == Protocol::XVC) {
-    printf("Use xilinx virtual cable protocol\n");
-    jtag_xvc_init();
-  } else if (proto == Protocol::JTAGD) {
-    printf("Use intel jtag server protocol\n");
-    jtag_jtagd_init();
+  jr_set_usb_id(vid, pid);
+  if (usb_bus_dev_used) {
+    jr_set_usb_bus_addr(bus, dev);
   }
-  uint64_t last_time = get_time_ns();
-  uint64_t last_bits_send = 0;
-  while (!stop) {
-    uint64_t current_time = get_time_ns();
-    if (current_time - last_time > 1000000000l) {
-      fprintf(stderr, "\rSpeed: %.2lf kbps",
-              (double)((bits_send - last_bits_send) * 1000000000l / 1000) /
-                  (current_time - last_time));
-      last_time = current_time;
-      last_bits_send = bits_send;
+  if (fanout_targets && jr_set_fanout(fanout_targets) < 0) {
+    return 1;
+  }
+  jr_set_unix_socket(unix_socket_path, use_shm_transport);
+  jr_set_socket_buffer_size(socket_buffer_size);
+
+  if (freq) {
+    jr_set_tck_freq(freq);
+  }
+
+  // xsvf is binary, anything else is taken as svf
+  size_t play_path_len = play_path ? strlen(play_path) : 0;
+  bool xsvf = play_path_len >= 5 &&
+              strcasecmp(play_path + play_path_len - 5, ".xsvf") == 0;
+  if (compile) {
+    // no hardware is needed
+    if (!play_path) {
+      fprintf(stderr, "Compiling an image requires a file to play (-S)\n");
+      return 1;
     }
-    if (proto == Protocol::RBB) {
-      jtag_rbb_tick();
-    } else if (proto == Protocol::VPI) {
-      jtag_vpi_tick();
-    } else if (proto == Protocol::XVC) {
-      jtag_xvc_tick();
-    } else if (proto == Protocol::JTAGD) {
-      jtag_jtagd_tick();
+    int res = xsvf ? jr_compile_xsvf(play_path, image_path)
+                   : jr_compile_svf(play_path, image_path);
+    return res < 0 ? 1 : 0;
+  }
+
+  if (jr_init() < 0) {
+    return 1;
+  }
+
+  if (play_path || image_path) {
+    int res;
+    if (image_path) {
+      res = jr_play_image(image_path);
+    } else {
+      res = xsvf ? jr_play_xsvf(play_path) : jr_play_svf(play_path);
     }
+    jr_deinit();
+    return res < 0 ? 1 : 0;
+  }
+
+  if (sample) {
+    int res = jr_sample_pins(sample_ir, sample_ir_len, sample_bsr_len,
+                             sample_count, sample_output);
+    jr_deinit();
+    return res < 0 ? 1 : 0;
   }
-  fflush(stdout);
+
+  jr_server_init(proto);
+  jr_run(proto);
+  jr_deinit();
   return 0;
-}
\ No newline at end of file
+}
@@ -1,10 +1,12 @@
 #include "mpsse.h"
 #include "common.h"
+#include "image.h"
 #include "mpsse_buffer.h"
 #include <algorithm>
 #include <ftdi.h>
 
-static struct ftdi_context *ftdi;
+// per thread for fanout workers, see fanout.h
+static thread_local struct ftdi_context *ftdi;
 
 bool mpsse_init(enum AdapterTypes adapter_type) {
   printf("Initialize ftdi\n");
@@ -23,6 +25,11 @@ bool mpsse_init(enum AdapterTypes adapter_type) {
     printf("Open device bus=0x%04x dev=0x%04x\n", usb_bus_addr, usb_dev_addr);
     ret = ftdi_usb_open_bus_addr(ftdi, usb_bus_addr, usb_dev_addr);
   }
+  else if(usb_serial) {
+    printf("Open device vid=0x%04x pid=0x%04x serial=%s\n", ftdi_vid, ftdi_pid,
+           usb_serial);
+    ret = ftdi_usb_open_desc(ftdi, ftdi_vid, ftdi_pid, NULL, usb_serial);
+  }
   else {
     printf("Open device vid=0x%04x pid=0x%04x\n", ftdi_vid, ftdi_pid);
     ret = ftdi_usb_open(ftdi, ftdi_vid, ftdi_pid);
@@ -82,6 +89,7 @@ bool mpsse_init(enum AdapterTypes adapter_type) {
   }
 
   mpsse_buffer_init(ftdi);
+  adapter_ftdi = ftdi;
 
   if (!mpsse_set_tck_freq(freq_mhz)) {
     return false;
@@ -91,6 +99,7 @@ bool mpsse_init(enum AdapterTypes adapter_type) {
 }
 
 bool mpsse_deinit() {
+  mpsse_buffer_deinit();
   ftdi_set_bitmode(ftdi, 0, 0);
   return true;
 }
@@ -169,56 +178,74 @@ bool mpsse_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
   return true;
 }
 
-bool mpsse_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits, bool flip_tms) {
-  if (!mpsse_buffer_is_empty())
-  {
-    if (!mpsse_buffer_ensure_space(1))
-      return false;
-    // flush FTDI buffers after all write commands are sent
-    mpsse_buffer_append_byte(SEND_IMMEDIATE);
-    // send all write commands
-    if (!mpsse_buffer_flush())
-      return false;
-  }
+// tail points at the raw bytes after the whole bytes
+static void mpsse_decode_tail(const uint8_t *tail, uint8_t *recv,
+                              size_t num_bits, bool flip_tms) {
   size_t bulk_bits = num_bits;
   if (flip_tms) {
     // last bit should be sent along TMS 0->1
     bulk_bits -= 1;
   }
 
-  // read bulk
-  size_t len = (bulk_bits + 7) / 8;
-  memset(recv, 0, len);
-  size_t offset = 0;
-  while (len > offset) {
-    int read = ftdi_read_data(ftdi, &recv[offset], len - offset);
-    if (read < 0) {
-      printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
-             ftdi_get_error_string(ftdi));
-      return false;
-    }
-    offset += read;
-  }
-
   if (bulk_bits % 8) {
     // a length of 1 bit will have the data bit sampled in bit 7 of the byte
     // sent back to the PC, so we need to shift this
-    recv[bulk_bits / 8] >>= 8 - (bulk_bits % 8);
+    recv[bulk_bits / 8] = *tail++ >> (8 - (bulk_bits % 8));
   }
 
   // handle last bit when TMS=1
   if (flip_tms) {
-    uint8_t last_bit;
-    while (ftdi_read_data(ftdi, &last_bit, 1) != 1)
-      ;
+    uint8_t last_bit = *tail;
+    if (bulk_bits % 8 == 0) {
+      recv[(num_bits - 1) / 8] = 0;
+    }
 
     // the bit read is at BIT 7
     recv[(num_bits - 1) / 8] |= ((last_bit >> 7) & 1) << ((num_bits - 1) % 8);
   }
+}
 
+bool mpsse_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits, bool flip_tms) {
+  if (!mpsse_buffer_is_empty())
+  {
+    if (!mpsse_buffer_ensure_space(1))
+      return false;
+    // flush FTDI buffers after all write commands are sent
+    mpsse_buffer_append_byte(SEND_IMMEDIATE);
+    // send all write commands
+    if (!mpsse_buffer_flush())
+      return false;
+  }
+
+  // whole bytes of tdo are read straight into recv, only the partial byte
+  // and the bit sent along TMS need decoding
+  size_t whole_bytes = (flip_tms ? num_bits - 1 : num_bits) / 8;
+  uint8_t tail[2];
+  size_t tail_bytes = mpsse_tdo_raw_bytes(num_bits, flip_tms) - whole_bytes;
+  if (whole_bytes && !ftdi_read_full(ftdi, recv, whole_bytes))
+    return false;
+  if (tail_bytes && !ftdi_read_full(ftdi, tail, tail_bytes))
+    return false;
+  mpsse_decode_tail(tail, recv, num_bits, flip_tms);
   return true;
 }
 
+size_t mpsse_tdo_raw_bytes(size_t num_bits, bool flip_tms) {
+  size_t bulk_bits = num_bits;
+  if (flip_tms) {
+    // last bit should be sent along TMS 0->1
+    bulk_bits -= 1;
+  }
+  return (bulk_bits + 7) / 8 + (flip_tms ? 1 : 0);
+}
+
+void mpsse_decode_tdo(const uint8_t *raw, uint8_t *recv, size_t num_bits,
+                      bool flip_tms) {
+  size_t whole_bytes = (flip_tms ? num_bits - 1 : num_bits) / 8;
+  memcpy(recv, raw, whole_bytes);
+  mpsse_decode_tail(&raw[whole_bytes], recv, num_bits, flip_tms);
+}
+
 bool mpsse_set_tck_freq(uint64_t freq_mhz) {
   // send any pending commands
   if (!mpsse_buffer_flush())
@@ -244,18 +271,20 @@ bool mpsse_jtag_clock_tck(size_t times) {
   if (!mpsse_buffer_flush())
     return false;
   size_t times_8 = times / 8;
-  if (times_8) {
-    // Clock For n x 8 bits with no data transfer
+  while (times_8) {
+    // Clock For n x 8 bits with no data transfer, n has 16 bits
+    size_t len = std::min(times_8, (size_t)0x10000);
     uint8_t buf[256] = {
         0x8F,
-        (uint8_t)((times_8 - 1) & 0xFF),
-        (uint8_t)((times_8 - 1) >> 8),
+        (uint8_t)((len - 1) & 0xFF),
+        (uint8_t)((len - 1) >> 8),
     };
     if (!ftdi_write_retry(ftdi, buf, 3)) {
       printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
              ftdi_get_error_string(ftdi));
       return false;
     }
+    times_8 -= len;
   }
 
   if (times % 8) {
@@ -281,4 +310,9 @@ driver mpsse_driver = {
     .jtag_scan_chain_send = mpsse_jtag_scan_chain_send,
     .jtag_scan_chain_recv = mpsse_jtag_scan_chain_recv,
     .jtag_clock_tck = mpsse_jtag_clock_tck,
+    .flush = mpsse_buffer_flush,
+    .max_pending_read_bytes = 0,
+    .image_encoding = Image_MPSSE,
+    .tdo_raw_bytes = mpsse_tdo_raw_bytes,
+    .decode_tdo = mpsse_decode_tdo,
 };
\ No newline at end of file
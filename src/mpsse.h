@@ -17,6 +17,11 @@ bool mpsse_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
 bool mpsse_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits, bool flip_tms);
 bool mpsse_jtag_clock_tck(size_t times);
 
+// tdo read back from usb, used by images
+size_t mpsse_tdo_raw_bytes(size_t num_bits, bool flip_tms);
+void mpsse_decode_tdo(const uint8_t *raw, uint8_t *recv, size_t num_bits,
+                      bool flip_tms);
+
 extern driver mpsse_driver;
 
 #endif
\ No newline at end of file
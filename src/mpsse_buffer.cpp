@@ -5,14 +5,42 @@
 
 #define BUFFER_LENGTH 8192
 #define MAX_TRANSFER_LENGTH 2048
-static uint8_t mpsse_buffer[BUFFER_LENGTH];
-static size_t mpsse_buffer_pos = 0;
-static struct ftdi_context* mpsse_ftdi = NULL;
+// per thread for fanout workers, see fanout.h
+// commands are encoded in place into usbfs memory when the kernel provides
+// it, so that the bulk transfer is not copied again into the kernel, and
+// into mpsse_host_buffer otherwise or without a device (image compile)
+static thread_local uint8_t mpsse_host_buffer[BUFFER_LENGTH];
+static thread_local uint8_t *mpsse_buffer = NULL;
+static thread_local bool mpsse_buffer_dev_mem = false;
+static thread_local size_t mpsse_buffer_pos = 0;
+static thread_local struct ftdi_context* mpsse_ftdi = NULL;
 
 void mpsse_buffer_init(struct ftdi_context *ftdi)
 {
+  mpsse_buffer_deinit();
   mpsse_buffer_pos = 0;
   mpsse_ftdi = ftdi;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  mpsse_buffer = libusb_dev_mem_alloc(ftdi->usb_dev, BUFFER_LENGTH);
+  mpsse_buffer_dev_mem = mpsse_buffer != NULL;
+#endif
+  if (!mpsse_buffer) {
+    mpsse_buffer = mpsse_host_buffer;
+  }
+  dprintf("MPSSE buffer in %s memory\n",
+          mpsse_buffer_dev_mem ? "usbfs" : "host");
+}
+
+void mpsse_buffer_deinit()
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  if (mpsse_buffer_dev_mem) {
+    libusb_dev_mem_free(mpsse_ftdi->usb_dev, mpsse_buffer, BUFFER_LENGTH);
+  }
+#endif
+  mpsse_buffer = NULL;
+  mpsse_buffer_dev_mem = false;
+  mpsse_buffer_pos = 0;
 }
 
 bool mpsse_buffer_flush() {
@@ -34,6 +62,9 @@ bool mpsse_buffer_is_empty() {
 }
 
 bool mpsse_buffer_ensure_space(size_t num_bytes) {
+  if (!mpsse_buffer) {
+    mpsse_buffer = mpsse_host_buffer;
+  }
   if (num_bytes >= BUFFER_LENGTH) {
     printf("MPSSE buffer too small\n");
     return false;
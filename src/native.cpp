@@ -0,0 +1,479 @@
+#include "common.h"
+#include "jrs_protocol.h"
+#include "dmi.h"
+#include "program.h"
+#include <deque>
+#include <list>
+
+// native protocol, see client/jrs_protocol.h for the wire format
+
+// socket receive ring
+const size_t NATIVE_SOCKET_BUFFER_SIZE = 1 << 20;
+// payload bytes handed to the adapter at a time
+const size_t NATIVE_CHUNK_BYTES = MAX_PENDING_READ_BYTES;
+
+bool jtag_native_init() {
+  if (!setup_socket_buffer(NATIVE_SOCKET_BUFFER_SIZE)) {
+    return false;
+  }
+  if (!setup_tcp_server(JRS_DEFAULT_PORT)) {
+    return false;
+  }
+
+  printf("Start native server at :%d\n", JRS_DEFAULT_PORT);
+  return true;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+  return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le32(uint8_t *p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+}
+
+// a request waiting for its reply
+struct NativeOp {
+  uint32_t id;
+  uint8_t flags;
+  uint64_t num_bits;
+  std::vector<uint8_t> mask;
+  std::vector<uint8_t> tdo;
+  // reads sent to the adapter but not received yet
+  size_t outstanding;
+  // whole payload handed to the adapter
+  bool parsed;
+  bool failed;
+  bool done;
+  uint8_t status;
+  uint8_t reply[JRS_REPLY_SIZE];
+};
+
+// a read sent to the adapter, received in order
+struct NativeRead {
+  NativeOp *op;
+  size_t offset;
+  size_t num_bits;
+  bool flip_tms;
+};
+
+enum NativeParseState {
+  NATIVE_HEADER,
+  NATIVE_MASK,
+  NATIVE_PAYLOAD,
+  NATIVE_FILL,
+  NATIVE_BUFFERED
+};
+
+// in request order, replies are sent as soon as an op is done
+static std::list<NativeOp> ops;
+static std::deque<NativeRead> pending_reads;
+static size_t pending_read_bytes = 0;
+
+static NativeParseState parse_state = NATIVE_HEADER;
+static uint8_t current_code;
+static NativeOp *current = NULL;
+// bytes of mask or bits of payload consumed
+static size_t current_received;
+static std::vector<uint8_t> scratch;
+// tdi of a fill request, a chunk at a time
+static std::vector<uint8_t> fill;
+// payload of a program or dmi request, run once complete
+static std::vector<uint8_t> buffered;
+
+static bool get_bit(const uint8_t *data, size_t index) {
+  return (data[index / 8] >> (index % 8)) & 1;
+}
+
+static void native_complete(NativeOp *op) {
+  if (!op->tdo.empty()) {
+    if (op->flags & JRS_FLAG_TDO_MASK) {
+      // drop bits that were not read
+      for (size_t i = 0; i < op->tdo.size(); i++) {
+        op->tdo[i] &= op->mask[i];
+      }
+    } else if (op->num_bits % 8) {
+      op->tdo.back() &= (1 << (op->num_bits % 8)) - 1;
+    }
+  }
+
+  put_le32(&op->reply[0], op->id);
+  if (op->status == JRS_STATUS_OK && op->failed) {
+    op->status = JRS_STATUS_ADAPTER_ERROR;
+  }
+  op->reply[4] = op->status;
+  op->reply[5] = 0;
+  op->reply[6] = 0;
+  op->reply[7] = 0;
+  put_le32(&op->reply[8], op->tdo.size());
+  op->done = true;
+}
+
+static void native_recv_one() {
+  NativeRead read = pending_reads.front();
+  pending_reads.pop_front();
+  pending_read_bytes -= (read.num_bits + 7) / 8;
+
+  NativeOp *op = read.op;
+  bool ok;
+  if (read.offset % 8 == 0) {
+    // later reads overwrite the bits past the end
+    ok = jtag_scan_chain_recv(&op->tdo[read.offset / 8], read.num_bits,
+                              read.flip_tms);
+  } else {
+    scratch.resize((read.num_bits + 7) / 8);
+    ok = jtag_scan_chain_recv(scratch.data(), read.num_bits, read.flip_tms);
+    copy_bits(op->tdo.data(), read.offset, scratch.data(), 0, read.num_bits);
+  }
+  if (!ok) {
+    op->failed = true;
+  }
+
+  op->outstanding--;
+  if (op->outstanding == 0 && op->parsed) {
+    native_complete(op);
+  }
+}
+
+static void native_recv_all() {
+  while (!pending_reads.empty()) {
+    native_recv_one();
+  }
+}
+
+// send bits [begin, begin + num_bits) of data, which starts at bit offset of
+// the scan
+static void native_scan_send(const uint8_t *data, size_t begin,
+                             size_t num_bits, size_t offset, bool flip_tms,
+                             bool do_read) {
+  const uint8_t *send = &data[begin / 8];
+  if (begin % 8) {
+    scratch.resize((num_bits + 7) / 8);
+    copy_bits(scratch.data(), 0, data, begin, num_bits);
+    send = scratch.data();
+  }
+  if (!jtag_scan_chain_send(send, num_bits, flip_tms, do_read)) {
+    current->failed = true;
+    return;
+  }
+
+  if (do_read) {
+    pending_reads.push_back(
+        NativeRead{current, offset + begin, num_bits, flip_tms});
+    pending_read_bytes += (num_bits + 7) / 8;
+    current->outstanding++;
+    if (pending_read_bytes >= adapter_max_pending_read_bytes()) {
+      native_recv_all();
+    }
+  }
+}
+
+// send a chunk of tdi starting at bit offset of the scan
+static void native_scan_chunk(const uint8_t *data, size_t offset,
+                              size_t num_bits, bool last) {
+  bool flip_tms = last && (current->flags & JRS_FLAG_FLIP_TMS);
+  if (!(current->flags & JRS_FLAG_TDO_MASK)) {
+    native_scan_send(data, 0, num_bits, offset, flip_tms,
+                     current->flags & JRS_FLAG_TDO_ALL);
+    return;
+  }
+
+  // split into runs of read and skipped bits
+  const uint8_t *mask = current->mask.data();
+  size_t begin = 0;
+  while (begin < num_bits) {
+    bool do_read = get_bit(mask, offset + begin);
+    uint8_t same = do_read ? 0xFF : 0x00;
+    size_t end = begin + 1;
+    while (end < num_bits) {
+      if ((offset + end) % 8 == 0 && end + 8 <= num_bits &&
+          mask[(offset + end) / 8] == same) {
+        // whole byte of the same kind
+        end += 8;
+      } else if (get_bit(mask, offset + end) == do_read) {
+        end++;
+      } else {
+        break;
+      }
+    }
+    native_scan_send(data, begin, end - begin, offset,
+                     flip_tms && end == num_bits, do_read);
+    begin = end;
+  }
+}
+
+static void native_finish_current() {
+  current->parsed = true;
+  if (current->outstanding == 0) {
+    native_complete(current);
+  }
+  current = NULL;
+  parse_state = NATIVE_HEADER;
+}
+
+static void native_reset() {
+  // tdo already requested from the adapter has to be drained
+  native_recv_all();
+  dmi_reset();
+  ops.clear();
+  pending_read_bytes = 0;
+  parse_state = NATIVE_HEADER;
+  current = NULL;
+}
+
+// parse and execute as much as available, false if more data is needed
+static bool native_parse() {
+  size_t available = buffer_end - buffer_begin;
+  const uint8_t *p = &buffer[buffer_begin];
+
+  if (parse_state == NATIVE_HEADER) {
+    if (available < JRS_REQUEST_SIZE) {
+      return false;
+    }
+    buffer_begin += JRS_REQUEST_SIZE;
+
+    ops.push_back(NativeOp());
+    current = &ops.back();
+    current_code = p[0];
+    current->id = get_le32(&p[4]);
+    current->flags = p[1];
+    current->num_bits = get_le64(&p[8]);
+    current->outstanding = 0;
+    current->parsed = false;
+    current->failed = false;
+    current->done = false;
+    current->status = JRS_STATUS_OK;
+    current_received = 0;
+    uint64_t arg = current->num_bits;
+    dprintf("Native op %d id %u flags %x arg %llu\n", current_code,
+            current->id, current->flags, (unsigned long long)arg);
+
+    bool ok = true;
+    switch (current_code) {
+    case JRS_OP_HELLO:
+      current->tdo.resize(8);
+      put_le32(&current->tdo[0], JRS_VERSION);
+      put_le32(&current->tdo[4], JRS_MAX_BITS);
+      break;
+    case JRS_OP_RESET:
+      ok = jtag_goto_tlr();
+      break;
+    case JRS_OP_TMS:
+    case JRS_OP_SCAN:
+      if (arg > JRS_MAX_BITS) {
+        printf("Unexpected native length %llu\n", (unsigned long long)arg);
+        return false;
+      }
+      if (current_code == JRS_OP_SCAN &&
+          (current->flags & (JRS_FLAG_TDO_ALL | JRS_FLAG_TDO_MASK))) {
+        current->tdo.assign((arg + 7) / 8, 0);
+      }
+      if (current_code == JRS_OP_SCAN &&
+          (current->flags & JRS_FLAG_TDO_MASK)) {
+        current->mask.resize((arg + 7) / 8);
+        parse_state = NATIVE_MASK;
+      } else {
+        parse_state = NATIVE_PAYLOAD;
+      }
+      if (arg > 0) {
+        return true;
+      }
+      break;
+    case JRS_OP_FILL:
+      if (arg > JRS_MAX_BITS) {
+        printf("Unexpected native length %llu\n", (unsigned long long)arg);
+        return false;
+      }
+      current->flags &= ~JRS_FLAG_TDO_MASK;
+      if (current->flags & JRS_FLAG_TDO_ALL) {
+        current->tdo.assign((arg + 7) / 8, 0);
+      }
+      // the tdi byte is always sent
+      parse_state = NATIVE_FILL;
+      return true;
+    case JRS_OP_CLOCK:
+      if (arg > JRS_MAX_CLOCK_CYCLES) {
+        printf("Unexpected native clock count %llu\n",
+               (unsigned long long)arg);
+        return false;
+      }
+      ok = jtag_clock_tck(arg);
+      break;
+    case JRS_OP_SET_FREQ:
+      ok = adapter_set_tck_freq(arg);
+      break;
+    case JRS_OP_GOTO_STATE:
+      ok = arg <= UpdateIR && jtag_tms_seq_to((JtagState)arg);
+      break;
+    case JRS_OP_SYNC:
+      native_recv_all();
+      break;
+    case JRS_OP_PROGRAM:
+    case JRS_OP_DMI:
+      if (arg > (current_code == JRS_OP_PROGRAM ? JRS_MAX_PROGRAM_BYTES
+                                                : JRS_MAX_DMI_BYTES)) {
+        printf("Unexpected native length %llu\n", (unsigned long long)arg);
+        return false;
+      }
+      // not a bit count, keep the reply as is
+      current->num_bits = 0;
+      current->flags = 0;
+      buffered.resize(arg);
+      parse_state = NATIVE_BUFFERED;
+      return true;
+    default:
+      // payload length is unknown, can not continue
+      printf("Unknown native op %d\n", current_code);
+      return false;
+    }
+
+    if (!ok) {
+      current->failed = true;
+    }
+    native_finish_current();
+    return true;
+  }
+
+  if (parse_state == NATIVE_BUFFERED) {
+    size_t len = std::min(available, buffered.size() - current_received);
+    memcpy(buffered.data() + current_received, p, len);
+    buffer_begin += len;
+    current_received += len;
+    if (current_received < buffered.size()) {
+      return len > 0;
+    }
+
+    // the request reads tdo itself, after the scans before it
+    native_recv_all();
+    if (current_code == JRS_OP_PROGRAM) {
+      ProgramResult result;
+      current->status =
+          program_run(buffered.data(), buffered.size(), result);
+      current->tdo.resize(16);
+      put_le32(&current->tdo[0], result.exit_code);
+      put_le32(&current->tdo[4], result.scans);
+      put_le32(&current->tdo[8], result.tdo);
+      put_le32(&current->tdo[12], result.tdo >> 32);
+    } else {
+      uint32_t completed;
+      current->tdo.assign(4, 0);
+      current->status =
+          dmi_run(buffered.data(), buffered.size(), current->tdo, completed);
+      put_le32(&current->tdo[0], completed);
+    }
+    native_finish_current();
+    return true;
+  }
+
+  if (available == 0) {
+    return false;
+  }
+
+  if (parse_state == NATIVE_MASK) {
+    size_t len = std::min(available, current->mask.size() - current_received);
+    memcpy(&current->mask[current_received], p, len);
+    buffer_begin += len;
+    current_received += len;
+    if (current_received == current->mask.size()) {
+      current_received = 0;
+      parse_state = NATIVE_PAYLOAD;
+    }
+    return true;
+  }
+
+  if (parse_state == NATIVE_FILL) {
+    fill.assign(NATIVE_CHUNK_BYTES, p[0]);
+    buffer_begin += 1;
+    for (size_t offset = 0; offset < current->num_bits;
+         offset += NATIVE_CHUNK_BYTES * 8) {
+      size_t num_bits = std::min((uint64_t)NATIVE_CHUNK_BYTES * 8,
+                                 current->num_bits - offset);
+      native_scan_chunk(fill.data(), offset, num_bits,
+                        offset + num_bits == current->num_bits);
+    }
+    native_finish_current();
+    return true;
+  }
+
+  // NATIVE_PAYLOAD: payload is used in place, a chunk at a time
+  size_t total_bytes = (current->num_bits + 7) / 8;
+  size_t len = std::min(available, total_bytes - current_received / 8);
+  len = std::min(len, NATIVE_CHUNK_BYTES);
+  size_t num_bits =
+      std::min((uint64_t)len * 8, current->num_bits - current_received);
+  bool last = current_received + num_bits == current->num_bits;
+  if (current_code == JRS_OP_TMS) {
+    if (!jtag_tms_seq(p, num_bits)) {
+      current->failed = true;
+    }
+  } else {
+    native_scan_chunk(p, current_received, num_bits, last);
+  }
+  buffer_begin += len;
+  current_received += num_bits;
+  if (last) {
+    native_finish_current();
+  }
+  return true;
+}
+
+// send replies of finished ops
+static void native_flush_replies() {
+  std::vector<struct iovec> iov;
+  for (auto &op : ops) {
+    if (op.done) {
+      iov.push_back(iovec{op.reply, JRS_REPLY_SIZE});
+      if (!op.tdo.empty()) {
+        iov.push_back(iovec{op.tdo.data(), op.tdo.size()});
+      }
+    }
+  }
+  if (iov.empty()) {
+    return;
+  }
+
+  client_writev(iov.data(), iov.size());
+  for (auto it = ops.begin(); it != ops.end();) {
+    if (it->done) {
+      it = ops.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void jtag_native_tick() {
+  if (client_fd >= 0) {
+    if (!read_socket()) {
+      native_reset();
+      return;
+    }
+
+    while (native_parse()) {
+    }
+    if (parse_state == NATIVE_HEADER && current != NULL) {
+      // bad request
+      native_reset();
+      printf("JTAG debugger detached\n");
+      client_close();
+      return;
+    }
+
+    if (!client_readable(0)) {
+      // nothing more to batch with, read tdo back
+      native_recv_all();
+    }
+    native_flush_replies();
+  } else {
+    // accept connection
+    try_accept();
+  }
+}
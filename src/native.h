@@ -0,0 +1,7 @@
+#ifndef __NATIVE_H__
+#define __NATIVE_H__
+
+bool jtag_native_init();
+void jtag_native_tick();
+
+#endif
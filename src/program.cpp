@@ -0,0 +1,173 @@
+#include "program.h"
+#include "jrs_protocol.h"
+#include <sys/time.h>
+
+// a program is stopped after this long
+const uint64_t PROGRAM_MAX_MS = 10000;
+// RUNTEST cycles are clocked at most this many at a time, so that the
+// deadline is checked in between
+const uint32_t PROGRAM_CLOCK_CHUNK = 1 << 20;
+
+static uint64_t now_ms() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+  return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+// operand bytes after the opcode
+static size_t operand_size(uint8_t op) {
+  switch (op) {
+  case JRS_PROG_EXIT:
+  case JRS_PROG_RUNTEST:
+  case JRS_PROG_JUMP:
+  case JRS_PROG_NEXT:
+    return 4;
+  case JRS_PROG_IR:
+  case JRS_PROG_DR:
+    return 9;
+  case JRS_PROG_BRANCH_EQ:
+  case JRS_PROG_BRANCH_NE:
+    return 20;
+  case JRS_PROG_LOOP:
+    return 8;
+  default:
+    return 0;
+  }
+}
+
+static bool program_scan(bool ir, size_t num_bits, uint64_t value,
+                         uint64_t &tdo) {
+  uint8_t tdi[8], recv[8] = {};
+  for (int i = 0; i < 8; i++) {
+    tdi[i] = value >> (i * 8);
+  }
+  if (ir) {
+    // programs poll status bits in the ir capture, always shift
+    jtag_ir_cache_invalidate();
+    if (!jtag_ir_scan(tdi, recv, num_bits)) {
+      return false;
+    }
+  } else {
+    if (!jtag_tms_seq_to(JtagState::ShiftDR) ||
+        !jtag_scan_chain_send(tdi, num_bits, true, true) ||
+        !jtag_scan_chain_recv(recv, num_bits, true)) {
+      return false;
+    }
+  }
+  if (!jtag_tms_seq_to(JtagState::RunTestIdle)) {
+    return false;
+  }
+
+  tdo = 0;
+  for (int i = 0; i < 8; i++) {
+    tdo |= (uint64_t)recv[i] << (i * 8);
+  }
+  if (num_bits < 64) {
+    tdo &= ((uint64_t)1 << num_bits) - 1;
+  }
+  return true;
+}
+
+int program_run(const uint8_t *code, size_t len, ProgramResult &result) {
+  result = ProgramResult{};
+  uint64_t deadline = now_ms() + PROGRAM_MAX_MS;
+  uint32_t loop_count = 0;
+  uint64_t loop_deadline = 0;
+  // when the clocks queued so far are done, at freq_mhz
+  uint64_t clock_done_ms = 0;
+
+  size_t pc = 0;
+  while (pc < len) {
+    uint8_t op = code[pc];
+    const uint8_t *arg = &code[pc + 1];
+    size_t size = operand_size(op);
+    if (size == 0 || pc + 1 + size > len) {
+      printf("Bad program instruction at %zu\n", pc);
+      return JRS_STATUS_PROGRAM_ERROR;
+    }
+    size_t next = pc + 1 + size;
+    uint32_t target = next;
+
+    switch (op) {
+    case JRS_PROG_EXIT:
+      result.exit_code = get_le32(arg);
+      return JRS_STATUS_OK;
+    case JRS_PROG_IR:
+    case JRS_PROG_DR:
+      if (arg[0] == 0 || arg[0] > 64) {
+        printf("Bad program scan length %d at %zu\n", arg[0], pc);
+        return JRS_STATUS_PROGRAM_ERROR;
+      }
+      if (!program_scan(op == JRS_PROG_IR, arg[0], get_le64(&arg[1]),
+                        result.tdo)) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+      result.scans++;
+      break;
+    case JRS_PROG_RUNTEST: {
+      if (!jtag_tms_seq_to(JtagState::RunTestIdle)) {
+        return JRS_STATUS_ADAPTER_ERROR;
+      }
+      uint32_t cycles = get_le32(arg);
+      while (cycles > 0) {
+        uint32_t len = std::min(cycles, PROGRAM_CLOCK_CHUNK);
+        clock_done_ms = std::max(clock_done_ms, now_ms()) +
+                        (len + freq_mhz * 1000 - 1) / (freq_mhz * 1000);
+        if (clock_done_ms >= deadline) {
+          printf("Program exceeded %llu ms\n",
+                 (unsigned long long)PROGRAM_MAX_MS);
+          return JRS_STATUS_PROGRAM_ERROR;
+        }
+        if (!jtag_clock_tck(len)) {
+          return JRS_STATUS_ADAPTER_ERROR;
+        }
+        cycles -= len;
+      }
+      break;
+    }
+    case JRS_PROG_BRANCH_EQ:
+    case JRS_PROG_BRANCH_NE:
+      if (((result.tdo & get_le64(&arg[0])) == get_le64(&arg[8])) ==
+          (op == JRS_PROG_BRANCH_EQ)) {
+        target = get_le32(&arg[16]);
+      }
+      break;
+    case JRS_PROG_JUMP:
+      target = get_le32(arg);
+      break;
+    case JRS_PROG_LOOP:
+      loop_count = get_le32(&arg[0]);
+      loop_deadline = get_le32(&arg[4]) ? now_ms() + get_le32(&arg[4]) : 0;
+      break;
+    case JRS_PROG_NEXT:
+      if (loop_count > 0) {
+        loop_count--;
+      }
+      if (loop_count > 0 && (!loop_deadline || now_ms() < loop_deadline)) {
+        target = get_le32(arg);
+      }
+      break;
+    }
+
+    // backward jumps are where a program can spin
+    if (target <= pc && now_ms() >= deadline) {
+      printf("Program exceeded %llu ms\n", (unsigned long long)PROGRAM_MAX_MS);
+      return JRS_STATUS_PROGRAM_ERROR;
+    }
+    if (target > len) {
+      printf("Bad program target %u at %zu\n", target, pc);
+      return JRS_STATUS_PROGRAM_ERROR;
+    }
+    pc = target;
+  }
+  return JRS_STATUS_OK;
+}
@@ -0,0 +1,19 @@
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#include "common.h"
+
+// run a jtag program next to the adapter, e.g. to poll a status register
+// without a round trip per iteration, see jrs_program_op for the encoding
+
+struct ProgramResult {
+  uint32_t exit_code;
+  uint32_t scans;
+  // tdo of the last scan
+  uint64_t tdo;
+};
+
+// returns a jrs_status, earlier scans must have been received
+int program_run(const uint8_t *code, size_t len, ProgramResult &result);
+
+#endif
@@ -1,6 +1,12 @@
 #include "common.h"
 
+// socket receive ring
+const size_t RBB_SOCKET_BUFFER_SIZE = 1 << 16;
+
 bool jtag_rbb_init() {
+  if (!setup_socket_buffer(RBB_SOCKET_BUFFER_SIZE)) {
+    return false;
+  }
   if (!setup_tcp_server(12345)) {
     return false;
   }
@@ -9,117 +15,232 @@ bool jtag_rbb_init() {
   return true;
 }
 
-void jtag_rbb_tick() {
-  if (client_fd >= 0) {
-    char tms_input[BUFFER_SIZE];
-    char tdi_input[BUFFER_SIZE];
-    char read_input[BUFFER_SIZE];
-    char read_buffer[BUFFER_SIZE];
-    char send_buffer[BUFFER_SIZE];
-
-    ssize_t num_read = read(client_fd, read_buffer, sizeof(read_buffer));
-    if (num_read <= 0) {
-      // remote socket closed
-      printf("JTAG debugger detached\n");
-      close(client_fd);
-      client_fd = -1;
-      return;
+// bits collected across reads until the window is executed
+const size_t RBB_WINDOW_BITS = 1 << 20;
+
+struct PendingScan {
+  size_t begin;
+  size_t end;
+  bool flip_tms;
+};
+
+static std::vector<uint8_t> tms_input;
+static std::vector<uint8_t> tdi_input;
+static std::vector<uint8_t> read_input;
+static std::vector<uint8_t> tdo_output;
+static size_t bits = 0;
+static size_t read_bits = 0;
+// levels of the last falling edge
+static int edge_tms = 0;
+static int edge_tdi = 0;
+// the next rising edge was already clocked to answer a read
+static bool edge_clocked = false;
+
+static std::vector<uint8_t> scan_buffer;
+static std::vector<PendingScan> pending_scans;
+static size_t pending_read_bytes = 0;
+
+static void rbb_set_bit(std::vector<uint8_t> &vec, size_t pos, int bit) {
+  if (vec.size() <= pos / 8) {
+    vec.resize(pos / 8 + 1, 0);
+  }
+  vec[pos / 8] |= bit << (pos % 8);
+}
+
+static int rbb_get_bit(const std::vector<uint8_t> &vec, size_t pos) {
+  if (vec.size() <= pos / 8) {
+    return 0;
+  }
+  return (vec[pos / 8] >> (pos % 8)) & 1;
+}
+
+static void rbb_recv_pending() {
+  for (auto &scan : pending_scans) {
+    size_t len = scan.end - scan.begin;
+    scan_buffer.assign((len + 7) / 8, 0);
+    jtag_scan_chain_recv(scan_buffer.data(), len, scan.flip_tms);
+    copy_bits(tdo_output.data(), scan.begin, scan_buffer.data(), 0, len);
+  }
+  pending_scans.clear();
+  pending_read_bytes = 0;
+}
+
+// bits sent to the adapter in one scan
+const size_t RBB_CHUNK_BITS = MAX_PENDING_READ_BYTES * 8;
+
+// send [begin, end) of tdi in chunks, read back later
+static void rbb_scan(size_t begin, size_t end, bool flip_tms, bool do_read) {
+  while (begin < end) {
+    size_t chunk_end = std::min(end, begin + RBB_CHUNK_BITS);
+    size_t len = chunk_end - begin;
+    bool last = chunk_end == end;
+    scan_buffer.assign((len + 7) / 8, 0);
+    copy_bits(scan_buffer.data(), 0, tdi_input.data(), begin, len);
+    jtag_scan_chain_send(scan_buffer.data(), len, last && flip_tms, do_read);
+    if (do_read) {
+      PendingScan scan;
+      scan.begin = begin;
+      scan.end = chunk_end;
+      scan.flip_tms = last && flip_tms;
+      pending_scans.push_back(scan);
+      pending_read_bytes += (len + 7) / 8;
+      if (pending_read_bytes >= adapter_max_pending_read_bytes()) {
+        rbb_recv_pending();
+      }
     }
+    begin = chunk_end;
+  }
+}
 
-    size_t bits = 0;
-    size_t read_bits = 0;
-    memset(tms_input, 0, (num_read + 7) / 8);
-    memset(tdi_input, 0, (num_read + 7) / 8);
-    memset(read_input, 0, (num_read + 7) / 8);
-    for (int i = 0; i < num_read; i++) {
-      char command = read_buffer[i];
-      if ('0' <= command && command <= '7') {
-        // set
-        char offset = command - '0';
-        int tck = (offset >> 2) & 1;
-        int tms = (offset >> 1) & 1;
-        int tdi = (offset >> 0) & 1;
-        if (tck) {
-          tms_input[bits / 8] |= tms << (bits % 8);
-          tdi_input[bits / 8] |= tdi << (bits % 8);
-          bits++;
+// execute collected bits and answer reads
+static void rbb_execute() {
+  if (bits == 0) {
+    return;
+  }
+  tms_input.resize(bits / 8 + 1, 0);
+  tdi_input.resize(bits / 8 + 1, 0);
+  tdo_output.assign(bits / 8 + 1, 0);
+
+  dprintf(" tms:");
+  print_bitvec(tms_input.data(), bits);
+  dprintf("\n");
+  dprintf(" tdi:");
+  print_bitvec(tdi_input.data(), bits);
+  dprintf("\n");
+
+  JtagState cur_state = state;
+  std::vector<Region> regions =
+      analyze_bitbang(tms_input.data(), bits, cur_state);
+
+  for (auto region : regions) {
+    assert(region.begin < region.end && region.end <= bits);
+    dprintf("[%d:%d]: %s\n", region.begin, region.end,
+            region.is_tms ? "TMS" : "DATA");
+    if (region.is_tms) {
+      // tdo is not driven outside shift states, reads there return zero
+      scan_buffer.assign((region.length() + 7) / 8, 0);
+      copy_bits(scan_buffer.data(), 0, tms_input.data(), region.begin,
+                region.length());
+      jtag_tms_seq(scan_buffer.data(), region.length());
+    } else {
+      // split into runs with and without read
+      size_t run_begin = region.begin;
+      while (run_begin < (size_t)region.end) {
+        int do_read = rbb_get_bit(read_input, run_begin);
+        size_t run_end = run_begin + 1;
+        while (run_end < (size_t)region.end &&
+               rbb_get_bit(read_input, run_end) == do_read) {
+          run_end++;
         }
-      } else if (command == 'R') {
-        // read
-        // NOTE: We made assumption of when OpenOCD sends the 'R' command
-        read_input[bits / 8] |= 1 << (bits % 8);
-        read_bits++;
-      } else if (command == 'r' || command == 's') {
-        // trst = 0;
-      } else if (command == 't' || command == 'u') {
-        // trst = 1;
+        bool flip_tms = run_end == (size_t)region.end && region.flip_tms;
+        rbb_scan(run_begin, run_end, flip_tms, do_read);
+        run_begin = run_end;
       }
     }
+  }
+  assert(cur_state == state);
+  rbb_recv_pending();
 
-    dprintf(" tms:");
-    print_bitvec((unsigned char *)tms_input, bits);
-    dprintf("\n");
-    dprintf(" tdi:");
-    print_bitvec((unsigned char *)tdi_input, bits);
-    dprintf("\n");
-    dprintf("read:");
-    print_bitvec((unsigned char *)read_input, bits);
-    dprintf("\n");
-
-    JtagState cur_state = state;
-    std::vector<Region> regions =
-        analyze_bitbang((uint8_t *)tms_input, bits, cur_state);
-
-    uint32_t actual_read_bits = 0;
-    for (auto region : regions) {
-      assert(region.begin < region.end && region.end <= bits);
-      dprintf("[%d:%d]: %s\n", region.begin, region.end,
-              region.is_tms ? "TMS" : "DATA");
-      if (region.is_tms) {
-        uint8_t tms_buffer[BUFFER_SIZE] = {};
-        for (int i = region.begin; i < region.end; i++) {
-          uint8_t tms_bit = (tms_input[i / 8] >> (i % 8)) & 0x1;
-          int off = i - region.begin;
-          tms_buffer[off / 8] |= tms_bit << (off % 8);
-        }
-        jtag_tms_seq(tms_buffer, region.length());
-      } else {
-        uint8_t tdi_buffer[BUFFER_SIZE] = {};
-        bool do_read = false;
-        for (int i = region.begin; i < region.end; i++) {
-          uint8_t tdi_bit = (tdi_input[i / 8] >> (i % 8)) & 0x1;
-          int off = i - region.begin;
-          tdi_buffer[off / 8] |= tdi_bit << (off % 8);
-
-          uint8_t read_bit = (read_input[i / 8] >> (i % 8)) & 0x1;
-          if (read_bit) {
-            do_read = true;
-          }
-          // verify our assumption: all read_bit remains the same
-          assert(do_read == read_bit);
-        }
+  // answer reads in order
+  std::vector<uint8_t> send_buffer;
+  send_buffer.reserve(read_bits);
+  for (size_t i = 0; i < bits; i++) {
+    if (rbb_get_bit(read_input, i)) {
+      send_buffer.push_back(rbb_get_bit(tdo_output, i) ? '1' : '0');
+    }
+  }
+  if (!send_buffer.empty()) {
+    client_write(send_buffer.data(), send_buffer.size());
+  }
 
-        uint8_t tdo_buffer[BUFFER_SIZE] = {};
-        jtag_scan_chain(tdi_buffer, tdo_buffer, region.length(),
-                        region.flip_tms, do_read);
+  // a read of the next bit stays pending
+  int next_read = rbb_get_bit(read_input, bits);
+  read_bits -= send_buffer.size();
+  tms_input.clear();
+  tdi_input.clear();
+  read_input.clear();
+  bits = 0;
+  if (next_read) {
+    rbb_set_bit(read_input, 0, 1);
+  }
+}
 
-        // handle read
-        if (do_read) {
-          actual_read_bits += region.length();
-          for (int i = 0; i < region.length(); i++) {
-            uint8_t tdo_bit = (tdo_buffer[i / 8] >> (i % 8)) & 0x1;
+static void rbb_reset() {
+  tms_input.clear();
+  tdi_input.clear();
+  read_input.clear();
+  bits = 0;
+  read_bits = 0;
+  edge_clocked = false;
+}
 
-            send_buffer[i] = tdo_bit ? '1' : '0';
-          }
+void jtag_rbb_tick() {
+  if (client_fd >= 0) {
+    // gather everything already waiting on the socket
+    do {
+      if (!read_socket()) {
+        // remote socket closed
+        rbb_execute();
+        rbb_reset();
+        return;
+      }
 
-          write_full(client_fd, (uint8_t *)send_buffer, region.length());
+      for (; buffer_begin < buffer_end; buffer_begin++) {
+        char command = buffer[buffer_begin];
+        if ('0' <= command && command <= '7') {
+          // set
+          char offset = command - '0';
+          int tck = (offset >> 2) & 1;
+          int tms = (offset >> 1) & 1;
+          int tdi = (offset >> 0) & 1;
+          if (!tck) {
+            edge_tms = tms;
+            edge_tdi = tdi;
+          } else if (edge_clocked) {
+            edge_clocked = false;
+            if (tms != edge_tms || tdi != edge_tdi) {
+              printf("Remote bitbang rising edge differs from the read before "
+                     "it, closing client\n");
+              rbb_execute();
+              rbb_reset();
+              client_close();
+              return;
+            }
+          } else {
+            rbb_set_bit(tms_input, bits, tms);
+            rbb_set_bit(tdi_input, bits, tdi);
+            bits++;
+          }
+        } else if (command == 'R') {
+          // read: tdo is sampled before the next rising edge
+          rbb_set_bit(read_input, bits, 1);
+          read_bits++;
+        } else if (command == 'r' || command == 's') {
+          // trst = 0;
+        } else if (command == 't' || command == 'u') {
+          // trst = 1;
+        } else if (command == 'Q') {
+          // quit
+          rbb_execute();
+          rbb_reset();
+          printf("JTAG debugger detached\n");
+          client_close();
+          return;
         }
       }
+    } while (bits < RBB_WINDOW_BITS && client_readable(0));
+
+    if (rbb_get_bit(read_input, bits) && !client_readable(0)) {
+      // the client waits for a read before sending the rising edge, clock
+      // it with the levels of the falling edge to sample tdo now
+      rbb_set_bit(tms_input, bits, edge_tms);
+      rbb_set_bit(tdi_input, bits, edge_tdi);
+      bits++;
+      edge_clocked = true;
     }
-    assert(cur_state == state);
-    assert(read_bits == actual_read_bits);
+    rbb_execute();
   } else {
     // accept connection
     try_accept();
   }
-}
\ No newline at end of file
+}
@@ -1,7 +1,7 @@
 #ifndef __RBB_H__
 #define __RBB_H__
 
-void jtag_rbb_init();
+bool jtag_rbb_init();
 void jtag_rbb_tick();
 
 #endif
\ No newline at end of file
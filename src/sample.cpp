@@ -0,0 +1,166 @@
+#include "sample.h"
+#include <deque>
+#include <time.h>
+
+// Exit1-DR -> Update-DR -> Select-DR-Scan -> Capture-DR -> Shift-DR
+const uint8_t RECAPTURE_TMS = 0x03;
+const size_t RECAPTURE_TMS_BITS = 4;
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// where samples go, a file or the client socket
+struct SampleOutput {
+  FILE *fp = NULL;
+  bool socket = false;
+
+  bool open(const char *output, volatile bool *stop) {
+    unsigned int port;
+    if (sscanf(output, "tcp:%u", &port) == 1) {
+      if (port > 65535 || !setup_tcp_server(port)) {
+        return false;
+      }
+      printf("Waiting for a sample client at :%u\n", port);
+      while (client_fd < 0 && !*stop) {
+        try_accept();
+      }
+      socket = true;
+      return client_fd >= 0;
+    }
+    fp = strcmp(output, "-") == 0 ? stdout : fopen(output, "wb");
+    if (!fp) {
+      perror(output);
+      return false;
+    }
+    return true;
+  }
+
+  bool write(const uint8_t *data, size_t len) {
+    if (socket) {
+      return client_write(data, len);
+    }
+    return fwrite(data, 1, len, fp) == len;
+  }
+
+  bool close() {
+    if (socket) {
+      client_close();
+      return true;
+    }
+    bool ok = fflush(fp) == 0;
+    if (fp != stdout) {
+      ok = fclose(fp) == 0 && ok;
+    }
+    return ok;
+  }
+};
+
+bool sample_stream(uint32_t instruction, size_t ir_len, size_t bsr_len,
+                   uint64_t count, const char *output, volatile bool *stop) {
+  if (ir_len == 0 || ir_len > 32 || bsr_len == 0) {
+    printf("Bad sample instruction or register length\n");
+    return false;
+  }
+  SampleOutput out;
+  if (!out.open(output, stop)) {
+    return false;
+  }
+
+  SampleHeader header = {};
+  memcpy(header.magic, SAMPLE_MAGIC, sizeof(SAMPLE_MAGIC));
+  header.version = SAMPLE_VERSION;
+  header.bsr_len = bsr_len;
+  header.freq_mhz = freq_mhz;
+  bool ok = out.write((const uint8_t *)&header, sizeof(header));
+
+  // SAMPLE stays loaded, entering Shift-DR captures the first sample
+  uint8_t ir[4];
+  for (int i = 0; i < 4; i++) {
+    ir[i] = instruction >> (i * 8);
+  }
+  ok = ok && jtag_ir_scan(ir, NULL, ir_len) &&
+       jtag_tms_seq_to(JtagState::ShiftDR);
+
+  // two batches in flight keep the adapter busy while one is received
+  size_t max_bytes = std::max(adapter_max_pending_read_bytes() / 2, (size_t)1);
+  size_t chunk_bits = std::min(bsr_len, max_bytes * 8);
+  size_t sample_bytes = (bsr_len + 7) / 8;
+  size_t batch = std::max(max_bytes / sample_bytes, (size_t)1);
+  size_t record_bytes = sizeof(uint64_t) + sample_bytes;
+  std::vector<uint8_t> tdi(sample_bytes, 0);
+  std::vector<uint8_t> chunk((chunk_bits + 7) / 8);
+  std::vector<uint8_t> records;
+  std::deque<size_t> batches;
+
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t begin = monotonic_ns();
+  uint64_t last_time = 0;
+  while (ok) {
+    // keep the next batch queued behind the one being received
+    while (batches.size() < 2 && (count ? sent < count : !*stop)) {
+      size_t num = count ? std::min((uint64_t)batch, count - sent) : batch;
+      for (size_t i = 0; i < num && ok; i++) {
+        for (size_t offset = 0; offset < bsr_len; offset += chunk_bits) {
+          size_t num_bits = std::min(chunk_bits, bsr_len - offset);
+          ok = ok && jtag_scan_chain_send(tdi.data(), num_bits,
+                                          offset + num_bits == bsr_len, true);
+        }
+        ok = ok && jtag_tms_seq(&RECAPTURE_TMS, RECAPTURE_TMS_BITS);
+      }
+      sent += num;
+      batches.push_back(num);
+    }
+    if (batches.empty() || !ok) {
+      break;
+    }
+
+    size_t num = batches.front();
+    batches.pop_front();
+    records.assign(num * record_bytes, 0);
+    for (size_t i = 0; i < num && ok; i++) {
+      uint8_t *sample = &records[i * record_bytes + sizeof(uint64_t)];
+      for (size_t offset = 0; offset < bsr_len; offset += chunk_bits) {
+        size_t num_bits = std::min(chunk_bits, bsr_len - offset);
+        ok = ok && jtag_scan_chain_recv(chunk.data(), num_bits,
+                                        offset + num_bits == bsr_len);
+        copy_bits(sample, offset, chunk.data(), 0, num_bits);
+      }
+    }
+
+    // spread the batch over the time since the previous one
+    uint64_t now = monotonic_ns() - begin;
+    for (size_t i = 0; i < num; i++) {
+      uint64_t time = last_time + (now - last_time) * (i + 1) / num;
+      memcpy(&records[i * record_bytes], &time, sizeof(time));
+    }
+    last_time = now;
+    received += num;
+    if (ok && !out.write(records.data(), records.size())) {
+      printf("Sample output closed\n");
+      break;
+    }
+  }
+
+  // drain reads still in flight
+  while (!batches.empty()) {
+    for (size_t i = 0; i < batches.front(); i++) {
+      for (size_t offset = 0; offset < bsr_len; offset += chunk_bits) {
+        size_t num_bits = std::min(chunk_bits, bsr_len - offset);
+        jtag_scan_chain_recv(chunk.data(), num_bits,
+                             offset + num_bits == bsr_len);
+      }
+    }
+    batches.pop_front();
+  }
+
+  ok = out.close() && ok;
+  double seconds = last_time / 1e9;
+  printf("%llu samples in %.3f s, %.0f samples/s\n",
+         (unsigned long long)received, seconds,
+         seconds > 0 ? received / seconds : 0.0);
+  return ok;
+}
@@ -0,0 +1,28 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+#include "common.h"
+
+// boundary-scan sampling
+//
+// SAMPLE/PRELOAD is loaded once and the boundary-scan register is captured
+// back to back. The stream is a header followed by one record per sample:
+// 8-byte time in ns since the first sample, then the register, (bsr_len +
+// 7) / 8 bytes. Times are interpolated between usb reads. Native byte order.
+
+const char SAMPLE_MAGIC[8] = {'J', 'R', 'S', 'S', 'M', 'P', 'L', '\0'};
+const uint32_t SAMPLE_VERSION = 1;
+
+struct SampleHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t bsr_len;
+  uint64_t freq_mhz;
+};
+
+// output is a file, - for stdout, or tcp:PORT to serve the first client,
+// count is 0 to sample until stop is set
+bool sample_stream(uint32_t instruction, size_t ir_len, size_t bsr_len,
+                   uint64_t count, const char *output, volatile bool *stop);
+
+#endif
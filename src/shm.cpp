@@ -0,0 +1,217 @@
+#include "shm.h"
+#include "jrs_shm.h"
+#include <poll.h>
+#include <sys/mman.h>
+
+// memfd of the current session, created for each client so that a
+// previous client can not write into the rings of the next one
+static int shm_fd = -1;
+static jrs_shm_control *control = NULL;
+static size_t data_offset = 0;
+// ring to client, mapped twice
+static uint8_t *reply_ring = NULL;
+static size_t ring_size = 0;
+// absolute position of buffer[0] in the ring to server
+static uint64_t shm_base = 0;
+
+bool shm_setup(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  data_offset =
+      (sizeof(jrs_shm_control) + page_size - 1) / page_size * page_size;
+  ring_size = size;
+  // the rings are mapped when a client attaches
+  buffer = NULL;
+  buffer_size = size;
+  buffer_begin = 0;
+  buffer_end = 0;
+  return true;
+}
+
+static bool shm_map() {
+  shm_fd = create_memfd(data_offset + ring_size * 2);
+  if (shm_fd < 0) {
+    return false;
+  }
+
+  control = (jrs_shm_control *)mmap(NULL, data_offset, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, shm_fd, 0);
+  if (control == MAP_FAILED) {
+    perror("mmap");
+    control = NULL;
+    return false;
+  }
+  control->magic = JRS_SHM_MAGIC;
+  control->ring_size = ring_size;
+  control->data_offset = data_offset;
+
+  // requests are parsed in place from the ring to server
+  buffer = map_mirrored(shm_fd, data_offset + ring_size * JRS_SHM_TO_SERVER,
+                        ring_size);
+  reply_ring = map_mirrored(
+      shm_fd, data_offset + ring_size * JRS_SHM_TO_CLIENT, ring_size);
+  return buffer && reply_ring;
+}
+
+bool shm_attach() {
+  shm_base = 0;
+  if (!shm_map()) {
+    return false;
+  }
+
+  // pass the memfd along with a single byte
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int))];
+  } cmsg = {};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg.data;
+  msg.msg_controllen = sizeof(cmsg.data);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &shm_fd, sizeof(int));
+  if (sendmsg(client_fd, &msg, 0) != 1) {
+    perror("sendmsg");
+    return false;
+  }
+  return true;
+}
+
+void shm_detach() {
+  shm_base = 0;
+  if (buffer) {
+    munmap(buffer, ring_size * 2);
+    buffer = NULL;
+  }
+  if (reply_ring) {
+    munmap(reply_ring, ring_size * 2);
+    reply_ring = NULL;
+  }
+  if (control) {
+    munmap(control, data_offset);
+    control = NULL;
+  }
+  if (shm_fd >= 0) {
+    close(shm_fd);
+    shm_fd = -1;
+  }
+}
+
+static uint64_t load(uint64_t *p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+
+static void store(uint64_t *p, uint64_t value) {
+  __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+// wake the client if it waits on this ring
+static void shm_notify(jrs_shm_ring *ring) {
+  if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+    char byte = 0;
+    if (write(client_fd, &byte, 1) < 0) {
+      // detach is noticed on the next read
+    }
+  }
+}
+
+// sleep until a doorbell arrives, false if the client is gone
+static bool shm_wait(int timeout_ms) {
+  struct pollfd pfd = {client_fd, POLLIN, 0};
+  if (poll(&pfd, 1, timeout_ms) <= 0) {
+    return true;
+  }
+
+  char bytes[64];
+  ssize_t res = recv(client_fd, bytes, sizeof(bytes), MSG_DONTWAIT);
+  return res != 0;
+}
+
+bool shm_read() {
+  jrs_shm_ring *ring = &control->ring[JRS_SHM_TO_SERVER];
+  if (buffer_begin >= buffer_size) {
+    // parser moved into the mirror, wrap both offsets
+    shm_base += buffer_size;
+    buffer_begin -= buffer_size;
+    buffer_end -= buffer_size;
+  }
+
+  // release parsed bytes to the client
+  store(&ring->tail, shm_base + buffer_begin);
+  shm_notify(ring);
+
+  // wait for new data unless the ring is full
+  while (load(&ring->head) == shm_base + buffer_end &&
+         buffer_end - buffer_begin < buffer_size) {
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (load(&ring->head) != shm_base + buffer_end) {
+      break;
+    }
+    if (!shm_wait(-1)) {
+      printf("JTAG debugger detached\n");
+      client_close();
+      return false;
+    }
+  }
+  buffer_end = load(&ring->head) - shm_base;
+  return true;
+}
+
+bool shm_readable(int timeout_ms) {
+  if (!control) {
+    // the session is gone
+    return false;
+  }
+  jrs_shm_ring *ring = &control->ring[JRS_SHM_TO_SERVER];
+  if (load(&ring->head) != shm_base + buffer_end) {
+    return true;
+  }
+  if (timeout_ms == 0) {
+    return false;
+  }
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+  if (load(&ring->head) == shm_base + buffer_end) {
+    shm_wait(timeout_ms);
+  }
+  return load(&ring->head) != shm_base + buffer_end;
+}
+
+bool shm_writev(struct iovec *iov, size_t iovcnt) {
+  if (!control) {
+    // the session is gone
+    return false;
+  }
+  jrs_shm_ring *ring = &control->ring[JRS_SHM_TO_CLIENT];
+  uint64_t head = load(&ring->head);
+  for (size_t i = 0; i < iovcnt; i++) {
+    const uint8_t *data = (const uint8_t *)iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    while (len > 0) {
+      size_t space = ring_size - (head - load(&ring->tail));
+      if (space == 0) {
+        // publish what is there and wait for the client to consume
+        store(&ring->head, head);
+        shm_notify(ring);
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (ring_size - (head - load(&ring->tail)) == 0 &&
+            !shm_wait(-1)) {
+          return false;
+        }
+        continue;
+      }
+
+      size_t n = std::min(len, space);
+      memcpy(&reply_ring[head % ring_size], data, n);
+      head += n;
+      data += n;
+      len -= n;
+    }
+  }
+
+  store(&ring->head, head);
+  shm_notify(ring);
+  return true;
+}
@@ -0,0 +1,14 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "common.h"
+
+// shared memory transport, see client/jrs_shm.h
+bool shm_setup(size_t ring_size);
+bool shm_attach();
+void shm_detach();
+bool shm_read();
+bool shm_writev(struct iovec *iov, size_t iovcnt);
+bool shm_readable(int timeout_ms);
+
+#endif
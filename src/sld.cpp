@@ -0,0 +1,175 @@
+#include "sld.h"
+
+const size_t SLD_IR_LEN = 10;
+const uint8_t SLD_USER0[2] = {0x0C, 0x00};
+const uint8_t SLD_USER1[2] = {0x0E, 0x00};
+// manufacturer id field of the hub info
+const uint32_t SLD_MFG_ALTERA = 0x06E;
+// an info word is read as 8 nibbles, one per USER0 dr capture
+const size_t SLD_INFO_NIBBLES = 8;
+// info words read per exchange
+const size_t SLD_INFO_BATCH = 16;
+
+SldHub sld_hub = {};
+// node whose address is in the virtual ir, -1 if unknown
+static int selected_node = -1;
+// last virtual ir value of each node
+static std::vector<uint32_t> node_vir;
+
+void sld_invalidate() {
+  sld_hub = {};
+  selected_node = -1;
+  node_vir.clear();
+}
+
+void sld_vir_invalidate() { selected_node = -1; }
+
+static size_t sld_vir_width() { return sld_hub.addr_bits + sld_hub.vir_bits; }
+
+static uint64_t sld_vir_mask() {
+  return sld_hub.vir_bits >= 32 ? 0xFFFFFFFF : (1ull << sld_hub.vir_bits) - 1;
+}
+
+// read count info words, USER0 must be loaded
+static bool sld_read_info(uint32_t *info, size_t count) {
+  uint8_t zero = 0;
+  for (size_t i = 0; i < count * SLD_INFO_NIBBLES; i++) {
+    if (!jtag_tms_seq_to(JtagState::ShiftDR) ||
+        !jtag_scan_chain_send(&zero, 4, true, true)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    info[i] = 0;
+    for (size_t j = 0; j < SLD_INFO_NIBBLES; j++) {
+      uint8_t nibble = 0;
+      if (!jtag_scan_chain_recv(&nibble, 4, true)) {
+        return false;
+      }
+      info[i] |= (uint32_t)(nibble & 0xF) << (j * 4);
+    }
+  }
+  return true;
+}
+
+bool sld_enumerate() {
+  if (sld_hub.valid) {
+    return true;
+  }
+
+  // virtual ir 0 at address 0 selects the hub info, its width is not known
+  // yet so shift more zeros than any hub has
+  uint8_t zeros[8] = {};
+  if (!jtag_ir_scan(SLD_USER1, NULL, SLD_IR_LEN) ||
+      !jtag_tms_seq_to(JtagState::ShiftDR) ||
+      !jtag_scan_chain(zeros, NULL, sizeof(zeros) * 8, true, false) ||
+      !jtag_ir_scan(SLD_USER0, NULL, SLD_IR_LEN)) {
+    return false;
+  }
+
+  uint32_t info;
+  if (!sld_read_info(&info, 1)) {
+    return false;
+  }
+  if (((info >> 8) & 0x7FF) != SLD_MFG_ALTERA) {
+    printf("No SLD hub found, hub info %08X\n", info);
+    return false;
+  }
+
+  // node info follows the hub info
+  size_t count = (info >> 19) & 0xFF;
+  std::vector<uint32_t> nodes(count);
+  for (size_t i = 0; i < count; i += SLD_INFO_BATCH) {
+    if (!sld_read_info(&nodes[i], std::min(SLD_INFO_BATCH, count - i))) {
+      return false;
+    }
+  }
+
+  size_t addr_bits = 0;
+  while (((size_t)1 << addr_bits) < count + 1) {
+    addr_bits++;
+  }
+  size_t vir_bits = info & 0xFF;
+  if (addr_bits + vir_bits > 64) {
+    printf("Virtual IR of %zu bits is not supported\n", addr_bits + vir_bits);
+    return false;
+  }
+
+  sld_hub.valid = true;
+  sld_hub.info = info;
+  sld_hub.vir_bits = vir_bits;
+  sld_hub.addr_bits = addr_bits;
+  sld_hub.nodes = nodes;
+  node_vir.assign(count, 0);
+  selected_node = -1;
+  printf("Found SLD hub with %zu nodes\n", count);
+  return true;
+}
+
+// shift address and value through USER1
+static bool sld_vir_shift(size_t node, uint32_t value, bool do_read,
+                          SldScan &scan) {
+  if (!sld_hub.valid || node >= sld_hub.nodes.size()) {
+    printf("Bad SLD node %zu\n", node);
+    return false;
+  }
+  uint64_t vir =
+      ((uint64_t)(node + 1) << sld_hub.vir_bits) | (value & sld_vir_mask());
+  uint8_t data[8];
+  for (int i = 0; i < 8; i++) {
+    data[i] = vir >> (i * 8);
+  }
+
+  scan.vir = true;
+  scan.vir_read = do_read;
+  if (!jtag_ir_scan_send(SLD_USER1, SLD_IR_LEN, scan.user1) ||
+      !jtag_tms_seq_to(JtagState::ShiftDR) ||
+      !jtag_scan_chain_send(data, sld_vir_width(), true, do_read)) {
+    return false;
+  }
+  node_vir[node] = value;
+  selected_node = node;
+  return true;
+}
+
+bool sld_vir_send(size_t node, uint32_t value, SldScan &scan) {
+  scan = {};
+  return sld_vir_shift(node, value, true, scan);
+}
+
+bool sld_dr_send(size_t node, SldScan &scan) {
+  scan = {};
+  if (selected_node != (int)node) {
+    if (!sld_vir_shift(node, node < node_vir.size() ? node_vir[node] : 0,
+                       false, scan)) {
+      return false;
+    }
+  }
+  scan.dr = true;
+  return jtag_ir_scan_send(SLD_USER0, SLD_IR_LEN, scan.user0);
+}
+
+bool sld_scan_recv(SldScan &scan, uint32_t *captured) {
+  if (scan.vir) {
+    if (!jtag_ir_scan_recv(NULL, scan.user1)) {
+      return false;
+    }
+    if (scan.vir_read) {
+      uint8_t data[8] = {};
+      if (!jtag_scan_chain_recv(data, sld_vir_width(), true)) {
+        return false;
+      }
+      uint64_t vir = 0;
+      for (int i = 0; i < 8; i++) {
+        vir |= (uint64_t)data[i] << (i * 8);
+      }
+      if (captured) {
+        *captured = vir & sld_vir_mask();
+      }
+    }
+  }
+  if (scan.dr) {
+    return jtag_ir_scan_recv(NULL, scan.user0);
+  }
+  return true;
+}
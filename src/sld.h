@@ -0,0 +1,49 @@
+#ifndef __SLD_H__
+#define __SLD_H__
+
+#include "common.h"
+
+// intel sld hub (virtual jtag) of a device with a 10-bit ir, the virtual ir
+// is shifted through USER1 and the virtual dr through USER0, the device must
+// be the only tap
+
+struct SldHub {
+  bool valid;
+  // hub info: version, node count, manufacturer, max virtual ir length
+  uint32_t info;
+  size_t vir_bits;
+  size_t addr_bits;
+  // node info of each node, node i is at address i + 1
+  std::vector<uint32_t> nodes;
+};
+
+extern SldHub sld_hub;
+
+// read hub and node info unless cached, no scans may be pending
+bool sld_enumerate();
+// forget the hub, e.g. when the chain is scanned again
+void sld_invalidate();
+// a raw dr scan may have changed the virtual ir
+void sld_vir_invalidate();
+
+// scans sent for a virtual access, received in the same order by
+// sld_scan_recv
+struct SldScan {
+  // USER1 ir scan and virtual ir, if the node had to be selected
+  bool vir;
+  IrScan user1;
+  bool vir_read;
+  // USER0 ir scan before a virtual dr scan
+  bool dr;
+  IrScan user0;
+};
+
+// load value into the virtual ir of node, the previous value is captured
+bool sld_vir_send(size_t node, uint32_t value, SldScan &scan);
+// select node and USER0 for a virtual dr scan, the virtual ir is only
+// shifted if another node was selected
+bool sld_dr_send(size_t node, SldScan &scan);
+// captured may be NULL
+bool sld_scan_recv(SldScan &scan, uint32_t *captured);
+
+#endif
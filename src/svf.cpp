@@ -0,0 +1,905 @@
+#include "svf.h"
+#include "image.h"
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string>
+#include <time.h>
+
+// SVF and XSVF players
+//
+// Scans are sent in chunks like the protocol servers do, and expected tdo is
+// only compared once it is read back, so that programming is not slowed down
+// by a round trip per scan. XSVF scans with retries are the exception: they
+// are verified right away to decide whether to retry.
+
+// bits sent to the adapter at a time
+const size_t SVF_CHUNK_BITS = MAX_PENDING_READ_BYTES * 8;
+
+// a scan whose tdo is compared after it is read back
+struct SvfCheck {
+  size_t line;
+  size_t num_bits;
+  std::vector<uint8_t> tdo;
+  std::vector<uint8_t> expected;
+  std::vector<uint8_t> mask;
+  // chunks not received yet
+  size_t outstanding;
+};
+
+struct SvfRead {
+  SvfCheck *check;
+  size_t offset;
+  size_t num_bits;
+  bool flip_tms;
+};
+
+static std::vector<std::unique_ptr<SvfCheck>> checks;
+static std::vector<SvfRead> pending_reads;
+static size_t pending_read_bytes = 0;
+static std::vector<uint8_t> chunk_buffer;
+static bool mismatch = false;
+static uint64_t mismatches = 0;
+// mismatches are not printed while retrying
+static bool quiet = false;
+// line in svf, offset in xsvf
+static const char *location = "Line";
+// tck frequency requested by FREQUENCY, cycles take at least as long as
+// they would at it
+static double requested_hz;
+// tck frequency of the adapter, used to turn times into cycles
+static double tck_hz;
+
+static std::string to_hex(const uint8_t *bits, size_t num_bits) {
+  static const char digits[] = "0123456789ABCDEF";
+  std::string res;
+  for (size_t i = (num_bits + 3) / 4; i-- > 0;) {
+    int digit = (bits[i / 2] >> (i % 2 * 4)) & 0xF;
+    if (i == (num_bits - 1) / 4 && num_bits % 4) {
+      digit &= (1 << (num_bits % 4)) - 1;
+    }
+    res.push_back(digits[digit]);
+  }
+  return res;
+}
+
+static bool tdo_matches(const uint8_t *tdo, const uint8_t *expected,
+                        const uint8_t *mask, size_t num_bits) {
+  for (size_t i = 0; i < (num_bits + 7) / 8; i++) {
+    if ((tdo[i] ^ expected[i]) & mask[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool svf_check_tdo(const char *location, size_t line, const uint8_t *tdo,
+                   const uint8_t *expected, const uint8_t *mask,
+                   size_t num_bits) {
+  if (tdo_matches(tdo, expected, mask, num_bits)) {
+    return true;
+  }
+  printf("%s %zu: TDO mismatch\n", location, line);
+  printf("  TDO:      %s\n", to_hex(tdo, num_bits).c_str());
+  printf("  expected: %s\n", to_hex(expected, num_bits).c_str());
+  printf("  mask:     %s\n", to_hex(mask, num_bits).c_str());
+  return false;
+}
+
+static void svf_compare(SvfCheck *check) {
+  bool ok = quiet ? tdo_matches(check->tdo.data(), check->expected.data(),
+                                check->mask.data(), check->num_bits)
+                  : svf_check_tdo(location, check->line, check->tdo.data(),
+                                  check->expected.data(), check->mask.data(),
+                                  check->num_bits);
+  if (!ok) {
+    mismatch = true;
+    mismatches++;
+  }
+}
+
+static bool svf_recv_pending() {
+  bool ok = true;
+  for (auto &read : pending_reads) {
+    chunk_buffer.assign((read.num_bits + 7) / 8, 0);
+    if (!jtag_scan_chain_recv(chunk_buffer.data(), read.num_bits,
+                              read.flip_tms)) {
+      ok = false;
+    }
+    if (image_recording()) {
+      // tdo is compared when the image is played
+      std::vector<uint8_t> expected(chunk_buffer.size());
+      std::vector<uint8_t> mask(chunk_buffer.size());
+      copy_bits(expected.data(), 0, read.check->expected.data(), read.offset,
+                read.num_bits);
+      copy_bits(mask.data(), 0, read.check->mask.data(), read.offset,
+                read.num_bits);
+      image_record_check(read.check->line, expected.data(), mask.data(),
+                         read.num_bits, read.flip_tms);
+      read.check->outstanding--;
+      continue;
+    }
+    copy_bits(read.check->tdo.data(), read.offset, chunk_buffer.data(), 0,
+              read.num_bits);
+    if (--read.check->outstanding == 0) {
+      svf_compare(read.check);
+    }
+  }
+  pending_reads.clear();
+  pending_read_bytes = 0;
+  // scans split into chunks may still be waiting for their last chunks
+  checks.erase(std::remove_if(checks.begin(), checks.end(),
+                              [](const std::unique_ptr<SvfCheck> &check) {
+                                return check->outstanding == 0;
+                              }),
+               checks.end());
+  return ok;
+}
+
+// shift tdi in the current shift state, leave it on the last bit if
+// flip_tms, tdo is compared if check is not NULL
+static bool svf_shift(const uint8_t *tdi, size_t num_bits, bool flip_tms,
+                      SvfCheck *check) {
+  if (check) {
+    // compared once the last chunk is received
+    check->outstanding += (num_bits + SVF_CHUNK_BITS - 1) / SVF_CHUNK_BITS;
+  }
+  for (size_t begin = 0; begin < num_bits; begin += SVF_CHUNK_BITS) {
+    size_t len = std::min(SVF_CHUNK_BITS, num_bits - begin);
+    bool last = begin + len == num_bits;
+    chunk_buffer.assign((len + 7) / 8, 0);
+    copy_bits(chunk_buffer.data(), 0, tdi, begin, len);
+    if (!jtag_scan_chain_send(chunk_buffer.data(), len, last && flip_tms,
+                              check != NULL)) {
+      return false;
+    }
+    if (check) {
+      pending_reads.push_back(
+          SvfRead{check, begin, len, last && flip_tms});
+      pending_read_bytes += (len + 7) / 8;
+      if (pending_read_bytes >= adapter_max_pending_read_bytes() &&
+          !svf_recv_pending()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static SvfCheck *svf_new_check(size_t line, size_t num_bits) {
+  checks.emplace_back(new SvfCheck());
+  SvfCheck *check = checks.back().get();
+  check->line = line;
+  check->num_bits = num_bits;
+  check->tdo.assign((num_bits + 7) / 8, 0);
+  check->expected.assign((num_bits + 7) / 8, 0);
+  check->mask.assign((num_bits + 7) / 8, 0);
+  check->outstanding = 0;
+  return check;
+}
+
+// sleep after the work queued so far has been sent
+static bool svf_sleep(double seconds) {
+  if (!adapter_flush()) {
+    return false;
+  }
+  if (image_recording()) {
+    // played back after the writes recorded so far
+    image_record_sleep((uint64_t)ceil(seconds * 1e6));
+    return true;
+  }
+  struct timespec ts;
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+  }
+  return true;
+}
+
+// clock in a stable state for at least cycles and seconds
+static bool svf_run(JtagState run_state, uint64_t cycles, double seconds) {
+  seconds = std::max(seconds, cycles / requested_hz);
+  uint64_t min_cycles = (uint64_t)ceil(seconds * tck_hz);
+  cycles = std::max(cycles, min_cycles);
+  if (!jtag_tms_seq_to(run_state)) {
+    return false;
+  }
+  if (run_state == TestLogicReset) {
+    // tms has to stay high
+    uint8_t ones[256];
+    memset(ones, 0xFF, sizeof(ones));
+    while (cycles > 0) {
+      size_t len = std::min(cycles, (uint64_t)sizeof(ones) * 8);
+      if (!jtag_tms_seq(ones, len)) {
+        return false;
+      }
+      cycles -= len;
+    }
+  } else if (cycles > 0 && !jtag_clock_tck(cycles)) {
+    return false;
+  }
+  if (!adapter_can_clock_tck() && seconds > 0) {
+    return svf_sleep(seconds);
+  }
+  return true;
+}
+
+static void svf_reset_player() {
+  checks.clear();
+  pending_reads.clear();
+  pending_read_bytes = 0;
+  mismatch = false;
+  mismatches = 0;
+  requested_hz = freq_mhz * 1e6;
+  tck_hz = freq_mhz * 1e6;
+}
+
+static bool svf_finish(bool ok) {
+  if (!svf_recv_pending()) {
+    ok = false;
+  }
+  if (mismatches) {
+    printf("%" PRIu64 " TDO mismatches\n", mismatches);
+  }
+  return ok && !mismatch;
+}
+
+static bool read_file(const char *path, std::vector<uint8_t> &data) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[65536];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    data.insert(data.end(), buf, buf + len);
+  }
+  fclose(fp);
+  return true;
+}
+
+// SVF
+
+// tdi, tdo and mask of a HDR/HIR/TDR/TIR/SDR/SIR command
+struct SvfScanParams {
+  size_t len;
+  std::vector<uint8_t> tdi;
+  std::vector<uint8_t> tdo;
+  std::vector<uint8_t> mask;
+  bool has_tdo;
+};
+
+static const char *svf_state_names[] = {
+    "RESET",   "IDLE",    "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1",
+    "DRPAUSE", "DREXIT2", "DRUPDATE", "IRSELECT",  "IRCAPTURE", "IRSHIFT",
+    "IREXIT1", "IRPAUSE", "IREXIT2",  "IRUPDATE"};
+
+static bool svf_parse_state(const std::string &name, JtagState &res) {
+  for (int i = 0; i <= UpdateIR; i++) {
+    if (name == svf_state_names[i]) {
+      res = (JtagState)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool svf_stable(JtagState s) {
+  return s == TestLogicReset || s == RunTestIdle || s == PauseDR ||
+         s == PauseIR;
+}
+
+// hex string, most significant digit first, into num_bits lsb first
+static bool svf_parse_hex(const std::string &hex, size_t num_bits,
+                          std::vector<uint8_t> &res) {
+  res.assign((num_bits + 7) / 8, 0);
+  size_t bit = 0;
+  for (size_t i = hex.size(); i-- > 0;) {
+    char c = hex[i];
+    int digit;
+    if ('0' <= c && c <= '9') {
+      digit = c - '0';
+    } else if ('A' <= c && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      return false;
+    }
+    for (int j = 0; j < 4; j++, bit++) {
+      if ((digit >> j) & 1) {
+        if (bit >= num_bits) {
+          // only leading zeros may exceed the length
+          return false;
+        }
+        res[bit / 8] |= 1 << (bit % 8);
+      }
+    }
+  }
+  return true;
+}
+
+class SvfPlayer {
+public:
+  bool play(const std::vector<uint8_t> &text);
+
+private:
+  bool statement(std::vector<std::string> &tokens);
+  bool scan_params(std::vector<std::string> &tokens, SvfScanParams &params);
+  bool scan(bool ir);
+  bool runtest(std::vector<std::string> &tokens);
+
+  size_t line = 1;
+  SvfScanParams hdr = {}, hir = {}, tdr = {}, tir = {}, sdr = {}, sir = {};
+  JtagState enddr = RunTestIdle;
+  JtagState endir = RunTestIdle;
+  JtagState run_state = RunTestIdle;
+  JtagState run_end_state = RunTestIdle;
+};
+
+bool SvfPlayer::play(const std::vector<uint8_t> &text) {
+  std::vector<std::string> tokens;
+  std::string token;
+  size_t statement_line = 1;
+  bool in_paren = false;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = toupper(text[i]);
+    if (c == '\n') {
+      line++;
+    }
+    if (in_paren) {
+      if (c == ')') {
+        in_paren = false;
+        tokens.push_back(token);
+        token.clear();
+      } else if (!isspace(c)) {
+        token.push_back(c);
+      }
+      continue;
+    }
+
+    if (c == '!' || (c == '/' && i + 1 < text.size() && text[i + 1] == '/')) {
+      // comment until end of line
+      while (i + 1 < text.size() && text[i + 1] != '\n') {
+        i++;
+      }
+      continue;
+    }
+    if (isspace(c) || c == '(' || c == ';') {
+      if (!token.empty()) {
+        tokens.push_back(token);
+        token.clear();
+      }
+      if (c == '(') {
+        // hex data, marked by a leading '('
+        in_paren = true;
+        token.push_back('(');
+      } else if (c == ';') {
+        std::swap(line, statement_line);
+        bool ok = statement(tokens);
+        std::swap(line, statement_line);
+        if (!ok || mismatch) {
+          return false;
+        }
+        tokens.clear();
+      }
+      continue;
+    }
+    if (tokens.empty() && token.empty()) {
+      statement_line = line;
+    }
+    token.push_back(c);
+  }
+  return true;
+}
+
+bool SvfPlayer::scan_params(std::vector<std::string> &tokens,
+                            SvfScanParams &params) {
+  if (tokens.size() < 2) {
+    printf("Line %zu: missing length\n", line);
+    return false;
+  }
+  size_t len = strtoull(tokens[1].c_str(), NULL, 10);
+  if (len != params.len) {
+    // tdi and mask are only kept while the length stays the same
+    params.len = len;
+    params.tdi.assign((len + 7) / 8, 0);
+    params.mask.assign((len + 7) / 8, 0xFF);
+  }
+  params.has_tdo = false;
+
+  for (size_t i = 2; i + 1 < tokens.size(); i += 2) {
+    const std::string &name = tokens[i];
+    const std::string &value = tokens[i + 1];
+    if (value.empty() || value[0] != '(') {
+      printf("Line %zu: expected hex data after %s\n", line, name.c_str());
+      return false;
+    }
+    std::vector<uint8_t> bits;
+    if (!svf_parse_hex(value.substr(1), len, bits)) {
+      printf("Line %zu: bad hex data for %s\n", line, name.c_str());
+      return false;
+    }
+    if (name == "TDI") {
+      params.tdi = bits;
+    } else if (name == "TDO") {
+      params.tdo = bits;
+      params.has_tdo = true;
+    } else if (name == "MASK") {
+      params.mask = bits;
+    } else if (name == "SMASK") {
+      // tdi is always driven
+    } else {
+      printf("Line %zu: unknown scan parameter %s\n", line, name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SvfPlayer::scan(bool ir) {
+  SvfScanParams *parts[3] = {ir ? &hir : &hdr, ir ? &sir : &sdr,
+                             ir ? &tir : &tdr};
+  size_t num_bits = parts[0]->len + parts[1]->len + parts[2]->len;
+  if (num_bits == 0) {
+    return true;
+  }
+
+  // header is shifted first
+  std::vector<uint8_t> tdi((num_bits + 7) / 8, 0);
+  SvfCheck *check = NULL;
+  size_t offset = 0;
+  for (auto part : parts) {
+    copy_bits(tdi.data(), offset, part->tdi.data(), 0, part->len);
+    if (part->has_tdo) {
+      if (!check) {
+        check = svf_new_check(line, num_bits);
+      }
+      copy_bits(check->expected.data(), offset, part->tdo.data(), 0,
+                part->len);
+      copy_bits(check->mask.data(), offset, part->mask.data(), 0, part->len);
+    }
+    offset += part->len;
+  }
+
+  if (!jtag_tms_seq_to(ir ? ShiftIR : ShiftDR) ||
+      !svf_shift(tdi.data(), num_bits, true, check)) {
+    return false;
+  }
+  return jtag_tms_seq_to(ir ? endir : enddr);
+}
+
+bool SvfPlayer::runtest(std::vector<std::string> &tokens) {
+  size_t i = 1;
+  JtagState parsed;
+  if (i < tokens.size() && svf_parse_state(tokens[i], parsed)) {
+    run_state = parsed;
+    run_end_state = parsed;
+    i++;
+  }
+
+  uint64_t cycles = 0;
+  double seconds = 0;
+  while (i + 1 < tokens.size()) {
+    double value = strtod(tokens[i].c_str(), NULL);
+    const std::string &unit = tokens[i + 1];
+    if (unit == "TCK" || unit == "SCK") {
+      cycles = value;
+      i += 2;
+    } else if (unit == "SEC") {
+      seconds = value;
+      i += 2;
+    } else if (tokens[i] == "MAXIMUM") {
+      // the minimum is always used
+      i += 3;
+    } else if (tokens[i] == "ENDSTATE" &&
+               svf_parse_state(tokens[i + 1], parsed)) {
+      run_end_state = parsed;
+      i += 2;
+    } else {
+      break;
+    }
+  }
+  if (i != tokens.size()) {
+    printf("Line %zu: bad RUNTEST\n", line);
+    return false;
+  }
+
+  return svf_run(run_state, cycles, seconds) &&
+         jtag_tms_seq_to(run_end_state);
+}
+
+bool SvfPlayer::statement(std::vector<std::string> &tokens) {
+  if (tokens.empty()) {
+    return true;
+  }
+  const std::string &command = tokens[0];
+  dprintf("SVF line %zu: %s\n", line, command.c_str());
+
+  JtagState parsed;
+  if (command == "SDR" || command == "SIR") {
+    bool ir = command == "SIR";
+    return scan_params(tokens, ir ? sir : sdr) && scan(ir);
+  } else if (command == "HDR") {
+    return scan_params(tokens, hdr);
+  } else if (command == "HIR") {
+    return scan_params(tokens, hir);
+  } else if (command == "TDR") {
+    return scan_params(tokens, tdr);
+  } else if (command == "TIR") {
+    return scan_params(tokens, tir);
+  } else if (command == "ENDDR" || command == "ENDIR") {
+    if (tokens.size() != 2 || !svf_parse_state(tokens[1], parsed) ||
+        !svf_stable(parsed)) {
+      printf("Line %zu: bad %s\n", line, command.c_str());
+      return false;
+    }
+    (command == "ENDDR" ? enddr : endir) = parsed;
+    return true;
+  } else if (command == "STATE") {
+    // path states are visited in order
+    for (size_t i = 1; i < tokens.size(); i++) {
+      if (!svf_parse_state(tokens[i], parsed)) {
+        printf("Line %zu: unknown state %s\n", line, tokens[i].c_str());
+        return false;
+      }
+      bool ok = parsed == TestLogicReset ? jtag_goto_tlr()
+                                         : jtag_tms_seq_to(parsed);
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  } else if (command == "RUNTEST") {
+    return runtest(tokens);
+  } else if (command == "FREQUENCY") {
+    double hz = tokens.size() >= 2 ? strtod(tokens[1].c_str(), NULL)
+                                   : freq_mhz * 1e6;
+    if (!(hz > 0)) {
+      printf("Line %zu: bad FREQUENCY\n", line);
+      return false;
+    }
+    // the adapter takes whole MHz, times are counted at its frequency
+    uint64_t mhz = std::max((uint64_t)(hz / 1e6), (uint64_t)1);
+    requested_hz = hz;
+    tck_hz = mhz * 1e6;
+    return adapter_set_tck_freq(mhz);
+  } else if (command == "TRST") {
+    // no trst pin
+    return true;
+  }
+
+  printf("Line %zu: unsupported command %s\n", line, command.c_str());
+  return false;
+}
+
+bool svf_play(const char *path) {
+  std::vector<uint8_t> text;
+  if (!read_file(path, text)) {
+    return false;
+  }
+  printf("Play svf %s\n", path);
+
+  svf_reset_player();
+  location = "Line";
+  SvfPlayer player;
+  bool ok = player.play(text);
+  return svf_finish(ok);
+}
+
+// XSVF, see Xilinx XAPP503
+
+enum XsvfCommand {
+  XCOMPLETE = 0x00,
+  XTDOMASK = 0x01,
+  XSIR = 0x02,
+  XSDR = 0x03,
+  XRUNTEST = 0x04,
+  XREPEAT = 0x07,
+  XSDRSIZE = 0x08,
+  XSDRTDO = 0x09,
+  XSETSDRMASKS = 0x0A,
+  XSDRINC = 0x0B,
+  XSDRB = 0x0C,
+  XSDRC = 0x0D,
+  XSDRE = 0x0E,
+  XSDRTDOB = 0x0F,
+  XSDRTDOC = 0x10,
+  XSDRTDOE = 0x11,
+  XSTATE = 0x12,
+  XENDIR = 0x13,
+  XENDDR = 0x14,
+  XSIR2 = 0x15,
+  XCOMMENT = 0x16,
+  XWAIT = 0x17,
+};
+
+class XsvfPlayer {
+public:
+  bool play(const std::vector<uint8_t> &data);
+
+private:
+  bool get_u8(uint8_t &value);
+  bool get_u32(uint32_t &value);
+  bool get_bits(size_t num_bits, std::vector<uint8_t> &bits);
+  bool sdr(bool compare);
+
+  const std::vector<uint8_t> *data;
+  size_t pos = 0;
+  // position of the current command, used as line in reports
+  size_t command_pos = 0;
+
+  uint32_t sdr_size = 0;
+  std::vector<uint8_t> tdi;
+  std::vector<uint8_t> tdo_expected;
+  std::vector<uint8_t> tdo_mask;
+  uint32_t runtest_us = 0;
+  uint8_t repeat = 32;
+  JtagState enddr = RunTestIdle;
+  JtagState endir = RunTestIdle;
+  bool warned_repeat = false;
+};
+
+bool XsvfPlayer::get_u8(uint8_t &value) {
+  if (pos >= data->size()) {
+    printf("Unexpected end of xsvf\n");
+    return false;
+  }
+  value = (*data)[pos++];
+  return true;
+}
+
+bool XsvfPlayer::get_u32(uint32_t &value) {
+  value = 0;
+  for (int i = 0; i < 4; i++) {
+    uint8_t byte;
+    if (!get_u8(byte)) {
+      return false;
+    }
+    value = (value << 8) | byte;
+  }
+  return true;
+}
+
+// xsvf vectors are big endian, convert to lsb first
+bool XsvfPlayer::get_bits(size_t num_bits, std::vector<uint8_t> &bits) {
+  size_t num_bytes = (num_bits + 7) / 8;
+  if (pos + num_bytes > data->size()) {
+    printf("Unexpected end of xsvf\n");
+    return false;
+  }
+  bits.resize(num_bytes);
+  for (size_t i = 0; i < num_bytes; i++) {
+    bits[i] = (*data)[pos + num_bytes - 1 - i];
+  }
+  pos += num_bytes;
+  return true;
+}
+
+bool XsvfPlayer::sdr(bool compare) {
+  JtagState end = runtest_us ? RunTestIdle : enddr;
+  double seconds = runtest_us / 1e6;
+  if (compare && repeat && image_recording() && !warned_repeat) {
+    printf("XREPEAT is not kept in images, scans are checked once\n");
+    warned_repeat = true;
+  }
+  if (!compare || repeat == 0 || image_recording()) {
+    // no retries, verify in the background
+    SvfCheck *check = NULL;
+    if (compare) {
+      check = svf_new_check(command_pos, sdr_size);
+      check->expected = tdo_expected;
+      check->mask = tdo_mask;
+    }
+    return jtag_tms_seq_to(ShiftDR) &&
+           svf_shift(tdi.data(), sdr_size, true, check) &&
+           jtag_tms_seq_to(end) &&
+           (!runtest_us || svf_run(RunTestIdle, 0, seconds));
+  }
+
+  // earlier scans must not be taken for a failed attempt
+  if (!svf_recv_pending() || mismatch) {
+    return false;
+  }
+  for (int attempt = 0; attempt <= repeat; attempt++) {
+    if (attempt > 0) {
+      // exception handling of XAPP503, from Exit1-DR
+      const JtagState path[] = {PauseDR,  Exit2DR,  ShiftDR,
+                                Exit1DR,  UpdateDR, RunTestIdle};
+      for (JtagState s : path) {
+        if (!jtag_tms_seq_to(s)) {
+          return false;
+        }
+      }
+      // wait a bit longer on every retry
+      if (!svf_run(RunTestIdle, 0, seconds * (1 + attempt / 4.0))) {
+        return false;
+      }
+    }
+
+    SvfCheck *check = svf_new_check(command_pos, sdr_size);
+    check->expected = tdo_expected;
+    check->mask = tdo_mask;
+    if (!jtag_tms_seq_to(ShiftDR) ||
+        !svf_shift(tdi.data(), sdr_size, true, check)) {
+      return false;
+    }
+    // read back now to decide whether to retry
+    uint64_t before = mismatches;
+    quiet = true;
+    bool recv_ok = svf_recv_pending();
+    quiet = false;
+    if (!recv_ok) {
+      return false;
+    }
+    mismatches = before;
+    if (!mismatch) {
+      return jtag_tms_seq_to(end) &&
+             (!runtest_us || svf_run(RunTestIdle, 0, seconds));
+    }
+    mismatch = false;
+    dprintf("XSDR mismatch, retry %d\n", attempt + 1);
+  }
+  printf("Offset %zu: TDO mismatch after %d retries\n", command_pos, repeat);
+  mismatch = true;
+  mismatches++;
+  return false;
+}
+
+bool XsvfPlayer::play(const std::vector<uint8_t> &bytes) {
+  data = &bytes;
+  while (!mismatch) {
+    command_pos = pos;
+    uint8_t command, value = 0;
+    uint32_t value32;
+    if (!get_u8(command)) {
+      return false;
+    }
+    dprintf("XSVF offset %zu: command 0x%02x\n", command_pos, command);
+
+    bool ok = true;
+    switch (command) {
+    case XCOMPLETE:
+      return true;
+    case XTDOMASK:
+      ok = get_bits(sdr_size, tdo_mask);
+      break;
+    case XSIR:
+    case XSIR2: {
+      uint32_t len;
+      if (command == XSIR) {
+        ok = get_u8(value);
+        len = value;
+      } else {
+        uint8_t high, low;
+        ok = get_u8(high) && get_u8(low);
+        len = (high << 8) | low;
+      }
+      std::vector<uint8_t> ir;
+      ok = ok && get_bits(len, ir) && jtag_tms_seq_to(ShiftIR) &&
+           svf_shift(ir.data(), len, true, NULL) &&
+           jtag_tms_seq_to(runtest_us ? RunTestIdle : endir) &&
+           (!runtest_us || svf_run(RunTestIdle, 0, runtest_us / 1e6));
+      break;
+    }
+    case XSDR:
+      ok = get_bits(sdr_size, tdi) && sdr(true);
+      break;
+    case XRUNTEST:
+      ok = get_u32(runtest_us);
+      break;
+    case XREPEAT:
+      ok = get_u8(repeat);
+      break;
+    case XSDRSIZE:
+      ok = get_u32(sdr_size);
+      if (ok) {
+        tdo_mask.assign((sdr_size + 7) / 8, 0xFF);
+        tdo_expected.assign((sdr_size + 7) / 8, 0);
+      }
+      break;
+    case XSDRTDO:
+      ok = get_bits(sdr_size, tdi) && get_bits(sdr_size, tdo_expected) &&
+           sdr(true);
+      break;
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE: {
+      bool compare = command >= XSDRTDOB;
+      bool begin = command == XSDRB || command == XSDRTDOB;
+      bool last = command == XSDRE || command == XSDRTDOE;
+      ok = get_bits(sdr_size, tdi) &&
+           (!compare || get_bits(sdr_size, tdo_expected));
+      SvfCheck *check = NULL;
+      if (ok && compare) {
+        check = svf_new_check(command_pos, sdr_size);
+        check->expected = tdo_expected;
+        check->mask.assign((sdr_size + 7) / 8, 0xFF);
+      }
+      ok = ok && (!begin || jtag_tms_seq_to(ShiftDR)) &&
+           svf_shift(tdi.data(), sdr_size, last, check) &&
+           (!last || jtag_tms_seq_to(enddr));
+      break;
+    }
+    case XSTATE:
+      ok = get_u8(value);
+      if (ok && value > UpdateIR) {
+        printf("Offset %zu: bad state %d\n", command_pos, value);
+        ok = false;
+      } else if (ok) {
+        ok = value == TestLogicReset ? jtag_goto_tlr()
+                                     : jtag_tms_seq_to((JtagState)value);
+      }
+      break;
+    case XENDIR:
+    case XENDDR:
+      ok = get_u8(value);
+      if (ok && value > 1) {
+        printf("Offset %zu: bad end state %d\n", command_pos, value);
+        ok = false;
+      } else if (command == XENDIR) {
+        endir = value ? PauseIR : RunTestIdle;
+      } else {
+        enddr = value ? PauseDR : RunTestIdle;
+      }
+      break;
+    case XCOMMENT:
+      do {
+        ok = get_u8(value);
+      } while (ok && value != 0);
+      break;
+    case XWAIT: {
+      uint8_t wait_state, end_state;
+      ok = get_u8(wait_state) && get_u8(end_state) && get_u32(value32);
+      if (ok && (wait_state > UpdateIR || end_state > UpdateIR)) {
+        printf("Offset %zu: bad state\n", command_pos);
+        ok = false;
+      }
+      ok = ok && svf_run((JtagState)wait_state, 0, value32 / 1e6) &&
+           jtag_tms_seq_to((JtagState)end_state);
+      break;
+    }
+    default:
+      printf("Offset %zu: unsupported xsvf command 0x%02x\n", command_pos,
+             command);
+      return false;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool xsvf_play(const char *path) {
+  std::vector<uint8_t> data;
+  if (!read_file(path, data)) {
+    return false;
+  }
+  printf("Play xsvf %s\n", path);
+
+  svf_reset_player();
+  location = "Offset";
+  XsvfPlayer player;
+  bool ok = player.play(data);
+  return svf_finish(ok);
+}
+
+static bool compile(const char *path, const char *image_path, bool xsvf) {
+  if (!image_record_begin()) {
+    return false;
+  }
+  bool ok = xsvf ? xsvf_play(path) : svf_play(path);
+  return image_record_end(ok ? image_path : NULL, xsvf) && ok;
+}
+
+bool svf_compile(const char *path, const char *image_path) {
+  return compile(path, image_path, false);
+}
+
+bool xsvf_compile(const char *path, const char *image_path) {
+  return compile(path, image_path, true);
+}
@@ -0,0 +1,20 @@
+#ifndef __SVF_H__
+#define __SVF_H__
+
+#include "common.h"
+
+// play a svf or xsvf file on the adapter, tdo is verified as it is read
+// back and mismatches are reported, false on the first mismatch or error
+bool svf_play(const char *path);
+bool xsvf_play(const char *path);
+
+// record the usb commands of a svf or xsvf file into an image, see image.h
+bool svf_compile(const char *path, const char *image_path);
+bool xsvf_compile(const char *path, const char *image_path);
+
+// compare tdo under mask and report a mismatch at location line
+bool svf_check_tdo(const char *location, size_t line, const uint8_t *tdo,
+                   const uint8_t *expected, const uint8_t *mask,
+                   size_t num_bits);
+
+#endif
@@ -0,0 +1,141 @@
+#include "tunnel.h"
+#include "image.h"
+#include "jrs_client.h"
+#include <deque>
+
+// Requests are queued in the client library and only sent when a tdo is
+// needed, the queue grows large or the frontend waits for its own client.
+// Work without tdo is never waited for, so only reads pay the round trip.
+
+// runs of the same tdi byte at least this long are sent as fill requests
+const size_t TUNNEL_FILL_MIN_BYTES = 64;
+// let the frontends queue many reads before waiting on the link
+const size_t TUNNEL_MAX_PENDING_READ_BYTES = 16 << 20;
+
+static jrs_client *client = NULL;
+
+// a scan whose tdo has not been received yet
+struct TunnelRead {
+  uint32_t id;
+  std::vector<uint8_t> tdo;
+};
+// deque keeps the tdo buffers in place while the library fills them
+static std::deque<TunnelRead> pending_reads;
+
+bool tunnel_init(enum AdapterTypes /* adapter_type */) {
+  printf("Connect to remote server %s:%d\n", tunnel_host, tunnel_port);
+  client = jrs_open(tunnel_host, tunnel_port);
+  if (!client) {
+    return false;
+  }
+
+  uint32_t version, max_bits;
+  if (jrs_hello(client, &version, &max_bits) < 0) {
+    printf("Remote server did not answer\n");
+    return false;
+  }
+  if (version < 2) {
+    printf("Remote server version %u is too old\n", version);
+    return false;
+  }
+  printf("Remote server version %u\n", version);
+  return true;
+}
+
+bool tunnel_deinit() {
+  bool ok = jrs_sync(client) == 0;
+  jrs_close(client);
+  client = NULL;
+  return ok;
+}
+
+bool tunnel_set_tck_freq(uint64_t freq_mhz) {
+  return jrs_set_freq(client, freq_mhz) != 0;
+}
+
+bool tunnel_jtag_tms_seq(const uint8_t *data, size_t num_bits) {
+  return jrs_tms(client, data, num_bits) != 0;
+}
+
+bool tunnel_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                 bool flip_tms, bool do_read) {
+  int flags = 0;
+  if (flip_tms) {
+    // last bit is sent along TMS=1
+    JtagState new_state = next_state(state, 1);
+    dprintf("JTAG state: %s -> %s\n", state_to_string(state),
+            state_to_string(new_state));
+    state = new_state;
+    flags = JRS_FLAG_FLIP_TMS;
+  }
+  if (do_read) {
+    pending_reads.push_back(TunnelRead());
+    TunnelRead &read = pending_reads.back();
+    read.tdo.resize((num_bits + 7) / 8);
+    read.id = jrs_scan(client, data, read.tdo.data(), NULL, num_bits, flags);
+    return read.id != 0;
+  }
+
+  // write only, compress long runs of the same byte, e.g. in bitstreams
+  size_t num_bytes = num_bits / 8;
+  size_t sent = 0;
+  size_t begin = 0;
+  while (begin < num_bytes) {
+    size_t end = begin + 1;
+    while (end < num_bytes && data[end] == data[begin]) {
+      end++;
+    }
+    if (end - begin >= TUNNEL_FILL_MIN_BYTES) {
+      if (begin > sent &&
+          !jrs_scan(client, &data[sent], NULL, NULL, (begin - sent) * 8, 0)) {
+        return false;
+      }
+      bool last = end * 8 == num_bits;
+      if (!jrs_fill(client, data[begin], NULL, (end - begin) * 8,
+                    last ? flags : 0)) {
+        return false;
+      }
+      sent = end;
+    }
+    begin = end;
+  }
+
+  if (sent * 8 < num_bits) {
+    return jrs_scan(client, &data[sent], NULL, NULL, num_bits - sent * 8,
+                    flags) != 0;
+  }
+  return true;
+}
+
+bool tunnel_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                 bool /* flip_tms */) {
+  // scans are received in the order they were sent
+  assert(!pending_reads.empty());
+  TunnelRead &read = pending_reads.front();
+  assert(read.tdo.size() == (num_bits + 7) / 8);
+  bool ok = jrs_wait(client, read.id) == 0;
+  memcpy(recv, read.tdo.data(), read.tdo.size());
+  pending_reads.pop_front();
+  return ok;
+}
+
+bool tunnel_jtag_clock_tck(size_t times) {
+  return jrs_clock(client, times) != 0;
+}
+
+bool tunnel_flush() { return jrs_flush(client) == 0; }
+
+driver tunnel_driver = {
+    .init = tunnel_init,
+    .deinit = tunnel_deinit,
+    .set_tck_freq = tunnel_set_tck_freq,
+    .jtag_tms_seq = tunnel_jtag_tms_seq,
+    .jtag_scan_chain_send = tunnel_jtag_scan_chain_send,
+    .jtag_scan_chain_recv = tunnel_jtag_scan_chain_recv,
+    .jtag_clock_tck = tunnel_jtag_clock_tck,
+    .flush = tunnel_flush,
+    .max_pending_read_bytes = TUNNEL_MAX_PENDING_READ_BYTES,
+    .image_encoding = Image_None,
+    .tdo_raw_bytes = NULL,
+    .decode_tdo = NULL,
+};
@@ -0,0 +1,28 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "common.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// remote server running the native protocol, from -t
+extern const char *tunnel_host;
+extern uint16_t tunnel_port;
+
+// forward jtag operations to the remote server
+bool tunnel_init(enum AdapterTypes adapter_type);
+bool tunnel_deinit();
+bool tunnel_set_tck_freq(uint64_t freq_mhz);
+
+// jtag functions
+bool tunnel_jtag_tms_seq(const uint8_t *data, size_t num_bits);
+bool tunnel_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                 bool flip_tms, bool do_read);
+bool tunnel_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                 bool flip_tms);
+bool tunnel_jtag_clock_tck(size_t times);
+bool tunnel_flush();
+
+extern driver tunnel_driver;
+
+#endif
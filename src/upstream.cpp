@@ -0,0 +1,326 @@
+#include "upstream.h"
+#include "image.h"
+#include "vpi.h"
+#include <deque>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+
+// Operations are encoded into the send buffer, which is written when tdo is
+// needed, when it grows large or when the frontend waits for its client, so
+// that a chatty client turns into a few large upstream writes. Responses are
+// read while writing, neither side can block on a full socket.
+
+// send buffer is written once it grows past this
+const size_t UPSTREAM_SEND_THRESHOLD = 1 << 20;
+// tdo bytes queued before reading back
+const size_t UPSTREAM_MAX_PENDING_READ_BYTES = 1 << 16;
+// bits in a jtag_vpi command
+const size_t UPSTREAM_VPI_CHUNK_BITS = sizeof(jtag_vpi_cmd::buffer_out) * 8;
+
+static int upstream_fd = -1;
+static std::vector<uint8_t> send_buffer;
+static std::vector<uint8_t> recv_buffer;
+static size_t recv_offset = 0;
+
+// responses expected from upstream, in order
+struct UpstreamResponse {
+  size_t num_bits;
+  size_t num_bytes;
+  // sent for a scan without read, jtag_vpi replies to every scan
+  bool discard;
+};
+static std::deque<UpstreamResponse> responses;
+
+bool upstream_init(enum AdapterTypes /* adapter_type */) {
+  printf("Connect to upstream %s server %s:%d\n",
+         upstream_protocol == Upstream_RBB ? "remote bitbang" : "jtag_vpi",
+         upstream_host, upstream_port);
+
+  char service[16];
+  snprintf(service, sizeof(service), "%u", upstream_port);
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *res;
+  if (getaddrinfo(upstream_host, service, &hints, &res) != 0) {
+    printf("Can not resolve %s\n", upstream_host);
+    return false;
+  }
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+    upstream_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (upstream_fd < 0) {
+      continue;
+    }
+    if (connect(upstream_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(upstream_fd);
+    upstream_fd = -1;
+  }
+  freeaddrinfo(res);
+  if (upstream_fd < 0) {
+    perror("connect");
+    return false;
+  }
+
+  int flags = 1;
+  if (setsockopt(upstream_fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags,
+                 sizeof(flags)) < 0) {
+    perror("setsockopt");
+  }
+  // partial writes let responses be read while a large batch is sent
+  fcntl(upstream_fd, F_SETFL, fcntl(upstream_fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+// write the send buffer and read until need bytes of responses are buffered
+static bool upstream_transfer(size_t need) {
+  size_t sent = 0;
+  while (sent < send_buffer.size() ||
+         recv_buffer.size() - recv_offset < need) {
+    struct pollfd pfd = {upstream_fd, POLLIN, 0};
+    if (sent < send_buffer.size()) {
+      pfd.events |= POLLOUT;
+    }
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return false;
+    }
+
+    if (pfd.revents & POLLIN) {
+      if (recv_offset == recv_buffer.size()) {
+        recv_buffer.clear();
+        recv_offset = 0;
+      } else if (recv_offset >= UPSTREAM_SEND_THRESHOLD) {
+        recv_buffer.erase(recv_buffer.begin(),
+                          recv_buffer.begin() + recv_offset);
+        recv_offset = 0;
+      }
+      size_t used = recv_buffer.size();
+      recv_buffer.resize(used + (1 << 16));
+      ssize_t res = read(upstream_fd, &recv_buffer[used], 1 << 16);
+      recv_buffer.resize(used + std::max(res, (ssize_t)0));
+      if (res == 0 || (res < 0 && errno != EAGAIN)) {
+        printf("Upstream server closed\n");
+        return false;
+      }
+    } else if (pfd.revents & (POLLERR | POLLHUP)) {
+      printf("Upstream server closed\n");
+      return false;
+    }
+
+    if ((pfd.revents & POLLOUT) && sent < send_buffer.size()) {
+      ssize_t res =
+          write(upstream_fd, &send_buffer[sent], send_buffer.size() - sent);
+      if (res < 0 && errno != EAGAIN) {
+        perror("write");
+        return false;
+      } else if (res > 0) {
+        sent += res;
+      }
+    }
+  }
+  send_buffer.clear();
+
+  // drop responses nobody waits for
+  while (!responses.empty() && responses.front().discard &&
+         recv_buffer.size() - recv_offset >= responses.front().num_bytes) {
+    recv_offset += responses.front().num_bytes;
+    responses.pop_front();
+  }
+  return true;
+}
+
+static bool upstream_queued() {
+  if (send_buffer.size() >= UPSTREAM_SEND_THRESHOLD) {
+    return upstream_transfer(0);
+  }
+  return true;
+}
+
+bool upstream_flush() { return upstream_transfer(0); }
+
+bool upstream_deinit() {
+  if (upstream_protocol == Upstream_RBB) {
+    send_buffer.push_back('Q');
+  }
+  bool ok = upstream_transfer(0);
+  close(upstream_fd);
+  upstream_fd = -1;
+  return ok;
+}
+
+// frequency is up to the upstream server
+bool upstream_set_tck_freq(uint64_t /* freq_mhz */) { return true; }
+
+// one tck cycle, tdo is sampled before the rising edge
+static void upstream_rbb_clock(int tms, int tdi, bool do_read) {
+  int bits = (tms << 1) | tdi;
+  send_buffer.push_back('0' + bits);
+  if (do_read) {
+    send_buffer.push_back('R');
+  }
+  send_buffer.push_back('4' + bits);
+}
+
+static void upstream_vpi_cmd(uint32_t cmd, const uint8_t *data,
+                             size_t num_bits) {
+  struct jtag_vpi_cmd vpi = {};
+  vpi.cmd = cmd;
+  vpi.length = (num_bits + 7) / 8;
+  vpi.nb_bits = num_bits;
+  if (data) {
+    memcpy(vpi.buffer_out, data, vpi.length);
+  }
+  const uint8_t *p = (const uint8_t *)&vpi;
+  send_buffer.insert(send_buffer.end(), p, p + sizeof(vpi));
+}
+
+bool upstream_jtag_tms_seq(const uint8_t *data, size_t num_bits) {
+  if (upstream_protocol == Upstream_RBB) {
+    for (size_t i = 0; i < num_bits; i++) {
+      upstream_rbb_clock((data[i / 8] >> (i % 8)) & 1, 0, false);
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < num_bits; i += UPSTREAM_VPI_CHUNK_BITS) {
+      upstream_vpi_cmd(CMD_TMS_SEQ, &data[i / 8],
+                       std::min(num_bits - i, UPSTREAM_VPI_CHUNK_BITS));
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool upstream_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                   bool flip_tms, bool do_read) {
+  if (flip_tms) {
+    // last bit is sent along TMS=1
+    JtagState new_state = next_state(state, 1);
+    dprintf("JTAG state: %s -> %s\n", state_to_string(state),
+            state_to_string(new_state));
+    state = new_state;
+  }
+
+  UpstreamResponse response;
+  response.num_bits = num_bits;
+  response.discard = !do_read;
+  if (upstream_protocol == Upstream_RBB) {
+    for (size_t i = 0; i < num_bits; i++) {
+      upstream_rbb_clock(flip_tms && i == num_bits - 1,
+                         (data[i / 8] >> (i % 8)) & 1, do_read);
+      // responses of the bits written so far wait in recv_buffer
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+    if (!do_read) {
+      return upstream_queued();
+    }
+    response.num_bytes = num_bits;
+  } else {
+    size_t chunks = 0;
+    for (size_t i = 0; i < num_bits; i += UPSTREAM_VPI_CHUNK_BITS) {
+      size_t len = std::min(num_bits - i, UPSTREAM_VPI_CHUNK_BITS);
+      bool last = i + len == num_bits;
+      upstream_vpi_cmd(flip_tms && last ? CMD_SCAN_CHAIN_FLIP_TMS
+                                        : CMD_SCAN_CHAIN,
+                       &data[i / 8], len);
+      chunks++;
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+    response.num_bytes = chunks * sizeof(struct jtag_vpi_cmd);
+  }
+  responses.push_back(response);
+  return upstream_queued();
+}
+
+bool upstream_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                   bool /* flip_tms */) {
+  // skip responses of earlier scans without read
+  while (!responses.empty() && responses.front().discard) {
+    if (!upstream_transfer(responses.front().num_bytes)) {
+      return false;
+    }
+    if (!responses.empty() && responses.front().discard) {
+      recv_offset += responses.front().num_bytes;
+      responses.pop_front();
+    }
+  }
+
+  // scans are received in the order they were sent
+  assert(!responses.empty());
+  UpstreamResponse response = responses.front();
+  assert(response.num_bits == num_bits);
+  if (!upstream_transfer(response.num_bytes)) {
+    return false;
+  }
+  responses.pop_front();
+
+  const uint8_t *p = &recv_buffer[recv_offset];
+  recv_offset += response.num_bytes;
+  if (upstream_protocol == Upstream_RBB) {
+    memset(recv, 0, (num_bits + 7) / 8);
+    for (size_t i = 0; i < num_bits; i++) {
+      if (p[i] == '1') {
+        recv[i / 8] |= 1 << (i % 8);
+      }
+    }
+  } else {
+    for (size_t i = 0; i < num_bits; i += UPSTREAM_VPI_CHUNK_BITS) {
+      struct jtag_vpi_cmd vpi;
+      memcpy(&vpi, p, sizeof(vpi));
+      p += sizeof(vpi);
+      size_t len = std::min(num_bits - i, UPSTREAM_VPI_CHUNK_BITS);
+      memcpy(&recv[i / 8], vpi.buffer_in, (len + 7) / 8);
+    }
+  }
+  return true;
+}
+
+bool upstream_jtag_clock_tck(size_t times) {
+  if (upstream_protocol == Upstream_RBB) {
+    for (size_t i = 0; i < times; i++) {
+      upstream_rbb_clock(0, 0, false);
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+  } else {
+    // jtag_vpi has no clock command, stay in the current state with tms 0
+    uint8_t zeros[sizeof(jtag_vpi_cmd::buffer_out)] = {};
+    for (size_t i = 0; i < times; i += UPSTREAM_VPI_CHUNK_BITS) {
+      upstream_vpi_cmd(CMD_TMS_SEQ, zeros,
+                       std::min(times - i, UPSTREAM_VPI_CHUNK_BITS));
+      if (!upstream_queued()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+driver upstream_driver = {
+    .init = upstream_init,
+    .deinit = upstream_deinit,
+    .set_tck_freq = upstream_set_tck_freq,
+    .jtag_tms_seq = upstream_jtag_tms_seq,
+    .jtag_scan_chain_send = upstream_jtag_scan_chain_send,
+    .jtag_scan_chain_recv = upstream_jtag_scan_chain_recv,
+    .jtag_clock_tck = upstream_jtag_clock_tck,
+    .flush = upstream_flush,
+    .max_pending_read_bytes = UPSTREAM_MAX_PENDING_READ_BYTES,
+    .image_encoding = Image_None,
+    .tdo_raw_bytes = NULL,
+    .decode_tdo = NULL,
+};
@@ -0,0 +1,34 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "common.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+enum UpstreamProtocol {
+  Upstream_RBB,
+  Upstream_VPI,
+};
+
+// upstream server, from -U
+extern enum UpstreamProtocol upstream_protocol;
+extern const char *upstream_host;
+extern uint16_t upstream_port;
+
+// forward jtag operations to a remote bitbang or jtag_vpi server
+bool upstream_init(enum AdapterTypes adapter_type);
+bool upstream_deinit();
+bool upstream_set_tck_freq(uint64_t freq_mhz);
+
+// jtag functions
+bool upstream_jtag_tms_seq(const uint8_t *data, size_t num_bits);
+bool upstream_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
+                                   bool flip_tms, bool do_read);
+bool upstream_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
+                                   bool flip_tms);
+bool upstream_jtag_clock_tck(size_t times);
+bool upstream_flush();
+
+extern driver upstream_driver;
+
+#endif
@@ -1,16 +1,19 @@
 #include "usb_blaster.h"
 
 #include "common.h"
+#include "image.h"
 #include <algorithm>
 #include <ftdi.h>
 
-static struct ftdi_context *ftdi;
+// per thread for fanout workers, see fanout.h
+static thread_local struct ftdi_context *ftdi;
 
 // reference:
 // https://github.com/openocd-org/openocd/blob/master/src/jtag/drivers/usb_blaster/usb_blaster.c
 
-static uint8_t recv_buffer[4096];
-static size_t recv_buffer_len = 0;
+// tdo of scans sent but not received yet
+static thread_local std::vector<uint8_t> recv_buffer;
+static thread_local size_t recv_buffer_pos = 0;
 
 // ublast_build_out
 uint8_t build_command(int tms, int tdi, int tck, bool read) {
@@ -44,8 +47,18 @@ bool usb_blaster_init(enum AdapterTypes adapter_type) {
   ftdi = ftdi_new();
   assert(ftdi);
 
-  printf("Open device vid=0x%04x pid=0x%04x\n", ftdi_vid, ftdi_pid);
-  int ret = ftdi_usb_open(ftdi, ftdi_vid, ftdi_pid);
+  int ret;
+  if (use_bus_addr) {
+    printf("Open device bus=0x%04x dev=0x%04x\n", usb_bus_addr, usb_dev_addr);
+    ret = ftdi_usb_open_bus_addr(ftdi, usb_bus_addr, usb_dev_addr);
+  } else if (usb_serial) {
+    printf("Open device vid=0x%04x pid=0x%04x serial=%s\n", ftdi_vid,
+           ftdi_pid, usb_serial);
+    ret = ftdi_usb_open_desc(ftdi, ftdi_vid, ftdi_pid, NULL, usb_serial);
+  } else {
+    printf("Open device vid=0x%04x pid=0x%04x\n", ftdi_vid, ftdi_pid);
+    ret = ftdi_usb_open(ftdi, ftdi_vid, ftdi_pid);
+  }
   if (ret) {
     printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
            ftdi_get_error_string(ftdi));
@@ -60,6 +73,7 @@ bool usb_blaster_init(enum AdapterTypes adapter_type) {
   assert(ret == 0);
 
   ftdi_disable_bitbang(ftdi);
+  adapter_ftdi = ftdi;
 
   printf("Initialize usb blaster\n");
   // flush queue
@@ -120,8 +134,6 @@ bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
   }
   uint8_t do_read_flag = do_read ? (1 << 6) : 0;
 
-  assert(recv_buffer_len == 0);
-
   // send whole bytes first
   size_t length_in_bytes = bulk_bits / 8;
   uint8_t buffer[256];
@@ -145,10 +157,11 @@ bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
 
       if (do_read) {
         // read immediately
-        if (!ftdi_read_retry(ftdi, &recv_buffer[recv_buffer_len], trans)) {
+        size_t recv_buffer_len = recv_buffer.size();
+        recv_buffer.resize(recv_buffer_len + trans);
+        if (!ftdi_read_full(ftdi, &recv_buffer[recv_buffer_len], trans)) {
           return false;
         }
-        recv_buffer_len += trans;
       }
 
       i += trans;
@@ -178,12 +191,13 @@ bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
     if (do_read) {
       // read immediately
       int trans = bulk_bits % 8;
-      if (!ftdi_read_retry(ftdi, &recv_buffer[recv_buffer_len], trans)) {
+      size_t recv_buffer_len = recv_buffer.size();
+      recv_buffer.resize(recv_buffer_len + trans);
+      if (!ftdi_read_full(ftdi, &recv_buffer[recv_buffer_len], trans)) {
         printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
                ftdi_get_error_string(ftdi));
         return false;
       }
-      recv_buffer_len += trans;
     }
   }
 
@@ -213,12 +227,13 @@ bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
 
     if (do_read) {
       // read immediately
-      if (!ftdi_read_retry(ftdi, &recv_buffer[recv_buffer_len], 1)) {
+      size_t recv_buffer_len = recv_buffer.size();
+      recv_buffer.resize(recv_buffer_len + 1);
+      if (!ftdi_read_full(ftdi, &recv_buffer[recv_buffer_len], 1)) {
         printf("Error @ %s:%d : %s\n", __FILE__, __LINE__,
                ftdi_get_error_string(ftdi));
         return false;
       }
-      recv_buffer_len += 1;
     }
   }
   return true;
@@ -226,28 +241,52 @@ bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
 
 bool usb_blaster_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
                                       bool flip_tms) {
+  size_t raw_bytes = usb_blaster_tdo_raw_bytes(num_bits, flip_tms);
+  assert(recv_buffer_pos + raw_bytes <= recv_buffer.size());
+  usb_blaster_decode_tdo(&recv_buffer[recv_buffer_pos], recv, num_bits,
+                         flip_tms);
+
+  // scans are received in the order they were sent
+  recv_buffer_pos += raw_bytes;
+  if (recv_buffer_pos == recv_buffer.size()) {
+    recv_buffer.clear();
+    recv_buffer_pos = 0;
+  }
+  return true;
+}
 
+size_t usb_blaster_tdo_raw_bytes(size_t num_bits, bool flip_tms) {
   size_t bulk_bits = num_bits;
   if (flip_tms) {
     // last bit should be sent along TMS 0->1
     bulk_bits -= 1;
   }
+  // a byte per byte in byte-shift mode, a byte per bit otherwise
+  return bulk_bits / 8 + bulk_bits % 8 + (flip_tms ? 1 : 0);
+}
 
-  size_t len = (bulk_bits + 7) / 8;
-  memset(recv, 0, len);
+void usb_blaster_decode_tdo(const uint8_t *raw, uint8_t *recv,
+                            size_t num_bits, bool flip_tms) {
+  size_t bulk_bits = num_bits;
+  if (flip_tms) {
+    // last bit should be sent along TMS 0->1
+    bulk_bits -= 1;
+  }
+
+  memset(recv, 0, (num_bits + 7) / 8);
 
   // read whole bytes first
   size_t offset = 0;
   size_t length_in_bytes = bulk_bits / 8;
   if (length_in_bytes) {
-    memcpy(recv, &recv_buffer[offset], length_in_bytes);
+    memcpy(recv, raw, length_in_bytes);
     offset += length_in_bytes;
   }
 
   // read rest bits
   if (bulk_bits % 8) {
     for (int i = 0; i < bulk_bits % 8; i++) {
-      uint8_t last_bit = recv_buffer[offset++];
+      uint8_t last_bit = raw[offset++];
 
       if (last_bit & 1) {
         recv[bulk_bits / 8] |= (1 << i);
@@ -257,22 +296,16 @@ bool usb_blaster_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits,
 
   // handle last bit when TMS=1
   if (flip_tms) {
-    uint8_t last_bit = recv_buffer[offset++];
+    uint8_t last_bit = raw[offset++];
 
     if (last_bit & 1) {
       recv[(num_bits - 1) / 8] |= 1 << ((num_bits - 1) % 8);
     }
   }
-
-  assert(offset == recv_buffer_len);
-  recv_buffer_len = 0;
-  return true;
 }
 
 bool usb_blaster_set_tck_freq(uint64_t freq_mhz) { return true; }
 
-bool usb_blaster_jtag_clock_tck(size_t times) { return true; }
-
 driver usb_blaster_driver = {
     .init = usb_blaster_init,
     .deinit = usb_blaster_deinit,
@@ -280,5 +313,11 @@ driver usb_blaster_driver = {
     .jtag_tms_seq = usb_blaster_jtag_tms_seq,
     .jtag_scan_chain_send = usb_blaster_jtag_scan_chain_send,
     .jtag_scan_chain_recv = usb_blaster_jtag_scan_chain_recv,
-    .jtag_clock_tck = usb_blaster_jtag_clock_tck,
+    // tck only runs while shifting
+    .jtag_clock_tck = NULL,
+    .flush = NULL,
+    .max_pending_read_bytes = 0,
+    .image_encoding = Image_USBBlaster,
+    .tdo_raw_bytes = usb_blaster_tdo_raw_bytes,
+    .decode_tdo = usb_blaster_decode_tdo,
 };
\ No newline at end of file
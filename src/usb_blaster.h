@@ -15,7 +15,11 @@ bool usb_blaster_jtag_tms_seq(const uint8_t *data, size_t num_bits);
 bool usb_blaster_jtag_scan_chain_send(const uint8_t *data, size_t num_bits,
                                 bool flip_tms, bool do_read);
 bool usb_blaster_jtag_scan_chain_recv(uint8_t *recv, size_t num_bits, bool flip_tms);
-bool usb_blaster_jtag_clock_tck(size_t times);
+
+// tdo read back from usb, used by images
+size_t usb_blaster_tdo_raw_bytes(size_t num_bits, bool flip_tms);
+void usb_blaster_decode_tdo(const uint8_t *raw, uint8_t *recv,
+                            size_t num_bits, bool flip_tms);
 
 extern driver usb_blaster_driver;
 
@@ -1,22 +1,13 @@
-#include "common.h"
+#include "vpi.h"
 
-enum JtagVpiCommand {
-  CMD_RESET,
-  CMD_TMS_SEQ,
-  CMD_SCAN_CHAIN,
-  CMD_SCAN_CHAIN_FLIP_TMS,
-  CMD_STOP_SIMU
-};
-
-struct jtag_vpi_cmd {
-  uint32_t cmd;
-  uint8_t buffer_out[512];
-  uint8_t buffer_in[512];
-  uint32_t length;
-  uint32_t nb_bits;
-};
+// commands read from the socket at once
+const size_t JTAG_VPI_MAX_CMDS = 64;
 
 bool jtag_vpi_init() {
+  // socket receive ring
+  if (!setup_socket_buffer(JTAG_VPI_MAX_CMDS * sizeof(struct jtag_vpi_cmd))) {
+    return false;
+  }
   if (!setup_tcp_server(12345)) {
     return false;
   }
@@ -24,48 +15,80 @@ bool jtag_vpi_init() {
   return true;
 }
 
-void jtag_vpi_tick() {
-  // ref jtag_vpi project jtagServer.cpp
+// scans sent to the adapter, responses written after tdo is received
+static std::vector<struct jtag_vpi_cmd> pending_scans;
+static size_t pending_recv = 0;
+static size_t pending_read_bytes = 0;
 
-  static uint8_t jtag_vpi_buffer[sizeof(struct jtag_vpi_cmd)];
-  static size_t jtag_vpi_recv = 0;
+static void jtag_vpi_recv_pending() {
+  for (; pending_recv < pending_scans.size(); pending_recv++) {
+    struct jtag_vpi_cmd *cmd = &pending_scans[pending_recv];
+    jtag_scan_chain_recv(cmd->buffer_in, cmd->nb_bits,
+                         cmd->cmd == CMD_SCAN_CHAIN_FLIP_TMS);
+  }
+  pending_read_bytes = 0;
+}
 
-  struct jtag_vpi_cmd *cmd = (struct jtag_vpi_cmd *)jtag_vpi_buffer;
+// responses in order
+static void jtag_vpi_write_pending() {
+  if (!pending_scans.empty()) {
+    jtag_vpi_recv_pending();
+    client_write((uint8_t *)pending_scans.data(),
+                 pending_scans.size() * sizeof(struct jtag_vpi_cmd));
+    pending_scans.clear();
+    pending_recv = 0;
+  }
+}
+
+void jtag_vpi_tick() {
+  // ref jtag_vpi project jtagServer.cpp
 
   if (client_fd >= 0) {
-    ssize_t num_read = read(client_fd, &jtag_vpi_buffer[jtag_vpi_recv],
-                            sizeof(jtag_vpi_cmd) - jtag_vpi_recv);
-    if (num_read > 0) {
-      jtag_vpi_recv += num_read;
-    } else if (num_read == 0) {
-      // remote socket closed
-      printf("JTAG debugger detached\n");
-      close(client_fd);
-      client_fd = -1;
+    // drain every command already waiting on the socket
+    do {
+      if (!read_socket()) {
+        // the adapter stays initialized for the next client
+        return;
+      }
+    } while (buffer_end - buffer_begin < buffer_size &&
+             client_readable(0));
 
-      // reset adapter
-      adapter_deinit();
-    }
+    // queue all complete commands, partial command stays for next tick
+    while (buffer_begin + sizeof(struct jtag_vpi_cmd) <= buffer_end) {
+      struct jtag_vpi_cmd cmd;
+      memcpy(&cmd, &buffer[buffer_begin], sizeof(cmd));
+      buffer_begin += sizeof(struct jtag_vpi_cmd);
 
-    if (jtag_vpi_recv == sizeof(struct jtag_vpi_cmd)) {
-      // cmd valid
-      jtag_vpi_recv = 0;
-      memset(cmd->buffer_in, 0, sizeof(cmd->buffer_in));
-      if (cmd->cmd == CMD_RESET) {
+      memset(cmd.buffer_in, 0, sizeof(cmd.buffer_in));
+      if (cmd.nb_bits > sizeof(cmd.buffer_out) * 8) {
+        // the client waits for a response that can not be given, answer
+        // the scans before it and drop the client
+        printf("Unexpected jtag_vpi length %d, closing client\n",
+               cmd.nb_bits);
+        jtag_vpi_write_pending();
+        client_close();
+        return;
+      }
+
+      if (cmd.cmd == CMD_RESET) {
         jtag_goto_tlr();
-      } else if (cmd->cmd == CMD_TMS_SEQ) {
-        jtag_tms_seq(cmd->buffer_out, cmd->nb_bits);
-      } else if (cmd->cmd == CMD_SCAN_CHAIN) {
-        // always read
-        jtag_scan_chain(cmd->buffer_out, cmd->buffer_in, cmd->nb_bits, false, true);
-        write_full(client_fd, jtag_vpi_buffer, sizeof(struct jtag_vpi_cmd));
-      } else if (cmd->cmd == CMD_SCAN_CHAIN_FLIP_TMS) {
+      } else if (cmd.cmd == CMD_TMS_SEQ) {
+        jtag_tms_seq(cmd.buffer_out, cmd.nb_bits);
+      } else if (cmd.cmd == CMD_SCAN_CHAIN ||
+                 cmd.cmd == CMD_SCAN_CHAIN_FLIP_TMS) {
         // always read
-        jtag_scan_chain(cmd->buffer_out, cmd->buffer_in, cmd->nb_bits, true, true);
-        write_full(client_fd, jtag_vpi_buffer, sizeof(struct jtag_vpi_cmd));
+        jtag_scan_chain_send(cmd.buffer_out, cmd.nb_bits,
+                             cmd.cmd == CMD_SCAN_CHAIN_FLIP_TMS, true);
+        pending_scans.push_back(cmd);
+        pending_read_bytes += (cmd.nb_bits + 7) / 8;
+        if (pending_read_bytes >= adapter_max_pending_read_bytes()) {
+          jtag_vpi_recv_pending();
+        }
       }
     }
+
+    jtag_vpi_write_pending();
   } else {
     try_accept();
   }
-}
\ No newline at end of file
+}
@@ -1,7 +1,25 @@
 #ifndef __VPI_H__
 #define __VPI_H__
 
-void jtag_vpi_init();
+#include "common.h"
+
+enum JtagVpiCommand {
+  CMD_RESET,
+  CMD_TMS_SEQ,
+  CMD_SCAN_CHAIN,
+  CMD_SCAN_CHAIN_FLIP_TMS,
+  CMD_STOP_SIMU
+};
+
+struct jtag_vpi_cmd {
+  uint32_t cmd;
+  uint8_t buffer_out[512];
+  uint8_t buffer_in[512];
+  uint32_t length;
+  uint32_t nb_bits;
+};
+
+bool jtag_vpi_init();
 void jtag_vpi_tick();
 
 #endif
\ No newline at end of file
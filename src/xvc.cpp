@@ -41,7 +41,13 @@ static int swrite(int fd, char *target, int len) {
   return 0;
 }
 
+// socket receive ring, large enough for a whole tdi vector
+const size_t XVC_SOCKET_BUFFER_SIZE = 1 << 20;
+
 bool jtag_xvc_init() {
+  if (!setup_socket_buffer(XVC_SOCKET_BUFFER_SIZE)) {
+    return false;
+  }
   if (!setup_tcp_server(2542)) {
     return false;
   }
@@ -50,34 +56,214 @@ bool jtag_xvc_init() {
   return true;
 }
 
-struct ShiftCommand {
-  uint32_t bits;
-  uint32_t bytes;
-  std::vector<Region> regions;
+// largest shift vector in bytes advertised to the client
+const uint32_t XVC_MAX_VECTOR_LEN = 1 << 20;
+
+// bits sent to the adapter at a time while tdi is still arriving
+const size_t XVC_CHUNK_BITS = MAX_PENDING_READ_BYTES * 8;
+
+// shift command is parsed while it arrives:
+// tms is collected first, then tdi is streamed to the adapter
+enum XvcParseState {
+  XVC_COMMAND,
+  XVC_SHIFT_TMS,
+  XVC_SHIFT_TDI,
 };
 
-char tms[BUFFER_SIZE];
-char tdi[BUFFER_SIZE];
-uint8_t tdo[BUFFER_SIZE] = {};
+// begin and end are bit positions in tdo
+struct PendingChunk {
+  size_t begin;
+  size_t end;
+  bool flip_tms;
+};
+
+static XvcParseState parse_state = XVC_COMMAND;
+static uint32_t shift_bits;
+static uint32_t shift_bytes;
+static size_t shift_received;
+static std::vector<uint8_t> tms;
+static std::vector<uint8_t> tdi;
+// tdo of completed shifts not written yet, followed by the current shift
+// at byte tdo_offset
+static std::vector<uint8_t> tdo;
+static size_t tdo_offset;
+static std::vector<uint8_t> chunk_buffer;
+
+// regions of current shift command
+static std::vector<Region> regions;
+static size_t region_index;
+static size_t region_pos;
+
+// chunks sent with read, tdo not received yet
+static std::vector<PendingChunk> pending_chunks;
+static size_t pending_read_bytes;
+
+static void xvc_recv_pending() {
+  for (auto &chunk : pending_chunks) {
+    size_t len = chunk.end - chunk.begin;
+    chunk_buffer.assign((len + 7) / 8, 0);
+    jtag_scan_chain_recv(chunk_buffer.data(), len, chunk.flip_tms);
+    copy_bits(tdo.data(), chunk.begin, chunk_buffer.data(), 0, len);
+  }
+  pending_chunks.clear();
+  pending_read_bytes = 0;
+}
+
+// write tdo of completed shifts, in order before any other reply
+static bool xvc_write_tdo() {
+  if (tdo_offset == 0) {
+    return true;
+  }
+  xvc_recv_pending();
+  bool ok = client_write(tdo.data(), tdo_offset);
+  tdo.erase(tdo.begin(), tdo.begin() + tdo_offset);
+  tdo_offset = 0;
+  return ok;
+}
+
+// drop the client along with tdo still in flight
+static void xvc_close() {
+  xvc_recv_pending();
+  tdo.clear();
+  tdo_offset = 0;
+  parse_state = XVC_COMMAND;
+  client_close();
+}
+
+// execute regions whose tdi has arrived
+static void xvc_shift_execute(size_t available_bits) {
+  while (region_index < regions.size()) {
+    Region &region = regions[region_index];
+    if (region.is_tms) {
+      dprintf("[%d:%d]: TMS\n", region.begin, region.end);
+      chunk_buffer.assign((region.length() + 7) / 8, 0);
+      // optimize runtest with a large number of cycles
+      bool clock_only = state == JtagState::RunTestIdle;
+      for (int i = region.begin; i < region.end; i++) {
+        uint8_t tms_bit = (tms[i / 8] >> (i % 8)) & 0x1;
+        int off = i - region.begin;
+        chunk_buffer[off / 8] |= tms_bit << (off % 8);
+        if (tms_bit) {
+          clock_only = false;
+        }
+      }
+      if (clock_only) {
+        jtag_tms_seq(chunk_buffer.data(), 1);
+        jtag_clock_tck(region.length() - 1);
+      } else {
+        jtag_tms_seq(chunk_buffer.data(), region.length());
+      }
+
+      region_index++;
+      if (region_index < regions.size()) {
+        region_pos = regions[region_index].begin;
+      }
+      continue;
+    }
+
+    size_t end = std::min((size_t)region.end, region_pos + XVC_CHUNK_BITS);
+    if (end > available_bits) {
+      // wait for a full chunk or the end of region
+      break;
+    }
+
+    dprintf("[%zu:%zu]: DATA\n", region_pos, end);
+    bool last = end == (size_t)region.end;
+    size_t len = end - region_pos;
+    chunk_buffer.assign((len + 7) / 8, 0);
+    copy_bits(chunk_buffer.data(), 0, tdi.data(), region_pos, len);
+
+    // send here, recv later
+    bool flip_tms = last && region.flip_tms;
+    jtag_scan_chain_send(chunk_buffer.data(), len, flip_tms, true);
+    PendingChunk chunk;
+    chunk.begin = tdo_offset * 8 + region_pos;
+    chunk.end = tdo_offset * 8 + end;
+    chunk.flip_tms = flip_tms;
+    pending_chunks.push_back(chunk);
+    pending_read_bytes += (len + 7) / 8;
+    if (pending_read_bytes >= adapter_max_pending_read_bytes()) {
+      xvc_recv_pending();
+    }
+
+    region_pos = end;
+    if (last) {
+      region_index++;
+      if (region_index < regions.size()) {
+        region_pos = regions[region_index].begin;
+      }
+    }
+  }
+}
+
+// copy as much of the current vector as available from socket buffer
+static bool xvc_receive_vector(std::vector<uint8_t> &vec) {
+  size_t len = std::min(buffer_end - buffer_begin,
+                        (size_t)shift_bytes - shift_received);
+  memcpy(&vec[shift_received], &buffer[buffer_begin], len);
+  buffer_begin += len;
+  shift_received += len;
+  return shift_received == shift_bytes;
+}
+
 void jtag_xvc_tick() {
   if (client_fd >= 0) {
     if (!read_socket()) {
+      // tdo already requested from the adapter has to be drained, or the
+      // next client reads it
+      xvc_recv_pending();
+      tdo.clear();
+      tdo_offset = 0;
+      parse_state = XVC_COMMAND;
       return;
     }
 
     // parse & execute commands
-    std::vector<ShiftCommand> shift_commands;
     while (true) {
       static size_t getinfo_len = strlen("getinfo:");
       static size_t settck_len = strlen("settck:");
       static size_t shift_len = strlen("shift:");
-      if (buffer_begin + getinfo_len <= buffer_end &&
-          memcmp(&buffer[buffer_begin], "getinfo:", getinfo_len) == 0) {
+      if (parse_state == XVC_SHIFT_TMS) {
+        if (!xvc_receive_vector(tms)) {
+          break;
+        }
+
+        dprintf(" tms:");
+        print_bitvec(tms.data(), shift_bits);
+        dprintf("\n");
+
+        JtagState cur_state = state;
+        regions = analyze_bitbang(tms.data(), shift_bits, cur_state);
+        region_index = 0;
+        region_pos = regions.empty() ? 0 : regions[0].begin;
+        shift_received = 0;
+        parse_state = XVC_SHIFT_TDI;
+      } else if (parse_state == XVC_SHIFT_TDI) {
+        bool complete = xvc_receive_vector(tdi);
+        xvc_shift_execute(std::min((size_t)shift_bits, shift_received * 8));
+        if (!complete) {
+          break;
+        }
+
+        // tdo is read back once the commands already received are sent
+        assert(region_index == regions.size());
+        dprintf(" tdi:");
+        print_bitvec(tdi.data(), shift_bits);
+        dprintf("\n");
+        tdo_offset += shift_bytes;
+        parse_state = XVC_COMMAND;
+      } else if (buffer_begin + getinfo_len <= buffer_end &&
+                 memcmp(&buffer[buffer_begin], "getinfo:", getinfo_len) == 0) {
         // getinfo
         dprintf("getinfo:\n");
         buffer_begin += getinfo_len;
-        char info[] = "xvcServer_v1.0:2048\n";
-        assert(write_full(client_fd, (uint8_t *)info, strlen(info)));
+        char info[64];
+        snprintf(info, sizeof(info), "xvcServer_v1.0:%u\n",
+                 XVC_MAX_VECTOR_LEN);
+        if (!xvc_write_tdo() || !client_write((uint8_t *)info, strlen(info))) {
+          xvc_close();
+          return;
+        }
       } else if (buffer_begin + settck_len + sizeof(uint32_t) <= buffer_end &&
                  memcmp(&buffer[buffer_begin], "settck:", settck_len) == 0) {
         dprintf("settck:");
@@ -88,110 +274,46 @@ void jtag_xvc_tick() {
         dprintf("%d\n", tck);
         buffer_begin += settck_len + sizeof(uint32_t);
 
+        if (!xvc_write_tdo()) {
+          xvc_close();
+          return;
+        }
         uint64_t freq_mhz = round(1000.0 / tck);
         adapter_set_tck_freq(freq_mhz);
-        assert(write_full(client_fd, (uint8_t *)&tck, sizeof(tck)));
+        if (!client_write((uint8_t *)&tck, sizeof(tck))) {
+          xvc_close();
+          return;
+        }
       } else if (buffer_begin + shift_len + sizeof(uint32_t) <= buffer_end &&
                  memcmp(&buffer[buffer_begin], "shift:", shift_len) == 0) {
         dprintf("shift:\n");
         uint32_t bits = 0;
         memcpy(&bits, &buffer[buffer_begin + shift_len], sizeof(uint32_t));
+        buffer_begin += shift_len + sizeof(uint32_t);
 
         uint32_t bytes = (bits + 7) / 8;
-        uint32_t total_len = shift_len + sizeof(uint32_t) + 2 * bytes;
-        if (buffer_begin + total_len > buffer_end) {
-          break;
+        if (bytes > XVC_MAX_VECTOR_LEN) {
+          printf("Shift of %u bits exceeds vector length\n", bits);
+          xvc_close();
+          return;
         }
-        memcpy(tms, &buffer[buffer_begin + shift_len + sizeof(uint32_t)],
-               bytes);
-        memcpy(tdi,
-               &buffer[buffer_begin + shift_len + sizeof(uint32_t) + bytes],
-               bytes);
-        buffer_begin += total_len;
-
-        dprintf(" tms:");
-        print_bitvec((unsigned char *)tms, bits);
-        dprintf("\n");
-        dprintf(" tdi:");
-        print_bitvec((unsigned char *)tdi, bits);
-        dprintf("\n");
 
-        // send tms & read
-        JtagState cur_state = state;
-        std::vector<Region> regions =
-            analyze_bitbang((uint8_t *)tms, bits, cur_state);
-
-        for (auto region : regions) {
-          assert(region.begin < region.end && region.end <= bits);
-          dprintf("[%d:%d]: %s\n", region.begin, region.end,
-                  region.is_tms ? "TMS" : "DATA");
-          if (region.is_tms) {
-            uint8_t tms_buffer[BUFFER_SIZE] = {};
-            // optimize runtest with a large number of cycles
-            bool clock_only = state == JtagState::RunTestIdle;
-            for (int i = region.begin; i < region.end; i++) {
-              uint8_t tms_bit = (tms[i / 8] >> (i % 8)) & 0x1;
-              int off = i - region.begin;
-              tms_buffer[off / 8] |= tms_bit << (off % 8);
-              if (tms_bit) {
-                clock_only = false;
-              }
-            }
-            if (clock_only) {
-              jtag_tms_seq(tms_buffer, 1);
-              jtag_clock_tck(region.length() - 1);
-            } else {
-              jtag_tms_seq(tms_buffer, region.length());
-            }
-          } else {
-            uint8_t tdi_buffer[BUFFER_SIZE] = {};
-            for (int i = region.begin; i < region.end; i++) {
-              uint8_t tdi_bit = (tdi[i / 8] >> (i % 8)) & 0x1;
-              int off = i - region.begin;
-              tdi_buffer[off / 8] |= tdi_bit << (off % 8);
-            }
-
-            // send here, recv later
-            jtag_scan_chain_send(tdi_buffer, region.length(), region.flip_tms,
-                                 true);
-          }
-        }
-        assert(cur_state == state);
-
-        // save shift command for recv below
-        ShiftCommand shift_command;
-        shift_command.bits = bits;
-        shift_command.bytes = bytes;
-        shift_command.regions = regions;
-        shift_commands.push_back(shift_command);
+        shift_bits = bits;
+        shift_bytes = bytes;
+        shift_received = 0;
+        tms.assign(bytes, 0);
+        tdi.assign(bytes, 0);
+        tdo.resize(tdo_offset + bytes, 0);
+        parse_state = XVC_SHIFT_TMS;
       } else {
         // can not parse
         break;
       }
     }
-
-    // read result back
-    for (auto &shift_command : shift_commands) {
-      memset(tdo, 0, shift_command.bytes);
-      for (auto region : shift_command.regions) {
-        if (!region.is_tms) {
-          uint8_t tdo_buffer[BUFFER_SIZE] = {};
-          jtag_scan_chain_recv(tdo_buffer, region.length(), region.flip_tms);
-
-          for (int i = region.begin; i < region.end; i++) {
-            int off = i - region.begin;
-            uint8_t tdo_bit = (tdo_buffer[off / 8] >> (off % 8)) & 0x1;
-            tdo[i / 8] |= tdo_bit << (i % 8);
-          }
-        }
-      }
-
-      dprintf(" tdo:");
-      print_bitvec(tdo, shift_command.bits);
-      dprintf("\n");
-      assert(write_full(client_fd, tdo, shift_command.bytes));
+    if (!xvc_write_tdo()) {
+      xvc_close();
     }
   } else {
     try_accept();
   }
-}
\ No newline at end of file
+}
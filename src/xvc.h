@@ -1,7 +1,7 @@
 #ifndef __XVC_H__
 #define __XVC_H__
 
-void jtag_xvc_init();
+bool jtag_xvc_init();
 void jtag_xvc_tick();
 
 #endif
\ No newline at end of file